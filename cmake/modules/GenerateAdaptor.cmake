@@ -0,0 +1,248 @@
+# Generates the property tables, a typed view and the buffer builders of a domain type adaptor.
+#
+# Invoked by generate_adaptors() as script:
+#   cmake -DSPEC=<name>.adaptor -DSOURCE_DIR=<source root> -DOUTPUT=<name>_adaptor_generated.h -P GenerateAdaptor.cmake
+#
+# The spec maps the properties of a domain type to the tables of the resource and the local schema:
+#   name <Name>
+#   resource <schema.fbs relative to the source root> <property>...
+#   local <schema.fbs relative to the source root> <property>...
+# A property is read from the resource buffer if it is mapped there, and from the local buffer otherwise.
+
+if (POLICY CMP0054)
+    cmake_policy(SET CMP0054 NEW)
+endif()
+
+function(fail message)
+    message(FATAL_ERROR "${SPEC}: ${message}")
+endfunction()
+
+# Reads the root table of @schema and the types of its fields
+function(parse_schema schema prefix)
+    if (NOT EXISTS "${schema}")
+        fail("Schema ${schema} does not exist")
+    endif()
+    file(READ "${schema}" content)
+    string(REGEX REPLACE "//[^\n]*" "" content "${content}")
+
+    string(REGEX MATCH "namespace[ \t\n]+([A-Za-z0-9_.]+)[ \t\n]*;" _ "${content}")
+    string(REPLACE "." "::" namespace "${CMAKE_MATCH_1}")
+    string(REGEX MATCH "root_type[ \t\n]+([A-Za-z0-9_]+)[ \t\n]*;" _ "${content}")
+    set(table "${CMAKE_MATCH_1}")
+    if (NOT table)
+        fail("${schema} has no root_type")
+    endif()
+    string(REGEX MATCH "table[ \t\n]+${table}[ \t\n]*{([^}]*)}" _ "${content}")
+    set(body "${CMAKE_MATCH_1}")
+
+    get_filename_component(header "${schema}" NAME_WE)
+    set(fields)
+    string(REGEX MATCHALL "[A-Za-z0-9_]+[ \t\n]*:[ \t\n]*[^;]+;" declarations "${body}")
+    foreach(declaration ${declarations})
+        string(REGEX MATCH "([A-Za-z0-9_]+)[ \t\n]*:[ \t\n]*(\\[[A-Za-z0-9_]+\\]|[A-Za-z0-9_]+)" _ "${declaration}")
+        list(APPEND fields "${CMAKE_MATCH_1}")
+        set(${prefix}_type_${CMAKE_MATCH_1} "${CMAKE_MATCH_2}" PARENT_SCOPE)
+    endforeach()
+
+    if (namespace)
+        set(${prefix}_class "${namespace}::${table}" PARENT_SCOPE)
+    else()
+        set(${prefix}_class "${table}" PARENT_SCOPE)
+    endif()
+    set(${prefix}_header "${header}_generated.h" PARENT_SCOPE)
+    set(${prefix}_fields "${fields}" PARENT_SCOPE)
+endfunction()
+
+# Maps a schema type to the kind of property and the C++ type of scalars
+function(property_kind type kindVar cppTypeVar)
+    set(kind "")
+    set(cppType "")
+    if (type STREQUAL "string")
+        set(kind "string")
+    elseif (type STREQUAL "[ubyte]" OR type STREQUAL "[byte]")
+        set(kind "bytes")
+    elseif (type MATCHES "^(bool|byte|ubyte|short|ushort|int|uint|long|ulong)$")
+        set(kind "integer")
+        set(bool bool)
+        set(byte int8_t)
+        set(ubyte uint8_t)
+        set(short int16_t)
+        set(ushort uint16_t)
+        set(int int32_t)
+        set(uint uint32_t)
+        set(long int64_t)
+        set(ulong uint64_t)
+        set(cppType "${${type}}")
+    endif()
+    set(${kindVar} "${kind}" PARENT_SCOPE)
+    set(${cppTypeVar} "${cppType}" PARENT_SCOPE)
+endfunction()
+
+# The accessor of @property in the table of @prefix, for use in the property table and the view
+function(accessors prefix property declarationVar viewVar)
+    set(class "${${prefix}_class}")
+    property_kind("${${prefix}_type_${property}}" kind cppType)
+    if (kind STREQUAL "string")
+        set(${declarationVar} "stringProperty<${class}, &${class}::${property}>(\"${property}\")" PARENT_SCOPE)
+        set(${viewVar} "viewFromString<${class}, &${class}::${property}>" PARENT_SCOPE)
+    elseif (kind STREQUAL "bytes")
+        set(${declarationVar} "bytesProperty<${class}, &${class}::${property}>(\"${property}\")" PARENT_SCOPE)
+        set(${viewVar} "viewFromBytes<${class}, &${class}::${property}>" PARENT_SCOPE)
+    elseif (kind STREQUAL "integer")
+        set(${declarationVar} "integerProperty<${class}, ${cppType}, &${class}::${property}>(\"${property}\")" PARENT_SCOPE)
+        set(${viewVar} "integerFromField<${class}, ${cppType}, &${class}::${property}>" PARENT_SCOPE)
+    else()
+        fail("Property ${property} of ${class} has the unsupported type ${${prefix}_type_${property}}")
+    endif()
+endfunction()
+
+# The builder function of the table of @prefix, writing the properties in @properties
+function(builder prefix name properties outputVar)
+    set(class "${${prefix}_class}")
+    string(REGEX REPLACE "::[A-Za-z0-9_]+$" "" namespace "${class}")
+    string(REGEX REPLACE "^.*::" "" table "${class}")
+    if (namespace STREQUAL class)
+        set(builderClass "${table}Builder")
+    else()
+        set(builderClass "${namespace}::${table}Builder")
+    endif()
+
+    set(code "/**\n * Builds the ${table} buffer from the properties of @param object that are read from it.\n */\n")
+    set(code "${code}template<typename Object>\nflatbuffers::Offset<${class}> create${name}${prefix}Buffer(flatbuffers::FlatBufferBuilder &fbb, const Object &object)\n{\n")
+    set(adds "")
+    foreach(property ${properties})
+        property_kind("${${prefix}_type_${property}}" kind cppType)
+        set(code "${code}    const QVariant ${property}Value = object.getProperty(\"${property}\");\n")
+        if (kind STREQUAL "string")
+            set(code "${code}    flatbuffers::Offset<flatbuffers::String> ${property};\n    if (${property}Value.isValid()) {\n        const QByteArray utf8 = ${property}Value.toString().toUtf8();\n        ${property} = fbb.CreateString(utf8.constData(), utf8.size());\n    }\n")
+            set(adds "${adds}    builder.add_${property}(${property});\n")
+        elseif (kind STREQUAL "bytes")
+            set(code "${code}    flatbuffers::Offset<flatbuffers::Vector<uint8_t> > ${property};\n    if (${property}Value.isValid()) {\n        const QByteArray bytes = ${property}Value.toByteArray();\n        ${property} = fbb.CreateVector(reinterpret_cast<const uint8_t*>(bytes.constData()), bytes.size());\n    }\n")
+            set(adds "${adds}    builder.add_${property}(${property});\n")
+        else()
+            set(adds "${adds}    if (${property}Value.isValid()) {\n        builder.add_${property}(static_cast<${cppType}>(${property}Value.toLongLong()));\n    }\n")
+        endif()
+    endforeach()
+    set(code "${code}    ${builderClass} builder(fbb);\n${adds}    return builder.Finish();\n}\n")
+    set(${outputVar} "${code}" PARENT_SCOPE)
+endfunction()
+
+if (NOT SPEC OR NOT OUTPUT OR NOT SOURCE_DIR)
+    message(FATAL_ERROR "Usage: cmake -DSPEC=<spec> -DSOURCE_DIR=<dir> -DOUTPUT=<header> -P GenerateAdaptor.cmake")
+endif()
+
+file(STRINGS "${SPEC}" lines)
+set(adaptorName "")
+set(Resource_properties)
+set(Local_properties)
+foreach(line ${lines})
+    string(STRIP "${line}" line)
+    set(keyword "")
+    if (NOT line STREQUAL "" AND NOT line MATCHES "^#")
+        string(REGEX REPLACE "[ \t]+" ";" words "${line}")
+        list(GET words 0 keyword)
+        list(REMOVE_AT words 0)
+    endif()
+    if (keyword STREQUAL "")
+        # Empty line or comment
+    elseif (keyword STREQUAL "name")
+        list(GET words 0 adaptorName)
+    elseif (keyword STREQUAL "resource" OR keyword STREQUAL "local")
+        if (keyword STREQUAL "resource")
+            set(prefix Resource)
+        else()
+            set(prefix Local)
+        endif()
+        list(GET words 0 schema)
+        list(REMOVE_AT words 0)
+        parse_schema("${SOURCE_DIR}/${schema}" ${prefix})
+        foreach(property ${words})
+            list(FIND ${prefix}_fields "${property}" index)
+            if (index LESS 0)
+                fail("${${prefix}_class} has no field ${property}")
+            endif()
+        endforeach()
+        set(${prefix}_properties ${words})
+    else()
+        fail("Unknown keyword ${keyword}")
+    endif()
+endforeach()
+
+if (NOT adaptorName OR NOT Resource_class OR NOT Local_class)
+    fail("The spec needs a name, a resource and a local schema")
+endif()
+
+get_filename_component(specName "${SPEC}" NAME)
+set(code "// Generated from ${specName} by GenerateAdaptor.cmake, do not edit.\n\n#pragma once\n\n")
+set(code "${code}#include \"common/domainadaptor.h\"\n#include \"${Resource_header}\"\n")
+if (NOT Local_header STREQUAL Resource_header)
+    set(code "${code}#include \"${Local_header}\"\n")
+endif()
+
+# The property tables, from which the mappers resolve the property ids
+foreach(prefix Resource Local)
+    set(code "${code}\nstatic constexpr PropertyMapper<${${prefix}_class}>::Property ${adaptorName}${prefix}Properties[] = {\n")
+    set(entries)
+    foreach(property ${${prefix}_properties})
+        accessors(${prefix} ${property} declaration view)
+        list(APPEND entries "    ${declaration}")
+    endforeach()
+    string(REPLACE ";" ",\n" entries "${entries}")
+    set(code "${code}${entries}\n};\n")
+endforeach()
+
+set(code "${code}\ntypedef GenericBufferAdaptor<${Local_class}, ${Resource_class}> ${adaptorName}Adaptor;\n")
+
+# The typed view reads the fields directly, without looking up the property
+set(code "${code}\n/**\n * Typed access to the properties of a ${adaptorName}, directly from its buffers.\n *\n * The returned views point into the buffers, and are only valid as long as the buffers are.\n */\n")
+set(code "${code}class ${adaptorName}View\n{\npublic:\n    ${adaptorName}View(${Local_class} const *local, ${Resource_class} const *resource)\n        : mLocal(local),\n        mResource(resource)\n    {\n    }\n")
+set(properties ${Resource_properties} ${Local_properties})
+list(REMOVE_DUPLICATES properties)
+foreach(property ${properties})
+    list(FIND Resource_properties "${property}" inResource)
+    list(FIND Local_properties "${property}" inLocal)
+    if (inResource GREATER -1)
+        property_kind("${Resource_type_${property}}" kind cppType)
+    else()
+        property_kind("${Local_type_${property}}" kind cppType)
+    endif()
+    if (kind STREQUAL "integer")
+        set(returnType "qint64")
+        set(missing "0")
+    else()
+        set(returnType "Akonadi2::Domain::PropertyView")
+        set(missing "Akonadi2::Domain::PropertyView()")
+    endif()
+    set(code "${code}\n    ${returnType} ${property}() const\n    {\n")
+    if (inResource GREATER -1)
+        accessors(Resource ${property} declaration view)
+        set(code "${code}        if (mResource) {\n            return ${view}(mResource);\n        }\n")
+    endif()
+    if (inLocal GREATER -1)
+        accessors(Local ${property} declaration view)
+        set(code "${code}        if (mLocal) {\n            return ${view}(mLocal);\n        }\n")
+    endif()
+    set(code "${code}        return ${missing};\n    }\n")
+endforeach()
+set(code "${code}\nprivate:\n    ${Local_class} const *mLocal;\n    ${Resource_class} const *mResource;\n};\n")
+
+# The builders write each property only to the buffer it is read from
+builder(Resource ${adaptorName} "${Resource_properties}" resourceBuilder)
+set(localOnly)
+foreach(property ${Local_properties})
+    list(FIND Resource_properties "${property}" inResource)
+    if (inResource LESS 0)
+        list(APPEND localOnly ${property})
+    endif()
+endforeach()
+builder(Local ${adaptorName} "${localOnly}" localBuilder)
+set(code "${code}\n${resourceBuilder}\n${localBuilder}")
+
+# Only touch the output if it changed, so dependent sources are not rebuilt needlessly
+if (EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" previous)
+    if (previous STREQUAL code)
+        return()
+    endif()
+endif()
+file(WRITE "${OUTPUT}" "${code}")
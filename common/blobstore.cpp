@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "blobstore.h"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QHash>
+#include <QVector>
+#include <cstring>
+
+namespace Akonadi2
+{
+
+//The blobs and their reference counts are stored under their reference with a prefix, so the counts can be scanned without touching the blobs
+static QByteArray blobKey(const QByteArray &reference)
+{
+    return "b" + reference;
+}
+
+static QByteArray countKey(const QByteArray &reference)
+{
+    return "r" + reference;
+}
+
+static void ignoreError(const Storage::Error &)
+{
+    //Missing keys are reported as errors
+}
+
+BlobStore::BlobStore(const QString &storageRoot, const QString &resourceName, Storage::AccessMode mode)
+    : mStorageRoot(storageRoot),
+    mName(resourceName + ".blobs"),
+    mMode(mode)
+{
+}
+
+Storage *BlobStore::storage() const
+{
+    //A read-only storage that didn't exist when it was opened stays closed, so it is opened again until it exists
+    if (!mStorage || !mStorage->exists()) {
+        mStorage.reset(new Storage(mStorageRoot, mName, mMode));
+    }
+    return mStorage->exists() ? mStorage.data() : nullptr;
+}
+
+QByteArray BlobStore::reference(const char *data, int size)
+{
+    return QCryptographicHash::hash(QByteArray::fromRawData(data, size), QCryptographicHash::Sha256).toHex();
+}
+
+qint64 BlobStore::readReferenceCount(Storage &storage, const QByteArray &reference) const
+{
+    const QByteArray key = countKey(reference);
+    qint64 count = 0;
+    storage.scan(key.constData(), key.size(), [&count](void *, int, void *value, int valueSize) -> bool {
+        if (valueSize == sizeof(count)) {
+            std::memcpy(&count, value, sizeof(count));
+        }
+        return false;
+    }, &ignoreError);
+    return count;
+}
+
+qint64 BlobStore::referenceCount(const QByteArray &reference)
+{
+    QMutexLocker locker(&mMutex);
+    auto store = storage();
+    return store ? readReferenceCount(*store, reference) : 0;
+}
+
+QByteArray BlobStore::add(const char *data, int size)
+{
+    const QByteArray ref = reference(data, size);
+    const QByteArray key = blobKey(ref);
+
+    QMutexLocker locker(&mMutex);
+    auto store = storage();
+    if (!store) {
+        qWarning() << "Failed to open the blob store " << mName;
+        return QByteArray();
+    }
+    store->startTransaction(Storage::ReadWrite);
+    //A blob without references is kept until it is collected, so it can be referenced again without writing it
+    bool stored = false;
+    store->scan(key.constData(), key.size(), [&stored](void *, int, void *, int) -> bool {
+        stored = true;
+        return false;
+    }, &ignoreError);
+    if (!stored) {
+        store->write(key.constData(), key.size(), data, size);
+    }
+    const qint64 count = readReferenceCount(*store, ref) + 1;
+    const QByteArray refs = countKey(ref);
+    store->write(refs.constData(), refs.size(), &count, sizeof(count));
+    store->commitTransaction();
+    return ref;
+}
+
+void BlobStore::release(const QByteArray &reference)
+{
+    QMutexLocker locker(&mMutex);
+    auto store = storage();
+    if (!store) {
+        return;
+    }
+    store->startTransaction(Storage::ReadWrite);
+    const qint64 count = readReferenceCount(*store, reference) - 1;
+    if (count < 0) {
+        qWarning() << "Released a blob without references: " << reference;
+    } else {
+        const QByteArray refs = countKey(reference);
+        store->write(refs.constData(), refs.size(), &count, sizeof(count));
+    }
+    store->commitTransaction();
+}
+
+QByteArray BlobStore::read(const QByteArray &reference)
+{
+    const QByteArray key = blobKey(reference);
+    QByteArray blob;
+    QMutexLocker locker(&mMutex);
+    auto store = storage();
+    if (!store) {
+        return blob;
+    }
+    store->scan(key.constData(), key.size(), [&blob](void *, int, void *value, int valueSize) -> bool {
+        blob = QByteArray(static_cast<const char *>(value), valueSize);
+        return false;
+    }, &ignoreError);
+    return blob;
+}
+
+qint64 BlobStore::collectGarbage()
+{
+    QMutexLocker locker(&mMutex);
+    auto store = storage();
+    if (!store) {
+        return 0;
+    }
+    store->startTransaction(Storage::ReadWrite);
+    QVector<QByteArray> unreferenced;
+    store->scanFrom("r", [&unreferenced](void *keyPtr, int keySize, void *value, int valueSize) -> bool {
+        const QByteArray key(static_cast<const char *>(keyPtr), keySize);
+        if (!key.startsWith('r')) {
+            return false;
+        }
+        qint64 count = 0;
+        if (valueSize == sizeof(count)) {
+            std::memcpy(&count, value, sizeof(count));
+        }
+        if (count <= 0) {
+            unreferenced << key.mid(1);
+        }
+        return true;
+    }, Storage::basicErrorHandler());
+    for (const auto &reference : unreferenced) {
+        const QByteArray blob = blobKey(reference);
+        const QByteArray refs = countKey(reference);
+        store->remove(blob.constData(), blob.size());
+        store->remove(refs.constData(), refs.size());
+    }
+    store->commitTransaction();
+    return unreferenced.size();
+}
+
+BlobStore::Statistics BlobStore::statistics()
+{
+    Statistics statistics;
+    QHash<QByteArray, qint64> sizes;
+    QMutexLocker locker(&mMutex);
+    auto store = storage();
+    if (!store) {
+        return statistics;
+    }
+    store->startTransaction(Storage::ReadOnly);
+    //Only the size of the blobs is needed, so their pages aren't read
+    store->scanFrom("b", [&](void *keyPtr, int keySize, void *, int valueSize) -> bool {
+        const QByteArray key(static_cast<const char *>(keyPtr), keySize);
+        if (!key.startsWith('b')) {
+            return false;
+        }
+        sizes.insert(key.mid(1), valueSize);
+        statistics.blobs++;
+        statistics.storedBytes += valueSize;
+        return true;
+    }, &ignoreError);
+    store->scanFrom("r", [&](void *keyPtr, int keySize, void *value, int valueSize) -> bool {
+        const QByteArray key(static_cast<const char *>(keyPtr), keySize);
+        if (!key.startsWith('r')) {
+            return false;
+        }
+        qint64 count = 0;
+        if (valueSize == sizeof(count)) {
+            std::memcpy(&count, value, sizeof(count));
+        }
+        if (count > 0) {
+            statistics.references += count;
+            statistics.referencedBytes += count * sizes.value(key.mid(1));
+        }
+        return true;
+    }, &ignoreError);
+    store->abortTransaction();
+    return statistics;
+}
+
+qint64 BlobStore::diskUsage() const
+{
+    QMutexLocker locker(&mMutex);
+    auto store = storage();
+    return store ? store->diskUsage() : 0;
+}
+
+} // namespace Akonadi2
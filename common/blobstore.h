@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <akonadi2common_export.h>
+#include <QByteArray>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QString>
+
+#include "storage.h"
+
+namespace Akonadi2
+{
+
+/**
+ * A content addressed store for large property values, so entities only have to hold a reference to them.
+ *
+ * Scanning, verifying and copying entities then no longer touches the large values, which are only read when they are accessed.
+ * Each value is stored once, with a count of the references to it. Values without references are removed by collectGarbage.
+ *
+ * The blobs of a resource are stored in the storage "<resourceName>.blobs".
+ * The storage is only opened once it is accessed, so a store that is created after this object is picked up.
+ * A BlobStore can be shared between threads, accesses to the storage are serialized.
+ */
+class AKONADI2COMMON_EXPORT BlobStore
+{
+public:
+    //Values of at least this size are moved to the blob store
+    static const int threshold = 16 * 1024;
+
+    struct Statistics
+    {
+        Statistics() : blobs(0), references(0), storedBytes(0), referencedBytes(0) {}
+        //The bytes that storing each reference separately would need in addition to the stored blobs
+        qint64 savedBytes() const { return referencedBytes - storedBytes; }
+        //Blobs in the store, including the ones without references that weren't collected yet
+        qint64 blobs;
+        qint64 references;
+        //The size of the stored blobs
+        qint64 storedBytes;
+        //The size of the blobs times their references
+        qint64 referencedBytes;
+    };
+
+    BlobStore(const QString &storageRoot, const QString &resourceName, Storage::AccessMode mode = Storage::ReadOnly);
+
+    /**
+     * The reference of a blob, which is the hex encoded SHA-256 of @param data.
+     */
+    static QByteArray reference(const char *data, int size);
+
+    /**
+     * Stores @param data unless it is stored already, adds a reference to it and returns the reference.
+     *
+     * Add the reference before the entity that holds it is written, so a crash in between leaks the blob instead of leaving a dangling reference.
+     */
+    QByteArray add(const char *data, int size);
+    /**
+     * Removes a reference added by add, once the entity that held it is gone.
+     */
+    void release(const QByteArray &reference);
+
+    /**
+     * The blob of @param reference, or a null QByteArray if it doesn't exist.
+     */
+    QByteArray read(const QByteArray &reference);
+    qint64 referenceCount(const QByteArray &reference);
+
+    /**
+     * Removes the blobs that have no references anymore, and returns how many were removed.
+     */
+    qint64 collectGarbage();
+
+    /**
+     * Counts the blobs and their references, to report how much deduplicating the blobs saves.
+     */
+    Statistics statistics();
+    qint64 diskUsage() const;
+
+private:
+    Q_DISABLE_COPY(BlobStore)
+    //The storage, or null if it doesn't exist yet. Requires mMutex to be locked.
+    Storage *storage() const;
+    qint64 readReferenceCount(Storage &storage, const QByteArray &reference) const;
+
+    QString mStorageRoot;
+    QString mName;
+    Storage::AccessMode mMode;
+    mutable QMutex mMutex;
+    mutable QScopedPointer<Storage> mStorage;
+};
+
+} // namespace Akonadi2
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "builderpool.h"
+
+#include <QThreadStorage>
+#include <QVector>
+
+namespace Akonadi2
+{
+
+//The initial buffer size of a builder, it grows to the largest buffer the builder built so far
+static const size_t initialBufferSize = 1024;
+//A builder that built a larger buffer is not kept, so a single large command doesn't hold on to its memory
+static const size_t maxRetainedSize = 4 * 1024 * 1024;
+
+/**
+ * Allocates the buffers of the builders from the heap, and counts the allocations.
+ */
+class CountingAllocator : public flatbuffers::simple_allocator
+{
+public:
+    CountingAllocator(BuilderPool::Statistics &statistics)
+        : mStatistics(statistics)
+    {
+    }
+
+    virtual uint8_t *allocate(size_t size) const
+    {
+        mStatistics.allocations++;
+        return new uint8_t[size];
+    }
+
+    virtual void deallocate(uint8_t *p) const
+    {
+        delete[] p;
+    }
+
+private:
+    BuilderPool::Statistics &mStatistics;
+};
+
+class ThreadPool
+{
+public:
+    ThreadPool()
+        : mAllocator(mStatistics)
+    {
+    }
+
+    ~ThreadPool()
+    {
+        qDeleteAll(mBuilders);
+    }
+
+    flatbuffers::FlatBufferBuilder *acquire()
+    {
+        mStatistics.builders++;
+        if (!mFree.isEmpty()) {
+            return mFree.takeLast();
+        }
+        mStatistics.createdBuilders++;
+        auto builder = new flatbuffers::FlatBufferBuilder(initialBufferSize, &mAllocator);
+        mBuilders << builder;
+        return builder;
+    }
+
+    void release(flatbuffers::FlatBufferBuilder *builder)
+    {
+        if (builder->GetSize() > maxRetainedSize) {
+            mBuilders.removeOne(builder);
+            delete builder;
+            return;
+        }
+        //Clearing keeps the buffer and the bookkeeping of the builder, so the next command doesn't have to grow them again
+        builder->Clear();
+        mFree << builder;
+    }
+
+    BuilderPool::Statistics mStatistics;
+
+private:
+    CountingAllocator mAllocator;
+    QVector<flatbuffers::FlatBufferBuilder*> mBuilders;
+    QVector<flatbuffers::FlatBufferBuilder*> mFree;
+};
+
+static ThreadPool &threadPool()
+{
+    static QThreadStorage<ThreadPool*> sPools;
+    if (!sPools.hasLocalData()) {
+        sPools.setLocalData(new ThreadPool);
+    }
+    return *sPools.localData();
+}
+
+BuilderPool::Builder::Builder()
+    : mBuilder(threadPool().acquire())
+{
+}
+
+BuilderPool::Builder::~Builder()
+{
+    threadPool().release(mBuilder);
+}
+
+BuilderPool::Statistics BuilderPool::statistics()
+{
+    return threadPool().mStatistics;
+}
+
+void BuilderPool::resetStatistics()
+{
+    threadPool().mStatistics = Statistics();
+}
+
+} // namespace Akonadi2
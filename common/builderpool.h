@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <akonadi2common_export.h>
+#include <QtGlobal>
+#include <flatbuffers/flatbuffers.h>
+
+namespace Akonadi2
+{
+
+/**
+ * A pool of flatbuffer builders per thread.
+ *
+ * Released builders are cleared and kept, so they are reused with the buffer capacity they already have.
+ * Once the builders of a thread have grown to the size of the usual commands, building a command doesn't allocate buffers anymore.
+ *
+ * Buffers of a builder are only valid until it is released, so copy them before if they are needed longer.
+ */
+class AKONADI2COMMON_EXPORT BuilderPool
+{
+public:
+    struct Statistics
+    {
+        Statistics() : builders(0), createdBuilders(0), allocations(0) {}
+        //Builders acquired from the pool
+        qint64 builders;
+        //Builders the pool had to create, because all of its builders were in use
+        qint64 createdBuilders;
+        //Buffers the builders allocated from the heap, including the ones to grow.
+        //The builders also keep vectors of offsets and vtables, which keep their capacity as well but are not counted.
+        qint64 allocations;
+    };
+
+    /**
+     * A builder of the pool of the current thread, it is cleared and returned to the pool when it goes out of scope.
+     */
+    class AKONADI2COMMON_EXPORT Builder
+    {
+    public:
+        Builder();
+        ~Builder();
+
+        flatbuffers::FlatBufferBuilder &operator*() const { return *mBuilder; }
+        flatbuffers::FlatBufferBuilder *operator->() const { return mBuilder; }
+
+    private:
+        Q_DISABLE_COPY(Builder)
+        flatbuffers::FlatBufferBuilder *mBuilder;
+    };
+
+    /**
+     * The statistics of the pool of the current thread.
+     */
+    static Statistics statistics();
+    static void resetStatistics();
+};
+
+} // namespace Akonadi2
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AKONADI2_CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+#include <QtEndian>
+#include <cstring>
+
+namespace Akonadi2
+{
+
+namespace Checksum
+{
+
+//The reflected Castagnoli polynomial
+static const quint32 s_polynomial = 0x82F63B78;
+
+//Tables for slicing by 8, so the portable implementation consumes 8 bytes per step
+struct Tables
+{
+    Tables()
+    {
+        for (quint32 i = 0; i < 256; i++) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ s_polynomial : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+        for (quint32 i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+            }
+        }
+    }
+
+    quint32 table[8][256];
+};
+
+quint32 crc32cPortable(const void *data, size_t size, quint32 crc)
+{
+    static const Tables tables;
+    const auto &t = tables.table;
+    const uchar *p = static_cast<const uchar*>(data);
+    crc = ~crc;
+    while (size >= 8) {
+        quint32 low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+        low = qFromLittleEndian(low);
+        high = qFromLittleEndian(high);
+#endif
+        low ^= crc;
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+              t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+#ifdef AKONADI2_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static quint32 crc32cSse42(const void *data, size_t size, quint32 crc)
+{
+    const uchar *p = static_cast<const uchar*>(data);
+    crc = ~crc;
+#ifdef __x86_64__
+    quint64 crc64 = crc;
+    while (size >= 8) {
+        quint64 value;
+        memcpy(&value, p, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+        p += 8;
+        size -= 8;
+    }
+    crc = crc64;
+#endif
+    while (size >= 4) {
+        quint32 value;
+        memcpy(&value, p, 4);
+        crc = _mm_crc32_u32(crc, value);
+        p += 4;
+        size -= 4;
+    }
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+}
+#endif
+
+bool isHardwareAccelerated()
+{
+#ifdef AKONADI2_CRC32C_SSE42
+    static const bool supported = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+quint32 crc32c(const void *data, size_t size, quint32 crc)
+{
+#ifdef AKONADI2_CRC32C_SSE42
+    if (isHardwareAccelerated()) {
+        return crc32cSse42(data, size, crc);
+    }
+#endif
+    return crc32cPortable(data, size, crc);
+}
+
+}
+
+} // namespace Akonadi2
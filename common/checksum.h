@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <akonadi2common_export.h>
+#include <QtGlobal>
+#include <cstddef>
+
+namespace Akonadi2
+{
+
+namespace Checksum
+{
+
+/**
+ * The CRC32C (Castagnoli) checksum of @param size bytes at @param data.
+ *
+ * Pass the checksum of the preceding data as @param crc to checksum data in chunks.
+ * Uses the SSE4.2 crc32 instruction if the CPU supports it.
+ */
+quint32 AKONADI2COMMON_EXPORT crc32c(const void *data, size_t size, quint32 crc = 0);
+/**
+ * The table based implementation that is used if the CPU lacks support for CRC32C.
+ */
+quint32 AKONADI2COMMON_EXPORT crc32cPortable(const void *data, size_t size, quint32 crc = 0);
+bool AKONADI2COMMON_EXPORT isHardwareAccelerated();
+
+}
+
+} // namespace Akonadi2
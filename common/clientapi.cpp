@@ -2,6 +2,9 @@
 #include "clientapi.h"
 #include "resourceaccess.h"
 #include "commands.h"
+#include "querycache.h"
+
+#include <QDataStream>
 
 namespace async
 {
@@ -31,6 +34,53 @@ QString getTypeName<Todo>()
 
 } // namespace Domain
 
+QByteArray ResumePoint::toToken() const
+{
+    QByteArray token;
+    QDataStream stream(&token, QIODevice::WriteOnly);
+    stream << key << revision;
+    return token;
+}
+
+ResumePoint ResumePoint::fromToken(const QByteArray &token)
+{
+    ResumePoint point;
+    QDataStream stream(token);
+    stream >> point.key >> point.revision;
+    return point;
+}
+
+QByteArray Store::encodeContinuation(const QHash<QString, QByteArray> &resumePoints)
+{
+    QByteArray continuation;
+    QDataStream stream(&continuation, QIODevice::WriteOnly);
+    stream << resumePoints;
+    return continuation;
+}
+
+QHash<QString, QByteArray> Store::decodeContinuation(const QByteArray &continuation)
+{
+    QHash<QString, QByteArray> resumePoints;
+    QDataStream stream(continuation);
+    stream >> resumePoints;
+    return resumePoints;
+}
+
+Snapshot::Ptr Store::openSnapshot(const QString &resource)
+{
+    return Snapshot::open(storageLocation(), resource);
+}
+
+QSharedPointer<QObject> Store::watchRevision(const QString &resource, const std::function<void()> &callback)
+{
+    auto resourceAccess = QSharedPointer<Akonadi2::ResourceAccess>::create(resource);
+    QObject::connect(resourceAccess.data(), &Akonadi2::ResourceAccess::revisionChanged, [callback](unsigned long long) {
+        callback();
+    });
+    resourceAccess->open();
+    return resourceAccess;
+}
+
 void Store::shutdown(const QString &identifier)
 {
     Akonadi2::ResourceAccess resourceAccess(identifier);
@@ -39,6 +89,8 @@ void Store::shutdown(const QString &identifier)
         //TODO wait for disconnect
         f.setFinished();
     }).exec().waitForFinished();
+    //The revisions of the resource can't be relied on anymore once it is gone, i.e. its storage may be recreated
+    QueryCache::forResource(identifier)->clear();
 }
 
 } // namespace Akonadi2
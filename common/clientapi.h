@@ -27,9 +27,13 @@
 #include <QTimer>
 #include <QDebug>
 #include <QEventLoop>
+#include <QMutex>
+#include <QAtomicInt>
 #include <QtConcurrent/QtConcurrentRun>
 #include <functional>
 #include "threadboundary.h"
+#include "snapshot.h"
+#include "propertyview.h"
 #include "async/src/async.h"
 
 namespace async {
@@ -44,29 +48,98 @@ namespace async {
     template<class T>
     class ResultEmitter;
 
+    /*
+     * Keeps the results of an emitter up to date after the initial result set, i.e. for live queries.
+     *
+     * It is owned by the emitter, so updates stop once the emitter is released.
+     */
+    class ResultUpdater {
+    public:
+        virtual ~ResultUpdater() {}
+    };
+
     /*
     * The promise side for the result emitter
     */
     template<class T>
     class ResultProvider {
     public:
+        //Results are delivered to the main thread in batches of up to batchSize values,
+        //or whatever has accumulated batchInterval ms after the first value of a batch.
+        static const int batchSize = 1000;
+        static const int batchInterval = 50;
+
+        ResultProvider()
+            : mBatch(new Batch)
+        {
+        }
+
+        /**
+         * Creates a provider for an existing emitter, i.e. to deliver updates of a live query.
+         */
+        ResultProvider(const QSharedPointer<ResultEmitter<T> > &emitter)
+            : mResultEmitter(emitter),
+            mBatch(new Batch)
+        {
+        }
+
         //Called from worker thread
         void add(const T &value)
         {
             //We use the eventloop to call the addHandler directly from the main eventloop.
             //That way the result emitter implementation doesn't have to care about threadsafety at all.
             //The alternative would be to make all handlers of the emitter threadsafe.
+            //To not flood the eventloop with one event per value, values are collected and passed over in batches.
+            QMutexLocker locker(&mBatch->mutex);
+            mBatch->values.append(value);
+            if (mBatch->values.size() >= batchSize) {
+                flushBatch(mResultEmitter, *mBatch);
+            } else if (!mBatch->flushScheduled) {
+                //The batch is delivered by a timer, so values are not held back if no further value arrives, i.e. from a slow resource
+                mBatch->flushScheduled = true;
+                scheduleFlush();
+            }
+        }
+
+        //Called from worker thread
+        void modify(const T &value)
+        {
+            QMutexLocker locker(&mBatch->mutex);
+            //Keep the order of changes to the same value
+            flushBatch(mResultEmitter, *mBatch);
             auto emitter = mResultEmitter;
             mResultEmitter->mThreadBoundary.callInMainThread([emitter, value]() {
-                if (emitter) {
-                    emitter->addHandler(value);
+                if (emitter && emitter->modifyHandler) {
+                    emitter->modifyHandler(value);
                 }
             });
         }
 
+        //Called from worker thread
+        void remove(const T &value)
+        {
+            QMutexLocker locker(&mBatch->mutex);
+            flushBatch(mResultEmitter, *mBatch);
+            auto emitter = mResultEmitter;
+            mResultEmitter->mThreadBoundary.callInMainThread([emitter, value]() {
+                if (emitter && emitter->removeHandler) {
+                    emitter->removeHandler(value);
+                }
+            });
+        }
+
+        //Called from worker thread, delivers values that are still waiting for their batch to fill up
+        void flush()
+        {
+            QMutexLocker locker(&mBatch->mutex);
+            flushBatch(mResultEmitter, *mBatch);
+        }
+
         //Called from worker thread
         void complete()
         {
+            QMutexLocker locker(&mBatch->mutex);
+            flushBatch(mResultEmitter, *mBatch);
             auto emitter = mResultEmitter;
             mResultEmitter->mThreadBoundary.callInMainThread([emitter]() {
                 if (emitter) {
@@ -75,6 +148,32 @@ namespace async {
             });
         }
 
+        //Called from worker thread, before complete()
+        void setContinuation(const QByteArray &continuation)
+        {
+            QMutexLocker locker(&mBatch->mutex);
+            flushBatch(mResultEmitter, *mBatch);
+            auto emitter = mResultEmitter;
+            mResultEmitter->mThreadBoundary.callInMainThread([emitter, continuation]() {
+                if (emitter) {
+                    emitter->mContinuation = continuation;
+                }
+            });
+        }
+
+        //Called from worker thread, before complete()
+        void setRevision(const QString &resource, qint64 revision)
+        {
+            QMutexLocker locker(&mBatch->mutex);
+            flushBatch(mResultEmitter, *mBatch);
+            auto emitter = mResultEmitter;
+            mResultEmitter->mThreadBoundary.callInMainThread([emitter, resource, revision]() {
+                if (emitter) {
+                    emitter->mRevisions.insert(resource, revision);
+                }
+            });
+        }
+
         QSharedPointer<ResultEmitter<T> > emitter()
         {
             if (!mResultEmitter) {
@@ -85,7 +184,52 @@ namespace async {
         }
 
     private:
+        //The values that wait for delivery, it is shared with the timer that flushes it
+        struct Batch
+        {
+            Batch() : flushScheduled(false) {}
+            QMutex mutex;
+            QList<T> values;
+            bool flushScheduled;
+        };
+
+        //Has to be called with the mutex of @param batch locked
+        static void flushBatch(const QSharedPointer<ResultEmitter<T> > &emitter, Batch &batch)
+        {
+            if (batch.values.isEmpty()) {
+                return;
+            }
+            QList<T> values;
+            values.swap(batch.values);
+            //The batch is passed through the same queue as all other calls, so the order of the changes is kept
+            emitter->mThreadBoundary.callInMainThread([emitter, values]() {
+                if (emitter) {
+                    emitter->addBatch(values);
+                }
+            });
+        }
+
+        //Has to be called with the mutex of the batch locked
+        void scheduleFlush()
+        {
+            //Worker threads don't necessarily run an eventloop, so the timer runs in the main thread
+            auto emitter = mResultEmitter;
+            auto batch = mBatch;
+            mResultEmitter->mThreadBoundary.callInMainThread([emitter, batch]() {
+                auto timer = new QTimer;
+                timer->setSingleShot(true);
+                QObject::connect(timer, &QTimer::timeout, [emitter, batch, timer]() {
+                    timer->deleteLater();
+                    QMutexLocker locker(&batch->mutex);
+                    batch->flushScheduled = false;
+                    flushBatch(emitter, *batch);
+                });
+                timer->start(batchInterval);
+            });
+        }
+
         QSharedPointer<ResultEmitter<T> > mResultEmitter;
+        QSharedPointer<Batch> mBatch;
     };
 
     /*
@@ -108,17 +252,85 @@ namespace async {
         {
             addHandler = handler;
         }
-        // void onRemoved(const std::function<void(const T&)> &handler);
+        /**
+         * Receives the results in the batches they are delivered in.
+         *
+         * If set, this handler is used instead of the onAdded handler.
+         */
+        void onAddedBatch(const std::function<void(const QList<DomainType>&)> &handler)
+        {
+            addBatchHandler = handler;
+        }
+        /**
+         * Called for values of a live query that changed, but still match the query.
+         */
+        void onModified(const std::function<void(const DomainType&)> &handler)
+        {
+            modifyHandler = handler;
+        }
+        /**
+         * Called for values of a live query that were removed, or no longer match the query.
+         *
+         * Only the identifier of removed values is valid.
+         */
+        void onRemoved(const std::function<void(const DomainType&)> &handler)
+        {
+            removeHandler = handler;
+        }
         void onComplete(const std::function<void(void)> &handler)
         {
             completeHandler = handler;
         }
 
+        /**
+         * The continuation to set on the query to load the next page of a paginated query.
+         *
+         * It's available once the query completed, and empty if there are no further results.
+         */
+        QByteArray continuation() const
+        {
+            return mContinuation;
+        }
+
+        /**
+         * The revision of @param resource the results were read at, or -1 if the resource wasn't queried.
+         *
+         * It's available once the query completed.
+         */
+        qint64 revision(const QString &resource) const
+        {
+            return mRevisions.value(resource, -1);
+        }
+
+        /**
+         * Attaches @param updater to the emitter, i.e. to keep a live query updating until the emitter is released.
+         */
+        void setUpdater(const QSharedPointer<ResultUpdater> &updater)
+        {
+            mUpdater = updater;
+        }
+
     private:
         friend class ResultProvider<DomainType>;
+        void addBatch(const QList<DomainType> &values)
+        {
+            if (addBatchHandler) {
+                addBatchHandler(values);
+            } else if (addHandler) {
+                for (const auto &value : values) {
+                    addHandler(value);
+                }
+            }
+        }
+
         std::function<void(const DomainType&)> addHandler;
-        // std::function<void(const T&)> removeHandler;
+        std::function<void(const QList<DomainType>&)> addBatchHandler;
+        std::function<void(const DomainType&)> modifyHandler;
+        std::function<void(const DomainType&)> removeHandler;
         std::function<void(void)> completeHandler;
+        QByteArray mContinuation;
+        QHash<QString, qint64> mRevisions;
+        QSharedPointer<ResultUpdater> mUpdater;
         ThreadBoundary mThreadBoundary;
     };
 
@@ -134,8 +346,8 @@ namespace async {
             mComplete(false),
             mEmitter(emitter)
         {
-            emitter->onAdded([this](const T &value) {
-                this->append(value);
+            emitter->onAddedBatch([this](const QList<T> &values) {
+                this->append(values);
             });
             emitter->onComplete([this]() {
                 mComplete = true;
@@ -182,6 +394,17 @@ public:
     virtual QVariant getProperty(const QString &key) const { return QVariant(); }
     virtual void setProperty(const QString &key, const QVariant &value) {}
     virtual QStringList availableProperties() const { return QStringList(); }
+
+    /**
+     * Typed access to the properties for internal processing, such as indexing, without converting them to a QVariant.
+     *
+     * Views point directly into the buffer. A null view, respectively false, is returned if the property
+     * is not available with that type, or if the adaptor doesn't read from a buffer.
+     * The QVariant based getProperty remains the API for values handed out to clients.
+     */
+    virtual PropertyView getStringView(const QString &key) const { return PropertyView(); }
+    virtual PropertyView getBytes(const QString &key) const { return PropertyView(); }
+    virtual bool getInteger(const QString &key, qint64 &value) const { return false; }
 };
 
 class MemoryBufferAdaptor : public BufferAdaptor {
@@ -199,6 +422,18 @@ public:
         }
     }
 
+    /**
+     * Copies only @param properties from @param buffer.
+     */
+    MemoryBufferAdaptor(const BufferAdaptor &buffer, const QStringList &properties)
+        : BufferAdaptor()
+    {
+        mValues.reserve(properties.size());
+        for(const auto &property : properties) {
+            mValues.insert(property, buffer.getProperty(property));
+        }
+    }
+
     virtual QVariant getProperty(const QString &key) const { return mValues.value(key); }
     virtual void setProperty(const QString &key, const QVariant &value) { mValues.insert(key, value); }
     virtual QStringList availableProperties() const { return mValues.keys(); }
@@ -229,6 +464,8 @@ public:
 
     virtual QVariant getProperty(const QString &key) const { return mAdaptor->getProperty(key); }
     virtual void setProperty(const QString &key, const QVariant &value){ mChangeSet.insert(key, value); mAdaptor->setProperty(key, value); }
+    QString identifier() const { return mIdentifier; }
+    qint64 revision() const { return mRevision; }
 
 private:
     QSharedPointer<BufferAdaptor> mAdaptor;
@@ -294,20 +531,64 @@ using namespace async;
  * * filters on various properties (parent collection, startDate range, ....)
  * * properties we need (for on-demand querying)
  */
+/**
+ * The position a query on a single resource was evaluated at.
+ *
+ * A paginated query continues from it, and a live query loads the changes since its revision.
+ */
+struct ResumePoint
+{
+    ResumePoint() : revision(-1) {}
+    //The key of the last result of the previous page, empty if there are no further results
+    QByteArray key;
+    //The revision of the storage the previous page was read at
+    qint64 revision;
+
+    QByteArray toToken() const;
+    static ResumePoint fromToken(const QByteArray &token);
+};
+
+/**
+ * The error of StoreFacade::loadChanges if the changes since the requested revision are no longer recorded.
+ *
+ * The changelog of a resource is compacted eventually, the result set then has to be reloaded instead.
+ */
+static const int ChangesIncompleteError = 2;
+
 class Query
 {
 public:
-    Query() : syncOnDemand(true), processAll(false) {}
+    Query() : syncOnDemand(true), processAll(false), lazyLoading(false), resourceTimeout(60000), limit(0), sortDescending(false), liveQuery(false) {}
     //Could also be a propertyFilter
     QStringList resources;
     //Could also be a propertyFilter
     QStringList ids;
     //Filters to apply
     QHash<QString, QVariant> propertyFilter;
-    //Properties to retrieve
+    //Properties to retrieve, if empty all properties except for the large ones that are loaded on demand (such as attachments)
     QSet<QString> requestedProperties;
     bool syncOnDemand;
     bool processAll;
+    //Results read their properties directly from the storage instead of copying them.
+    //Each result keeps a read transaction open, so only use this for results that are released shortly after (see Akonadi2::Snapshot).
+    bool lazyLoading;
+    //Time in ms after which a resource that didn't finish the query is skipped, 0 to wait forever
+    int resourceTimeout;
+    //The maximum number of results per resource, 0 for no limit. Paginated results are returned in key order.
+    int limit;
+    //Opaque token to load the next page, as returned by ResultEmitter::continuation() of the previous page.
+    //Empty for the first page.
+    QByteArray continuation;
+    //Returns the results ordered by this property instead of by key, together with limit only the first ones.
+    //The query fails on a resource that can't sort on the property.
+    //Sorted queries can't be continued, the query fails on a resource if a continuation is set.
+    QString sortProperty;
+    bool sortDescending;
+    //Keeps the results up to date after the initial result set, reporting changes via the emitters added/modified/removed handlers.
+    //Limited and sorted queries are not kept up to date.
+    bool liveQuery;
+    //Pins the query on a resource to a snapshot (see Store::openSnapshot), instead of reading the latest revision.
+    QHash<QString, Snapshot::Ptr> snapshots;
 };
 
 
@@ -327,10 +608,30 @@ public:
     virtual Async::Job<void> create(const DomainType &domainObject) = 0;
     virtual Async::Job<void> modify(const DomainType &domainObject) = 0;
     virtual Async::Job<void> remove(const DomainType &domainObject) = 0;
-    virtual Async::Job<void> load(const Query &query, const std::function<void(const typename DomainType::Ptr &)> &resultCallback) = 0;
+    /**
+     * Loads the entities matching @param query.
+     *
+     * The continuation of the query is the token of the ResumePoint of this resource.
+     * The revision the query was evaluated at, and if the result set is cut short due to the limit of the query
+     * also the key to continue from, is reported via @param resumeCallback.
+     */
+    virtual Async::Job<void> load(const Query &query, const std::function<void(const typename DomainType::Ptr &)> &resultCallback, const std::function<void(const ResumePoint &)> &resumeCallback) = 0;
+    /**
+     * Reports the entities that changed since @param fromRevision.
+     *
+     * Changed entities that match @param query are passed to @param matchingCallback,
+     * the keys of the ones that don't match or were removed to @param notMatchingCallback together with the revision they were read at.
+     * If @param fromRevision is negative no changes are reported, the revision only starts being tracked.
+     * The revision the changes were read up to is reported via @param revisionCallback.
+     * If the changes since @param fromRevision are no longer recorded, the job fails with ChangesIncompleteError.
+     * Resources that don't implement this don't support live queries.
+     */
+    virtual Async::Job<void> loadChanges(const Query &query, qint64 fromRevision, const std::function<void(const typename DomainType::Ptr &)> &matchingCallback, const std::function<void(const QByteArray &key, qint64 revision)> &notMatchingCallback, const std::function<void(qint64 revision)> &revisionCallback)
+    {
+        return Async::null<void>();
+    }
 };
 
-
 /**
  * Facade factory that returns a store facade implementation, by loading a plugin and providing the relevant implementation.
  *
@@ -390,6 +691,196 @@ private:
     QHash<QString, std::function<void*(void)> > mFacadeRegistry;
 };
 
+/**
+ * Keeps the results of a live query up to date.
+ *
+ * Per resource it remembers the revision the results are evaluated at and the keys of the reported entities,
+ * and on each revision change of the resource it only loads the entities that changed since then.
+ * A changed entity is added if it wasn't reported before, modified if it was, and removed if it was but no longer matches.
+ * Updates of a resource are serialized, changes that arrive during an update are handled by a follow-up update.
+ */
+template<class DomainType>
+class LiveQuery : public async::ResultUpdater
+{
+public:
+    typedef typename DomainType::Ptr Ptr;
+
+    LiveQuery(const Query &query, const QWeakPointer<async::ResultEmitter<Ptr> > &emitter)
+        : d(new Private)
+    {
+        d->query = query;
+        d->emitter = emitter;
+    }
+
+    /**
+     * Keeps @param watcher alive as long as the live query.
+     */
+    void addWatcher(const QSharedPointer<QObject> &watcher)
+    {
+        mWatchers << watcher;
+    }
+
+    /**
+     * Called from the query thread once the initial result set of @param resource was loaded at @param revision.
+     *
+     * @param keys are the keys of the entities of the initial result set.
+     */
+    void setRevision(const QString &resource, qint64 revision, const QSet<QByteArray> &keys)
+    {
+        bool pending = false;
+        {
+            QMutexLocker locker(&d->mutex);
+            auto &state = d->resources[resource];
+            state.loaded = true;
+            state.revision = revision;
+            state.keys = keys;
+            pending = state.pending;
+            state.updating = pending;
+        }
+        //Catch up on changes that happened while the initial result set was loaded
+        if (pending) {
+            update(d, resource);
+        }
+    }
+
+    /**
+     * Called from the main thread whenever the revision of @param resource changed.
+     */
+    void revisionChanged(const QString &resource)
+    {
+        {
+            QMutexLocker locker(&d->mutex);
+            auto &state = d->resources[resource];
+            if (!state.loaded || state.updating) {
+                state.pending = true;
+                return;
+            }
+            state.updating = true;
+        }
+        auto data = d;
+        async::run([data, resource]() {
+            update(data, resource);
+        });
+    }
+
+private:
+    struct ResourceState
+    {
+        ResourceState() : loaded(false), revision(-1), updating(false), pending(false) {}
+        //Set once the initial result set was loaded
+        bool loaded;
+        qint64 revision;
+        //The entities that are currently in the result set
+        QSet<QByteArray> keys;
+        bool updating;
+        bool pending;
+    };
+
+    struct Private
+    {
+        Query query;
+        QWeakPointer<async::ResultEmitter<Ptr> > emitter;
+        QMutex mutex;
+        QHash<QString, ResourceState> resources;
+    };
+
+    //Runs in a worker thread
+    static void update(const QSharedPointer<Private> &d, const QString &resource)
+    {
+        //Like the facades of the initial load, the facade is only used in the thread that created it
+        auto facade = FacadeFactory::instance().getFacade<DomainType>(resource);
+        while (true) {
+            qint64 fromRevision;
+            QSet<QByteArray> keys;
+            {
+                QMutexLocker locker(&d->mutex);
+                auto &state = d->resources[resource];
+                state.pending = false;
+                fromRevision = state.revision;
+                keys = state.keys;
+            }
+
+            qint64 revision = fromRevision;
+            auto emitter = d->emitter.toStrongRef();
+            if (emitter && facade) {
+                auto resultProvider = QSharedPointer<async::ResultProvider<Ptr> >::create(emitter);
+                auto future = facade->loadChanges(d->query, fromRevision, [&keys, &resultProvider](const Ptr &value) {
+                    const QByteArray key = value->identifier().toUtf8();
+                    if (keys.contains(key)) {
+                        resultProvider->modify(value);
+                    } else {
+                        keys.insert(key);
+                        resultProvider->add(value);
+                    }
+                },
+                [&keys, &resultProvider, &resource](const QByteArray &key, qint64 changeRevision) {
+                    //Entities that were never reported don't have to be removed.
+                    //The removed entity has no properties left, the empty adaptor keeps reading them safe.
+                    if (keys.remove(key)) {
+                        resultProvider->remove(QSharedPointer<DomainType>::create(resource, QString::fromUtf8(key), changeRevision, QSharedPointer<Domain::MemoryBufferAdaptor>::create()));
+                    }
+                },
+                [&revision](qint64 r) {
+                    revision = r;
+                }).exec();
+                future.waitForFinished();
+                if (future.errorCode() == ChangesIncompleteError) {
+                    qWarning() << "The changes of " << resource << " since revision " << fromRevision << " are incomplete, reloading the result set";
+                    reload(d->query, facade, resource, *resultProvider, keys, revision);
+                }
+                resultProvider->flush();
+            }
+
+            QMutexLocker locker(&d->mutex);
+            auto &state = d->resources[resource];
+            state.revision = revision;
+            state.keys = keys;
+            if (!emitter || !state.pending) {
+                state.updating = false;
+                return;
+            }
+        }
+    }
+
+    //Loads the result set of @param resource again, and reports the differences to the entities in @param keys
+    static void reload(const Query &query, const QSharedPointer<StoreFacade<DomainType> > &facade, const QString &resource, async::ResultProvider<Ptr> &resultProvider, QSet<QByteArray> &keys, qint64 &revision)
+    {
+        Query reloadQuery = query;
+        reloadQuery.syncOnDemand = false;
+        reloadQuery.processAll = false;
+        QSet<QByteArray> reloadedKeys;
+        ResumePoint resumePoint;
+        auto future = facade->load(reloadQuery, [&keys, &reloadedKeys, &resultProvider](const Ptr &value) {
+            const QByteArray key = value->identifier().toUtf8();
+            reloadedKeys.insert(key);
+            if (keys.contains(key)) {
+                resultProvider.modify(value);
+            } else {
+                resultProvider.add(value);
+            }
+        },
+        [&resumePoint](const ResumePoint &point) {
+            resumePoint = point;
+        }).exec();
+        future.waitForFinished();
+        if (future.errorCode()) {
+            qWarning() << "Failed to reload the result set of " << resource << ": " << future.errorMessage();
+            return;
+        }
+        for (const auto &key : keys) {
+            if (!reloadedKeys.contains(key)) {
+                resultProvider.remove(QSharedPointer<DomainType>::create(resource, QString::fromUtf8(key), resumePoint.revision, QSharedPointer<Domain::MemoryBufferAdaptor>::create()));
+            }
+        }
+        keys = reloadedKeys;
+        revision = resumePoint.revision;
+    }
+
+    QSharedPointer<Private> d;
+    QList<QSharedPointer<QObject> > mWatchers;
+};
+
+
 /**
  * Store interface used in the client API.
  */
@@ -407,36 +898,78 @@ public:
     static QSharedPointer<ResultEmitter<typename DomainType::Ptr> > load(Query query)
     {
         QSharedPointer<ResultProvider<typename DomainType::Ptr> > resultSet(new ResultProvider<typename DomainType::Ptr>);
+        //The emitter has to exist before the first result is emitted
+        auto emitter = resultSet->emitter();
+
+        //A live query watches the revision of each resource from the main thread, the updates are loaded in a worker thread.
+        QSharedPointer<LiveQuery<DomainType> > liveQuery;
+        if (query.liveQuery && (query.limit > 0 || !query.sortProperty.isEmpty())) {
+            //The changes would have to be merged into the page or order of the initial result set
+            qWarning() << "Limited and sorted queries are not kept up to date";
+        } else if (query.liveQuery) {
+            liveQuery = QSharedPointer<LiveQuery<DomainType> >::create(query, emitter.toWeakRef());
+            QWeakPointer<LiveQuery<DomainType> > weakLiveQuery = liveQuery;
+            for(const QString &resource : query.resources) {
+                liveQuery->addWatcher(watchRevision(resource, [weakLiveQuery, resource]() {
+                    if (auto liveQuery = weakLiveQuery.toStrongRef()) {
+                        liveQuery->revisionChanged(resource);
+                    }
+                }));
+            }
+            emitter->setUpdater(liveQuery);
+        }
+        const QWeakPointer<LiveQuery<DomainType> > weakLiveQuery = liveQuery;
 
         //Execute the search in a thread.
         //We must guarantee that the emitter is returned before the first result is emitted.
         //The result provider must be threadsafe.
-        async::run([resultSet, query](){
+        async::run([resultSet, query, weakLiveQuery](){
             // Query all resources and aggregate results
             // query tells us in which resources we're interested
-            // TODO: queries to individual resources could be parallelized
-            Async::Job<void> job = Async::null<void>();
+            // Each resource is queried in a thread of its own, so the results of fast resources are not held back by slow ones.
+            //For a follow-up page only the resources that had further results are queried.
+            const bool nextPage = !query.continuation.isEmpty();
+            const QHash<QString, QByteArray> resumePoints = nextPage ? decodeContinuation(query.continuation) : QHash<QString, QByteArray>();
+            QList<QPair<QString, QFuture<void> > > loads;
+            QHash<QString, QByteArray> continuation;
+            QMutex continuationMutex;
             for(const QString &resource : query.resources) {
-                auto facade = FacadeFactory::instance().getFacade<DomainType>(resource);
-                //We have to bind an instance to the function callback. Since we use a shared pointer this keeps the result provider instance (and thus also the emitter) alive.
-                std::function<void(const typename DomainType::Ptr &)> addCallback = std::bind(&ResultProvider<typename DomainType::Ptr>::add, resultSet, std::placeholders::_1);
-                //We copy the facade pointer to keep it alive
-                //TODO JOBAPI: we should be able to just do, job = job.then(facade->load(..))
-                job = job.then<void>([facade, query, addCallback](Async::Future<void> &future) {
-                    Async::Job<void> j = facade->load(query, addCallback);
-                    j.then<void>([&future, facade](Async::Future<void> &f) {
-                        future.setFinished();
-                        f.setFinished();
-                    }).exec();
-                });
+                if (nextPage && !resumePoints.contains(resource)) {
+                    continue;
+                }
+                Query resourceQuery = query;
+                resourceQuery.continuation = resumePoints.value(resource);
+                loads << qMakePair(resource, QtConcurrent::run([resultSet, resourceQuery, resource, weakLiveQuery, &continuation, &continuationMutex]() {
+                    //The facade and its connection to the resource are created, used and destroyed in this thread,
+                    //so their socket and timer events are delivered to the event loop that runs while we wait for the resource.
+                    auto facade = FacadeFactory::instance().getFacade<DomainType>(resource);
+                    if (!facade) {
+                        return;
+                    }
+                    //A live query needs to know which entities it reported
+                    QSet<QByteArray> keys;
+                    const ResumePoint resumePoint = loadFromResource<DomainType>(resultSet, facade, resourceQuery, resource, !weakLiveQuery.isNull() ? &keys : nullptr);
+                    resultSet->setRevision(resource, resumePoint.revision);
+                    if (!resumePoint.key.isEmpty()) {
+                        QMutexLocker locker(&continuationMutex);
+                        continuation.insert(resource, resumePoint.toToken());
+                    }
+                    if (auto liveQuery = weakLiveQuery.toStrongRef()) {
+                        liveQuery->setRevision(resource, resumePoint.revision, keys);
+                    }
+                }));
             }
-            job.then<void>([/* eventloop,  */resultSet](Async::Future<void> &future) {
-                qDebug() << "Query complete";
-                resultSet->complete();
-                future.setFinished();
-            }).exec().waitForFinished(); //We use the eventloop provided by waitForFinished to keep the thread alive until all is done
+            //Waiting on a future that hasn't started yet runs it in this thread, so this doesn't starve the pool
+            for (auto &load : loads) {
+                load.second.waitForFinished();
+            }
+            if (!continuation.isEmpty()) {
+                resultSet->setContinuation(encodeContinuation(continuation));
+            }
+            qDebug() << "Query complete";
+            resultSet->complete();
         });
-        return resultSet->emitter();
+        return emitter;
     }
 
     /**
@@ -462,6 +995,59 @@ public:
         //TODO return job?
     }
 
+    /**
+     * Create many new entities without waiting for each of them.
+     *
+     * The commands are sent to the resource right away, without waiting for the acknowledgement of the previous one.
+     * The returned job completes once the resource acknowledged all of them, and fails if any of them failed.
+     */
+    template <class DomainType>
+    static Async::Job<void> createAll(const QList<DomainType> &domainObjects, const QString &resourceIdentifier) {
+        auto facade = FacadeFactory::instance().getFacade<DomainType>(resourceIdentifier);
+        //The facade sends the command as soon as the job is created, the job only waits for the acknowledgement
+        auto jobs = QSharedPointer<QList<Async::Job<void> > >::create();
+        for (const auto &domainObject : domainObjects) {
+            jobs->append(facade->create(domainObject));
+        }
+        //The facade is kept until all commands are acknowledged, since its connection to the resource goes with it
+        return Async::start<void>([facade, jobs](Async::Future<void> &future) {
+            if (jobs->isEmpty()) {
+                future.setFinished();
+                return;
+            }
+            auto pending = QSharedPointer<int>::create(jobs->size());
+            auto errorCode = QSharedPointer<int>::create(0);
+            auto errorMessage = QSharedPointer<QString>::create();
+            auto acknowledged = [pending, errorCode, errorMessage, &future](int error, const QString &message) {
+                if (error && !*errorCode) {
+                    *errorCode = error;
+                    *errorMessage = message;
+                }
+                if (--(*pending) == 0) {
+                    if (*errorCode) {
+                        future.setError(*errorCode, *errorMessage);
+                    }
+                    future.setFinished();
+                }
+            };
+            //The continuations replace the jobs, so they live as long as the returned job
+            QList<Async::Job<void> > continuations;
+            for (auto &job : *jobs) {
+                continuations << job.then<void>([acknowledged](Async::Future<void> &f) {
+                    acknowledged(0, QString());
+                    f.setFinished();
+                },
+                [acknowledged](int error, const QString &message) {
+                    acknowledged(error, message);
+                });
+            }
+            *jobs = continuations;
+            for (auto &job : *jobs) {
+                job.exec();
+            }
+        });
+    }
+
     /**
      * Modify an entity.
      * 
@@ -471,7 +1057,9 @@ public:
     static void modify(const DomainType &domainObject, const QString &resourceIdentifier) {
         //Potentially move to separate thread as well
         auto facade = FacadeFactory::instance().getFacade<DomainType>(resourceIdentifier);
-        facade.modify(domainObject);
+        auto job = facade->modify(domainObject);
+        auto future = job.exec();
+        future.waitForFinished();
     }
 
     /**
@@ -481,10 +1069,83 @@ public:
     static void remove(const DomainType &domainObject, const QString &resourceIdentifier) {
         //Potentially move to separate thread as well
         auto facade = FacadeFactory::instance().getFacade<DomainType>(resourceIdentifier);
-        facade.remove(domainObject);
+        auto job = facade->remove(domainObject);
+        auto future = job.exec();
+        future.waitForFinished();
     }
 
     static void shutdown(const QString &resourceIdentifier);
+
+    /**
+     * Opens a snapshot of @param resource, to read the same revision in multiple queries (see Query::snapshots).
+     *
+     * Returns a null pointer if the resource has no storage yet.
+     */
+    static Snapshot::Ptr openSnapshot(const QString &resource);
+
+private:
+    static QByteArray encodeContinuation(const QHash<QString, QByteArray> &resumePoints);
+    static QHash<QString, QByteArray> decodeContinuation(const QByteArray &continuation);
+    //Calls @param callback whenever the revision of @param resource changes, as long as the returned object exists
+    static QSharedPointer<QObject> watchRevision(const QString &resource, const std::function<void()> &callback);
+
+    /*
+     * Executes the query on a single resource and waits until it is done, fails, or query.resourceTimeout expires.
+     *
+     * A resource that times out is abandoned, results it produces afterwards are dropped.
+     * Returns the resume point the resource reported, and the keys of the results in @param keys unless it is null.
+     */
+    template <class DomainType>
+    static ResumePoint loadFromResource(const QSharedPointer<ResultProvider<typename DomainType::Ptr> > &resultSet, const QSharedPointer<StoreFacade<DomainType> > &facade, const Query &query, const QString &resource, QSet<QByteArray> *keys = nullptr)
+    {
+        auto abandoned = QSharedPointer<QAtomicInt>::create(0);
+        //The keys are only handed out if the resource finished, so an abandoned resource can keep adding to them
+        auto resultKeys = keys ? QSharedPointer<QSet<QByteArray> >::create() : QSharedPointer<QSet<QByteArray> >();
+        //Since we use a shared pointer this keeps the result provider instance (and thus also the emitter) alive.
+        std::function<void(const typename DomainType::Ptr &)> addCallback = [resultSet, abandoned, resultKeys](const typename DomainType::Ptr &value) {
+            if (!abandoned->load()) {
+                if (resultKeys) {
+                    resultKeys->insert(value->identifier().toUtf8());
+                }
+                resultSet->add(value);
+            }
+        };
+
+        auto resumePoint = QSharedPointer<ResumePoint>::create();
+        std::function<void(const ResumePoint &)> resumeCallback = [resumePoint, abandoned](const ResumePoint &point) {
+            if (!abandoned->load()) {
+                *resumePoint = point;
+            }
+        };
+
+        auto future = facade->load(query, addCallback, resumeCallback).exec();
+        if (!future.isFinished()) {
+            //The job may depend on this threads eventloop
+            Async::FutureWatcher<void> watcher;
+            QEventLoop eventLoop;
+            QObject::connect(&watcher, &Async::FutureWatcher<void>::futureReady, &eventLoop, &QEventLoop::quit);
+            if (query.resourceTimeout > 0) {
+                QTimer::singleShot(query.resourceTimeout, &eventLoop, SLOT(quit()));
+            }
+            watcher.setFuture(future);
+            if (!future.isFinished()) {
+                eventLoop.exec();
+            }
+        }
+
+        if (!future.isFinished()) {
+            abandoned->store(1);
+            qWarning() << "Query on resource " << resource << " timed out after " << query.resourceTimeout << "ms";
+            return ResumePoint();
+        } else if (future.errorCode()) {
+            qWarning() << "Query on resource " << resource << " failed: " << future.errorCode() << future.errorMessage();
+            return ResumePoint();
+        }
+        if (keys) {
+            *keys = *resultKeys;
+        }
+        return *resumePoint;
+    }
 };
 
 }
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compression.h"
+
+#include <QDebug>
+#include <QThreadStorage>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <zlib.h>
+
+namespace Akonadi2
+{
+
+namespace Compression
+{
+
+//Values are compressed on every write and decompressed on every read, so speed matters more than the ratio
+static const int s_level = Z_BEST_SPEED;
+
+/**
+ * A buffer that only grows, so a thread doesn't allocate for every value.
+ */
+class Buffer
+{
+public:
+    Buffer()
+        : data(0),
+        capacity(0)
+    {
+    }
+
+    ~Buffer()
+    {
+        free(data);
+    }
+
+    uchar *reserve(size_t size)
+    {
+        if (size > capacity) {
+            //malloc aligns for any scalar, so a decompressed flatbuffer can be read in place
+            free(data);
+            capacity = qMax(size, capacity * 2);
+            data = static_cast<uchar*>(malloc(capacity));
+            if (!data) {
+                capacity = 0;
+                throw std::bad_alloc();
+            }
+        }
+        return data;
+    }
+
+    uchar *data;
+    size_t capacity;
+};
+
+/**
+ * The buffers and zlib streams of a thread, the streams are reset for each value instead of allocated again.
+ */
+class ThreadState
+{
+public:
+    ThreadState()
+        : mDeflaterValid(false),
+        mInflaterValid(false)
+    {
+        memset(&mDeflater, 0, sizeof(mDeflater));
+        memset(&mInflater, 0, sizeof(mInflater));
+    }
+
+    ~ThreadState()
+    {
+        if (mDeflaterValid) {
+            deflateEnd(&mDeflater);
+        }
+        if (mInflaterValid) {
+            inflateEnd(&mInflater);
+        }
+    }
+
+    //The streams are only initialized once they are used, threads that only read uncompressed values don't need them
+    z_stream *deflater()
+    {
+        if (!mDeflaterValid) {
+            mDeflaterValid = deflateInit(&mDeflater, s_level) == Z_OK;
+        } else {
+            deflateReset(&mDeflater);
+        }
+        return mDeflaterValid ? &mDeflater : nullptr;
+    }
+
+    z_stream *inflater()
+    {
+        if (!mInflaterValid) {
+            mInflaterValid = inflateInit(&mInflater) == Z_OK;
+        } else {
+            inflateReset(&mInflater);
+        }
+        return mInflaterValid ? &mInflater : nullptr;
+    }
+
+    Buffer encoded;
+    Buffer decoded;
+
+private:
+    z_stream mDeflater;
+    z_stream mInflater;
+    bool mDeflaterValid;
+    bool mInflaterValid;
+};
+
+static QThreadStorage<ThreadState*> sThreadStates;
+
+static ThreadState &threadState()
+{
+    if (!sThreadStates.hasLocalData()) {
+        sThreadStates.setLocalData(new ThreadState);
+    }
+    return *sThreadStates.localData();
+}
+
+static void writeHeader(uchar *header, Format format, quint32 size)
+{
+    memset(header, 0, headerSize);
+    header[0] = format;
+    memcpy(header + headerSize - sizeof(size), &size, sizeof(size));
+}
+
+void encode(const void *data, size_t size, const QByteArray &dictionary, const void *&encoded, size_t &encodedSize)
+{
+    auto &state = threadState();
+    uchar *buffer = state.encoded.reserve(headerSize + size);
+    const size_t minimumSize = dictionary.isEmpty() ? threshold : dictionaryThreshold;
+    if (size >= minimumSize && size <= std::numeric_limits<quint32>::max()) {
+        z_stream *stream = state.deflater();
+        if (stream && (dictionary.isEmpty() || deflateSetDictionary(stream, reinterpret_cast<const Bytef*>(dictionary.constData()), dictionary.size()) == Z_OK)) {
+            stream->next_in = static_cast<Bytef*>(const_cast<void*>(data));
+            stream->avail_in = size;
+            //The output is limited to the uncompressed size, if it doesn't fit the value is stored uncompressed
+            stream->next_out = buffer + headerSize;
+            stream->avail_out = size;
+            if (deflate(stream, Z_FINISH) == Z_STREAM_END) {
+                writeHeader(buffer, dictionary.isEmpty() ? Zlib : ZlibDictionary, size);
+                encoded = buffer;
+                encodedSize = headerSize + stream->total_out;
+                return;
+            }
+        }
+    }
+    writeHeader(buffer, Uncompressed, size);
+    memcpy(buffer + headerSize, data, size);
+    encoded = buffer;
+    encodedSize = headerSize + size;
+}
+
+bool decode(const void *value, size_t size, const std::function<QByteArray(quint32 id)> &dictionaryLookup, void *&data, size_t &dataSize)
+{
+    if (size < size_t(headerSize)) {
+        return false;
+    }
+    const uchar *header = static_cast<const uchar*>(value);
+    quint32 decodedSize;
+    memcpy(&decodedSize, header + headerSize - sizeof(decodedSize), sizeof(decodedSize));
+    const uchar *payload = header + headerSize;
+    const size_t payloadSize = size - headerSize;
+
+    switch (header[0]) {
+        case Uncompressed:
+            if (payloadSize != decodedSize) {
+                return false;
+            }
+            data = const_cast<uchar*>(payload);
+            dataSize = payloadSize;
+            return true;
+        case Zlib:
+        case ZlibDictionary: {
+            auto &state = threadState();
+            z_stream *stream = state.inflater();
+            if (!stream) {
+                return false;
+            }
+            uchar *buffer = state.decoded.reserve(qMax<size_t>(decodedSize, 1));
+            stream->next_in = const_cast<Bytef*>(payload);
+            stream->avail_in = payloadSize;
+            stream->next_out = buffer;
+            stream->avail_out = decodedSize;
+            int rc = inflate(stream, Z_FINISH);
+            if (rc == Z_NEED_DICT) {
+                //The stream refers to the dictionary by its id
+                const QByteArray dictionary = dictionaryLookup(stream->adler);
+                if (dictionary.isEmpty() || inflateSetDictionary(stream, reinterpret_cast<const Bytef*>(dictionary.constData()), dictionary.size()) != Z_OK) {
+                    qWarning() << "Missing compression dictionary " << stream->adler;
+                    return false;
+                }
+                rc = inflate(stream, Z_FINISH);
+            }
+            if (rc != Z_STREAM_END || stream->total_out != decodedSize) {
+                return false;
+            }
+            data = buffer;
+            dataSize = decodedSize;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool isTransient(const void *data)
+{
+    if (!sThreadStates.hasLocalData()) {
+        return false;
+    }
+    const Buffer &buffer = sThreadStates.localData()->decoded;
+    const uchar *p = static_cast<const uchar*>(data);
+    return buffer.data && p >= buffer.data && p < buffer.data + buffer.capacity;
+}
+
+quint32 dictionaryId(const QByteArray &dictionary)
+{
+    return adler32(adler32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(dictionary.constData()), dictionary.size());
+}
+
+}
+
+} // namespace Akonadi2
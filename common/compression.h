@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <akonadi2common_export.h>
+#include <QByteArray>
+#include <QtGlobal>
+#include <cstddef>
+#include <functional>
+
+namespace Akonadi2
+{
+
+/**
+ * The encoding of the values of a compressed storage (see Storage::enableCompression).
+ *
+ * Every value starts with a header of headerSize bytes: the format in the first byte, and the size of the payload once it is decoded in the last four.
+ * The header is as large as the largest scalar of a flatbuffer, so an uncompressed payload keeps the alignment of the value.
+ */
+namespace Compression
+{
+
+enum Format { Uncompressed = 0, Zlib = 1, ZlibDictionary = 2 };
+
+static const int headerSize = 8;
+//Smaller values rarely get smaller, so they are stored uncompressed
+static const int threshold = 512;
+//A dictionary provides what the values have in common, so even small values compress with it
+static const int dictionaryThreshold = 64;
+
+/**
+ * Encodes the value @param data, compressing it if it is large enough and gets smaller.
+ *
+ * If @param dictionary is not empty, it is used as preset dictionary of the compressor.
+ * The encoded value is written to a buffer of the calling thread, which is valid until the thread encodes the next value.
+ */
+void AKONADI2COMMON_EXPORT encode(const void *data, size_t size, const QByteArray &dictionary, const void *&encoded, size_t &encodedSize);
+
+/**
+ * Decodes the encoded @param value into @param data, returns false if the value is corrupt.
+ *
+ * Uncompressed payloads are returned in place. Compressed ones are decompressed into a buffer of the calling thread,
+ * which is valid until the thread decodes the next compressed value (see isTransient).
+ * The dictionary a value was compressed with is requested from @param dictionaryLookup by its id.
+ */
+bool AKONADI2COMMON_EXPORT decode(const void *value, size_t size, const std::function<QByteArray(quint32 id)> &dictionaryLookup, void *&data, size_t &dataSize);
+
+/**
+ * Whether @param data points into the buffer values are decompressed into by the calling thread.
+ */
+bool AKONADI2COMMON_EXPORT isTransient(const void *data);
+
+/**
+ * The id a value compressed with @param dictionary refers to it by, which is its Adler-32 checksum.
+ */
+quint32 AKONADI2COMMON_EXPORT dictionaryId(const QByteArray &dictionary);
+
+}
+
+} // namespace Akonadi2
@@ -22,37 +22,463 @@
 #include "entity_generated.h"
 #include <QVariant>
 #include <QString>
+#include <QSet>
 #include <functional>
 #include "clientapi.h" //for domain parts
+#include "querypredicate.h"
+#include "snapshot.h"
+#include "blobstore.h"
+
+/**
+ * Views the string field @param Field of a buffer.
+ */
+template<typename BufferType, flatbuffers::String const *(BufferType::*Field)() const>
+Akonadi2::Domain::PropertyView viewFromString(BufferType const *buffer)
+{
+    if (auto value = (buffer->*Field)()) {
+        return Akonadi2::Domain::PropertyView(value->c_str(), value->size());
+    }
+    return Akonadi2::Domain::PropertyView();
+}
+
+/**
+ * Views the byte vector @param Field of a buffer.
+ */
+template<typename BufferType, flatbuffers::Vector<uint8_t> const *(BufferType::*Field)() const>
+Akonadi2::Domain::PropertyView viewFromBytes(BufferType const *buffer)
+{
+    if (auto value = (buffer->*Field)()) {
+        return Akonadi2::Domain::PropertyView(reinterpret_cast<const char*>(value->Data()), value->size());
+    }
+    return Akonadi2::Domain::PropertyView();
+}
+
+/**
+ * Reads the scalar field @param Field of a buffer.
+ */
+template<typename BufferType, typename T, T (BufferType::*Field)() const>
+qint64 integerFromField(BufferType const *buffer)
+{
+    return static_cast<qint64>((buffer->*Field)());
+}
+
+template<typename BufferType, typename T, T (BufferType::*Field)() const>
+QVariant propertyFromInteger(BufferType const *buffer)
+{
+    return QVariant(static_cast<qint64>((buffer->*Field)()));
+}
+
+/**
+ * Reads the string field @param Field of a buffer as property.
+ */
+template<typename BufferType, flatbuffers::String const *(BufferType::*Field)() const>
+QVariant propertyFromString(BufferType const *buffer)
+{
+    if (auto value = (buffer->*Field)()) {
+        return QString::fromUtf8(value->c_str(), value->size());
+    }
+    return QVariant();
+}
+
+/**
+ * Reads the byte vector @param Field of a buffer as property.
+ */
+template<typename BufferType, flatbuffers::Vector<uint8_t> const *(BufferType::*Field)() const>
+QVariant propertyFromBytes(BufferType const *buffer)
+{
+    if (auto value = (buffer->*Field)()) {
+        return QByteArray(reinterpret_cast<const char*>(value->Data()), value->size());
+    }
+    return QVariant();
+}
 
 /**
  * The property mapper holds accessor functions for all properties.
  *
- * It is by default initialized with accessors that access the local-only buffer,
- * and resource simply have to overwrite those accessors.
+ * Properties are declared once in a static table (see setProperties), and are accessed by their index in that table.
+ * Resolve the property names to ids when preparing a query, reading a property by id is then a single indirect call.
+ * Accessors that are only known at runtime can still be added to mReadAccessors.
  */
 template<typename BufferType>
 class PropertyMapper
 {
 public:
+    typedef QVariant (*Accessor)(BufferType const *buffer);
+    typedef Akonadi2::Domain::PropertyView (*ViewAccessor)(BufferType const *buffer);
+    typedef qint64 (*IntegerAccessor)(BufferType const *buffer);
+
+    enum PropertyType {
+        StringProperty,
+        BytesProperty,
+        IntegerProperty
+    };
+
+    /**
+     * A property with the QVariant accessor for clients, and the typed accessor for its type.
+     *
+     * Use stringProperty, bytesProperty and integerProperty to declare them.
+     */
+    struct Property
+    {
+        const char *name;
+        PropertyType type;
+        Accessor read;
+        ViewAccessor view;
+        IntegerAccessor integer;
+    };
+
+    PropertyMapper()
+        : mProperties(nullptr),
+        mPropertyCount(0)
+    {
+    }
+
+    /**
+     * Declares the properties in @param properties, the index of a property in the table is its id.
+     *
+     * The table is not copied and has to outlive the mapper, typically it is a static constexpr array.
+     */
+    template<size_t N>
+    void setProperties(const Property (&properties)[N])
+    {
+        mProperties = properties;
+        mPropertyCount = N;
+        mPropertyIds.clear();
+        for (int i = 0; i < mPropertyCount; i++) {
+            mPropertyIds.insert(QString::fromLatin1(properties[i].name), i);
+        }
+    }
+
+    /**
+     * The id of the declared property @param key, or -1 if the property is not declared.
+     */
+    int propertyId(const QString &key) const
+    {
+        return mPropertyIds.value(key, -1);
+    }
+
+    QVariant getProperty(int id, BufferType const *buffer) const
+    {
+        Q_ASSERT(id >= 0 && id < mPropertyCount);
+        return mProperties[id].read(buffer);
+    }
+
+    /**
+     * The view accessor of a string or byte property, null for other properties.
+     */
+    ViewAccessor viewAccessor(int id) const
+    {
+        Q_ASSERT(id >= 0 && id < mPropertyCount);
+        return mProperties[id].view;
+    }
+
+    Akonadi2::Domain::PropertyView getStringView(int id, BufferType const *buffer) const
+    {
+        Q_ASSERT(id >= 0 && id < mPropertyCount);
+        const Property &property = mProperties[id];
+        return property.type == StringProperty ? property.view(buffer) : Akonadi2::Domain::PropertyView();
+    }
+
+    Akonadi2::Domain::PropertyView getBytes(int id, BufferType const *buffer) const
+    {
+        Q_ASSERT(id >= 0 && id < mPropertyCount);
+        const Property &property = mProperties[id];
+        return property.type == BytesProperty ? property.view(buffer) : Akonadi2::Domain::PropertyView();
+    }
+
+    bool getInteger(int id, BufferType const *buffer, qint64 &value) const
+    {
+        Q_ASSERT(id >= 0 && id < mPropertyCount);
+        const Property &property = mProperties[id];
+        if (property.type != IntegerProperty) {
+            return false;
+        }
+        value = property.integer(buffer);
+        return true;
+    }
+
+    bool hasProperty(const QString &key) const
+    {
+        return mPropertyIds.contains(key) || mReadAccessors.contains(key);
+    }
+
+    QStringList availableProperties() const
+    {
+        return mPropertyIds.keys() + mReadAccessors.keys();
+    }
+
     void setProperty(const QString &key, const QVariant &value, BufferType *buffer)
     {
-        if (mWriteAccessors.contains(key)) {
-            auto accessor = mWriteAccessors.value(key);
-            return accessor(value, buffer);
+        auto it = mWriteAccessors.constFind(key);
+        if (it != mWriteAccessors.constEnd()) {
+            return it.value()(value, buffer);
         }
     }
 
     virtual QVariant getProperty(const QString &key, BufferType const *buffer) const
     {
-        if (mReadAccessors.contains(key)) {
-            auto accessor = mReadAccessors.value(key);
-            return accessor(buffer);
+        const int id = propertyId(key);
+        if (id >= 0) {
+            return getProperty(id, buffer);
+        }
+        auto it = mReadAccessors.constFind(key);
+        if (it != mReadAccessors.constEnd()) {
+            return it.value()(buffer);
         }
         return QVariant();
     }
     QHash<QString, std::function<QVariant(BufferType const *)> > mReadAccessors;
     QHash<QString, std::function<void(const QVariant &, BufferType*)> > mWriteAccessors;
+
+private:
+    const Property *mProperties;
+    int mPropertyCount;
+    QHash<QString, int> mPropertyIds;
+};
+
+template<typename BufferType, flatbuffers::String const *(BufferType::*Field)() const>
+constexpr typename PropertyMapper<BufferType>::Property stringProperty(const char *name)
+{
+    return {name, PropertyMapper<BufferType>::StringProperty, &propertyFromString<BufferType, Field>, &viewFromString<BufferType, Field>, nullptr};
+}
+
+template<typename BufferType, flatbuffers::Vector<uint8_t> const *(BufferType::*Field)() const>
+constexpr typename PropertyMapper<BufferType>::Property bytesProperty(const char *name)
+{
+    return {name, PropertyMapper<BufferType>::BytesProperty, &propertyFromBytes<BufferType, Field>, &viewFromBytes<BufferType, Field>, nullptr};
+}
+
+template<typename BufferType, typename T, T (BufferType::*Field)() const>
+constexpr typename PropertyMapper<BufferType>::Property integerProperty(const char *name)
+{
+    return {name, PropertyMapper<BufferType>::IntegerProperty, &propertyFromInteger<BufferType, T, Field>, nullptr, &integerFromField<BufferType, T, Field>};
+}
+
+/**
+ * A property resolved to its id in the resource and the local mapper, an id is -1 if the mapper doesn't declare the property.
+ */
+struct ResolvedProperty
+{
+    QString name;
+    int resourceId;
+    int localId;
+};
+
+/**
+ * A buffer adaptor for a pair of local and resource buffers.
+ *
+ * A property is read from the resource buffer if the resource mapper declares it, and from the local buffer otherwise.
+ * The adaptors of the resources are generated from their schemas, see generate_adaptors().
+ *
+ * A property that was moved to the blob store is replaced by its reference in the property "<property>Ref",
+ * the blob is only read from @var mBlobs once the property is accessed.
+ */
+template<typename LocalBuffer, typename ResourceBuffer>
+class GenericBufferAdaptor : public Akonadi2::Domain::BufferAdaptor
+{
+public:
+    GenericBufferAdaptor()
+        : BufferAdaptor(),
+        mLocalBuffer(0),
+        mResourceBuffer(0)
+    {
+    }
+
+    /**
+     * The buffers are read-only, so this does nothing.
+     *
+     * Modifications are set on the domain object instead, and written to new buffers by the adaptor factory.
+     */
+    void setProperty(const QString &key, const QVariant &value) Q_DECL_OVERRIDE
+    {
+    }
+
+    virtual QVariant getProperty(const QString &key) const
+    {
+        const int resourceId = mResourceBuffer ? mResourceMapper->propertyId(key) : -1;
+        const int localId = mLocalBuffer ? mLocalMapper->propertyId(key) : -1;
+        QVariant value;
+        if (resourceId >= 0) {
+            value = mResourceMapper->getProperty(resourceId, mResourceBuffer);
+        } else if (localId >= 0) {
+            value = mLocalMapper->getProperty(localId, mLocalBuffer);
+        } else {
+            qWarning() << "no mapping available for key " << key;
+            return QVariant();
+        }
+        if (!value.isValid()) {
+            const QByteArray blob = readBlob(key);
+            if (!blob.isNull()) {
+                return blob;
+            }
+        }
+        return value;
+    }
+
+    virtual Akonadi2::Domain::PropertyView getStringView(const QString &key) const
+    {
+        if (mResourceBuffer) {
+            const int id = mResourceMapper->propertyId(key);
+            if (id >= 0) {
+                return mResourceMapper->getStringView(id, mResourceBuffer);
+            }
+        }
+        if (mLocalBuffer) {
+            const int id = mLocalMapper->propertyId(key);
+            if (id >= 0) {
+                return mLocalMapper->getStringView(id, mLocalBuffer);
+            }
+        }
+        return Akonadi2::Domain::PropertyView();
+    }
+
+    virtual Akonadi2::Domain::PropertyView getBytes(const QString &key) const
+    {
+        const int resourceId = mResourceBuffer ? mResourceMapper->propertyId(key) : -1;
+        const int localId = mLocalBuffer ? mLocalMapper->propertyId(key) : -1;
+        Akonadi2::Domain::PropertyView view;
+        if (resourceId >= 0) {
+            view = mResourceMapper->getBytes(resourceId, mResourceBuffer);
+        } else if (localId >= 0) {
+            view = mLocalMapper->getBytes(localId, mLocalBuffer);
+        }
+        if (view.isNull()) {
+            //The blob is kept by the adaptor, so the view is valid as long as the adaptor is
+            const QByteArray blob = readBlob(key);
+            if (!blob.isNull()) {
+                return Akonadi2::Domain::PropertyView(blob.constData(), blob.size());
+            }
+        }
+        return view;
+    }
+
+    virtual bool getInteger(const QString &key, qint64 &value) const
+    {
+        if (mResourceBuffer) {
+            const int id = mResourceMapper->propertyId(key);
+            if (id >= 0) {
+                return mResourceMapper->getInteger(id, mResourceBuffer, value);
+            }
+        }
+        if (mLocalBuffer) {
+            const int id = mLocalMapper->propertyId(key);
+            if (id >= 0) {
+                return mLocalMapper->getInteger(id, mLocalBuffer, value);
+            }
+        }
+        return false;
+    }
+
+    virtual QStringList availableProperties() const
+    {
+        QStringList props;
+        props << mResourceMapper->availableProperties();
+        props << mLocalMapper->availableProperties();
+        return props;
+    }
+
+    LocalBuffer const *mLocalBuffer;
+    ResourceBuffer const *mResourceBuffer;
+
+    QSharedPointer<PropertyMapper<LocalBuffer> > mLocalMapper;
+    QSharedPointer<PropertyMapper<ResourceBuffer> > mResourceMapper;
+    QSharedPointer<Akonadi2::BlobStore> mBlobs;
+
+private:
+    QByteArray readBlob(const QString &key) const
+    {
+        if (!mBlobs) {
+            return QByteArray();
+        }
+        if (mBlobCache.contains(key)) {
+            return mBlobCache.value(key);
+        }
+        const auto reference = getStringView(key + "Ref");
+        if (reference.isNull()) {
+            return QByteArray();
+        }
+        const QByteArray blob = mBlobs->read(reference.toByteArray());
+        mBlobCache.insert(key, blob);
+        return blob;
+    }
+
+    mutable QHash<QString, QByteArray> mBlobCache;
+};
+
+/**
+ * A buffer adaptor that decodes properties directly from the storage when they are accessed.
+ *
+ * It keeps the snapshot the entity was read in alive, so the buffers the wrapped adaptor points to stay valid.
+ * Only @param properties are accessible, modifications are kept in memory.
+ */
+class LazyBufferAdaptor : public Akonadi2::Domain::BufferAdaptor
+{
+public:
+    LazyBufferAdaptor(const QSharedPointer<Akonadi2::Domain::BufferAdaptor> &adaptor, const Akonadi2::Snapshot::Ptr &snapshot, const QStringList &properties)
+        : BufferAdaptor(),
+        mAdaptor(adaptor),
+        mSnapshot(snapshot),
+        mProperties(properties)
+    {
+    }
+
+    virtual QVariant getProperty(const QString &key) const
+    {
+        if (mChanges.contains(key)) {
+            return mChanges.value(key);
+        }
+        if (mProperties.contains(key)) {
+            return mAdaptor->getProperty(key);
+        }
+        return QVariant();
+    }
+
+    //Modified properties are no longer in the buffer, so they are only available through getProperty
+    virtual Akonadi2::Domain::PropertyView getStringView(const QString &key) const
+    {
+        if (!mChanges.contains(key) && mProperties.contains(key)) {
+            return mAdaptor->getStringView(key);
+        }
+        return Akonadi2::Domain::PropertyView();
+    }
+
+    virtual Akonadi2::Domain::PropertyView getBytes(const QString &key) const
+    {
+        if (!mChanges.contains(key) && mProperties.contains(key)) {
+            return mAdaptor->getBytes(key);
+        }
+        return Akonadi2::Domain::PropertyView();
+    }
+
+    virtual bool getInteger(const QString &key, qint64 &value) const
+    {
+        if (!mChanges.contains(key) && mProperties.contains(key)) {
+            return mAdaptor->getInteger(key, value);
+        }
+        return false;
+    }
+
+    virtual void setProperty(const QString &key, const QVariant &value)
+    {
+        mChanges.insert(key, value);
+    }
+
+    virtual QStringList availableProperties() const
+    {
+        QStringList props = mProperties;
+        for (const auto &key : mChanges.keys()) {
+            if (!props.contains(key)) {
+                props << key;
+            }
+        }
+        return props;
+    }
+
+private:
+    QSharedPointer<Akonadi2::Domain::BufferAdaptor> mAdaptor;
+    Akonadi2::Snapshot::Ptr mSnapshot;
+    QStringList mProperties;
+    QHash<QString, QVariant> mChanges;
 };
 
 //The factory should define how to go from an entitybuffer (local + resource buffer), to a domain type adapter.
@@ -68,11 +494,150 @@ class DomainTypeAdaptorFactory/* <typename DomainType, LocalBuffer, ResourceBuff
 {
 public:
     virtual QSharedPointer<Akonadi2::Domain::BufferAdaptor> createAdaptor(const Akonadi2::Entity &entity) = 0;
-    virtual void createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb) {};
+    /**
+     * Creates an adaptor that only verifies the buffers of @param entity if @param verify is set.
+     *
+     * Buffers read from a trusted storage don't need to be verified again (see Akonadi2::EntityBuffer::verificationRequired).
+     */
+    virtual QSharedPointer<Akonadi2::Domain::BufferAdaptor> createAdaptor(const Akonadi2::Entity &entity, bool verify)
+    {
+        return createAdaptor(entity);
+    }
+
+    /**
+     * Builds the entity buffer of @param event in place, as nested buffer of the empty builder @param fbb.
+     *
+     * The returned vector can be added directly to the command that carries the entity.
+     */
+    virtual flatbuffers::Offset<flatbuffers::Vector<uint8_t> > createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb) { return flatbuffers::Offset<flatbuffers::Vector<uint8_t> >(); };
+
+    /**
+     * Resolves the filtered properties to the view accessors of the local and resource mapper.
+     *
+     * Like the adaptors, a property is resolved to the resource buffer if the resource mapper declares it.
+     * Filtering on a property that has no view accessor matches nothing.
+     */
+    virtual QueryPredicate<LocalBuffer, ResourceBuffer> createPredicate(const QHash<QString, QVariant> &propertyFilter) const
+    {
+        QueryPredicate<LocalBuffer, ResourceBuffer> predicate;
+        for (auto it = propertyFilter.constBegin(); it != propertyFilter.constEnd(); ++it) {
+            const QByteArray value = it.value().toByteArray();
+            const int resourceId = mResourceMapper ? mResourceMapper->propertyId(it.key()) : -1;
+            const int localId = mLocalMapper ? mLocalMapper->propertyId(it.key()) : -1;
+            if (resourceId >= 0 && mResourceMapper->viewAccessor(resourceId)) {
+                predicate.addResourceFilter(mResourceMapper->viewAccessor(resourceId), value);
+            } else if (localId >= 0 && mLocalMapper->viewAccessor(localId)) {
+                predicate.addLocalFilter(mLocalMapper->viewAccessor(localId), value);
+            } else {
+                qWarning() << "Can't filter on property " << it.key();
+                predicate.setMatchNothing();
+            }
+        }
+        return predicate;
+    }
+
+    /**
+     * Resolves a sort property to the field of the local or resource buffer.
+     *
+     * Resources have to implement this to support sorting, the returned field is invalid if the property can't be sorted on.
+     */
+    virtual QuerySortField<LocalBuffer, ResourceBuffer> createSortField(const QString &property) const
+    {
+        return QuerySortField<LocalBuffer, ResourceBuffer>();
+    }
+
+    /**
+     * Resolves the properties requested by a query to the properties that are copied into each result.
+     *
+     * If nothing is requested all mapped properties are returned, except for the ones in mOnDemandProperties.
+     * Those are only loaded if explicitly requested, i.e. by a follow-up query by id.
+     */
+    QStringList resolveRequestedProperties(const QSet<QString> &requestedProperties) const
+    {
+        QSet<QString> available;
+        if (mLocalMapper) {
+            available += mLocalMapper->availableProperties().toSet();
+        }
+        if (mResourceMapper) {
+            available += mResourceMapper->availableProperties().toSet();
+        }
+        if (requestedProperties.isEmpty()) {
+            return (available - mOnDemandProperties).toList();
+        }
+        return (available & requestedProperties).toList();
+    }
+
+    /**
+     * Resolves @param properties to the ids of the mappers once, so copying them into each result doesn't have to look them up by name.
+     */
+    QVector<ResolvedProperty> resolveProperties(const QStringList &properties) const
+    {
+        QVector<ResolvedProperty> resolved;
+        resolved.reserve(properties.size());
+        for (const auto &property : properties) {
+            ResolvedProperty p;
+            p.name = property;
+            p.resourceId = mResourceMapper ? mResourceMapper->propertyId(property) : -1;
+            p.localId = mLocalMapper ? mLocalMapper->propertyId(property) : -1;
+            resolved << p;
+        }
+        return resolved;
+    }
+
+    /**
+     * Copies the resolved @param properties from the buffers into a memory adaptor.
+     *
+     * Like the adaptors, a property is read from the resource buffer if it provides it, and from the local buffer otherwise.
+     */
+    QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor> copyProperties(const QVector<ResolvedProperty> &properties, LocalBuffer const *localBuffer, ResourceBuffer const *resourceBuffer) const
+    {
+        auto adaptor = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create();
+        for (const auto &property : properties) {
+            QVariant value;
+            if (resourceBuffer && property.resourceId >= 0) {
+                value = mResourceMapper->getProperty(property.resourceId, resourceBuffer);
+            } else if (localBuffer && property.localId >= 0) {
+                value = mLocalMapper->getProperty(property.localId, localBuffer);
+            } else if (resourceBuffer && mResourceMapper && mResourceMapper->hasProperty(property.name)) {
+                //Accessors that were registered at runtime have no id
+                value = mResourceMapper->getProperty(property.name, resourceBuffer);
+            } else if (localBuffer && mLocalMapper) {
+                value = mLocalMapper->getProperty(property.name, localBuffer);
+            }
+            if (!value.isValid() && mBlobs) {
+                value = readBlob(property.name, localBuffer, resourceBuffer);
+            }
+            adaptor->setProperty(property.name, value);
+        }
+        return adaptor;
+    }
 
 protected:
+    /**
+     * Reads the blob that replaced @param property, see GenericBufferAdaptor.
+     */
+    QVariant readBlob(const QString &property, LocalBuffer const *localBuffer, ResourceBuffer const *resourceBuffer) const
+    {
+        const QString refProperty = property + "Ref";
+        QVariant reference;
+        if (resourceBuffer && mResourceMapper && mResourceMapper->hasProperty(refProperty)) {
+            reference = mResourceMapper->getProperty(refProperty, resourceBuffer);
+        } else if (localBuffer && mLocalMapper && mLocalMapper->hasProperty(refProperty)) {
+            reference = mLocalMapper->getProperty(refProperty, localBuffer);
+        }
+        if (!reference.isValid()) {
+            return QVariant();
+        }
+        const QByteArray blob = mBlobs->read(reference.toByteArray());
+        return blob.isNull() ? QVariant() : QVariant(blob);
+    }
+
     QSharedPointer<PropertyMapper<LocalBuffer> > mLocalMapper;
     QSharedPointer<PropertyMapper<ResourceBuffer> > mResourceMapper;
+    //Large properties that are not loaded unless requested
+    QSet<QString> mOnDemandProperties;
+    //The blob store of the resource, if its entities can reference blobs
+    QSharedPointer<Akonadi2::BlobStore> mBlobs;
 };
 
 
@@ -3,19 +3,28 @@
 #include "entity_generated.h"
 #include "metadata_generated.h"
 #include <QDebug>
+#include <QtGlobal>
 
 using namespace Akonadi2;
 
-EntityBuffer::EntityBuffer(void *dataValue, int dataSize)
+bool EntityBuffer::verificationRequired(qint64 storedSchemaVersion)
+{
+    static const bool forced = qEnvironmentVariableIsSet("AKONADI2_VERIFY_BUFFERS");
+    return forced || storedSchemaVersion != schemaVersion;
+}
+
+EntityBuffer::EntityBuffer(void *dataValue, int dataSize, bool verify)
     : mEntity(nullptr)
 {
-    flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(dataValue), dataSize);
-    // Q_ASSERT(Akonadi2::VerifyEntity(verifyer));
-    if (!Akonadi2::VerifyEntityBuffer(verifyer)) {
-        qWarning() << "invalid buffer";
-    } else {
-        mEntity = Akonadi2::GetEntity(dataValue);
+    if (verify) {
+        flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(dataValue), dataSize);
+        // Q_ASSERT(Akonadi2::VerifyEntity(verifyer));
+        if (!Akonadi2::VerifyEntityBuffer(verifyer)) {
+            qWarning() << "invalid buffer";
+            return;
+        }
     }
+    mEntity = Akonadi2::GetEntity(dataValue);
 }
 
 const Akonadi2::Entity &EntityBuffer::entity()
@@ -56,17 +65,40 @@ void EntityBuffer::extractResourceBuffer(void *dataValue, int dataSize, const st
     }
 }
 
-void EntityBuffer::assembleEntityBuffer(flatbuffers::FlatBufferBuilder &fbb, void const *metadataData, size_t metadataSize, void const *resourceData, size_t resourceSize, void const *localData, size_t localSize)
+flatbuffers::Offset<flatbuffers::Vector<uint8_t> > EntityBuffer::createNestedBuffer(flatbuffers::FlatBufferBuilder &fbb, void const *data, size_t size)
+{
+    fbb.StartVector(size, sizeof(uint8_t));
+    //Raises the alignment of the whole buffer, and pads so the data starts aligned once it is pushed.
+    //The length is pushed right before the data, which is aligned for it as well.
+    fbb.Align(bufferAlignment);
+    fbb.PreAlign(size, bufferAlignment);
+    fbb.PushBytes(static_cast<uint8_t const*>(data), size);
+    return flatbuffers::Offset<flatbuffers::Vector<uint8_t> >(fbb.EndVector(size));
+}
+
+flatbuffers::Offset<Entity> EntityBuffer::createEntity(flatbuffers::FlatBufferBuilder &fbb, flatbuffers::Offset<flatbuffers::Vector<uint8_t> > metadata, flatbuffers::Offset<flatbuffers::Vector<uint8_t> > resource, flatbuffers::Offset<flatbuffers::Vector<uint8_t> > local)
 {
-    auto metadata = fbb.CreateVector<uint8_t>(static_cast<uint8_t const*>(metadataData), metadataSize);
-    auto resource = fbb.CreateVector<uint8_t>(static_cast<uint8_t const*>(resourceData), resourceSize);
-    auto local = fbb.CreateVector<uint8_t>(static_cast<uint8_t const*>(localData), localSize);
+    //Readers expect all buffers to be there, readBuffer treats the empty ones as missing
+    if (!metadata.o) {
+        metadata = fbb.CreateVector<uint8_t>(nullptr, 0);
+    }
+    if (!resource.o) {
+        resource = fbb.CreateVector<uint8_t>(nullptr, 0);
+    }
+    if (!local.o) {
+        local = fbb.CreateVector<uint8_t>(nullptr, 0);
+    }
     auto builder = Akonadi2::EntityBuilder(fbb);
     builder.add_metadata(metadata);
     builder.add_resource(resource);
     builder.add_local(local);
-
-    auto buffer = builder.Finish();
-    Akonadi2::FinishEntityBuffer(fbb, buffer);
+    return builder.Finish();
 }
 
+void EntityBuffer::assembleEntityBuffer(flatbuffers::FlatBufferBuilder &fbb, void const *metadataData, size_t metadataSize, void const *resourceData, size_t resourceSize, void const *localData, size_t localSize)
+{
+    auto metadata = createNestedBuffer(fbb, metadataData, metadataSize);
+    auto resource = createNestedBuffer(fbb, resourceData, resourceSize);
+    auto local = createNestedBuffer(fbb, localData, localSize);
+    Akonadi2::FinishEntityBuffer(fbb, createEntity(fbb, metadata, resource, local));
+}
@@ -2,18 +2,94 @@
 
 #include <functional>
 #include <flatbuffers/flatbuffers.h>
+#include <QtGlobal>
 
 namespace Akonadi2 {
 class Entity;
 
 class EntityBuffer {
 public:
-    EntityBuffer(void *dataValue, int size);
+    /**
+     * The version the pipeline tags a storage with (see Storage::schemaVersion).
+     *
+     * The pipeline verifies all buffers before it writes them, so buffers read from a storage with this tag don't have to be verified again.
+     * Bump it whenever that guarantee changes, storages with another tag are verified on read.
+     */
+    static const qint64 schemaVersion = 1;
+
+    /**
+     * Whether buffers read from a storage tagged with @param storedSchemaVersion have to be verified.
+     *
+     * Set the AKONADI2_VERIFY_BUFFERS environment variable to always verify, i.e. to track down a corrupted storage.
+     */
+    static bool verificationRequired(qint64 storedSchemaVersion);
+
+    /**
+     * The alignment of the buffers nested in an entity, relative to the start of the entity buffer.
+     *
+     * Nested buffers are [ubyte] vectors, which by themselves only align their length to 4 bytes,
+     * so the data is padded to make the 64bit scalars of the nested buffers (like Metadata::revision) safe to read in place.
+     * An entity buffer is aligned the same way in the builder, so the alignment holds in memory as long as the entity buffer is stored aligned.
+     */
+    static const size_t bufferAlignment = sizeof(flatbuffers::largest_scalar_t);
+
+    /**
+     * Returns the root of the buffer nested in @param data, or null if @param verify is set and the buffer is invalid.
+     *
+     * An empty vector is treated as a missing buffer.
+     */
+    template<typename T>
+    static T const *readBuffer(const flatbuffers::Vector<uint8_t> *data, bool (*verifyBuffer)(flatbuffers::Verifier &), T const *(*getBuffer)(const void *), bool verify = true)
+    {
+        if (!data || data->size() == 0) {
+            return nullptr;
+        }
+        if (verify) {
+            flatbuffers::Verifier verifyer(data->Data(), data->size());
+            if (!verifyBuffer(verifyer)) {
+                return nullptr;
+            }
+        }
+        return getBuffer(data->Data());
+    }
+
+    EntityBuffer(void *dataValue, int size, bool verify = true);
     const uint8_t *resourceBuffer();
     const uint8_t *metadataBuffer();
     const uint8_t *localBuffer();
     const Entity &entity();
 
+    /**
+     * Finishes the buffer with the root @param root in place, and returns it as [ubyte] vector that can be nested in a table of @param fbb.
+     *
+     * Everything built in @param fbb so far becomes part of the nested buffer, which saves building it in a builder of its own and copying it.
+     * Since the builder shares identical vtables between all tables, a nested buffer has to be built first,
+     * otherwise its tables could refer to vtables outside of it.
+     * Pass the @param fileIdentifier of the schema if it declares one, as the generated Finish function would.
+     */
+    template<typename T>
+    static flatbuffers::Offset<flatbuffers::Vector<uint8_t> > finishNestedBuffer(flatbuffers::FlatBufferBuilder &fbb, flatbuffers::Offset<T> root, const char *fileIdentifier = nullptr)
+    {
+        //Like FlatBufferBuilder::Finish, but the root offset is followed by the length of the vector instead of the end of the buffer
+        fbb.Align(bufferAlignment);
+        fbb.PreAlign(sizeof(flatbuffers::uoffset_t) + (fileIdentifier ? flatbuffers::kFileIdentifierLength : 0), bufferAlignment);
+        if (fileIdentifier) {
+            fbb.PushBytes(reinterpret_cast<const uint8_t *>(fileIdentifier), flatbuffers::kFileIdentifierLength);
+        }
+        fbb.PushElement(fbb.ReferTo(root.o));
+        return flatbuffers::Offset<flatbuffers::Vector<uint8_t> >(fbb.PushElement(static_cast<flatbuffers::uoffset_t>(fbb.GetSize())));
+    }
+
+    /**
+     * Copies the finished buffer @param data into @param fbb as [ubyte] vector, with the data aligned to bufferAlignment.
+     */
+    static flatbuffers::Offset<flatbuffers::Vector<uint8_t> > createNestedBuffer(flatbuffers::FlatBufferBuilder &fbb, void const *data, size_t size);
+
+    /**
+     * Builds the entity table from nested buffers that are already in @param fbb, missing buffers are stored as empty vectors.
+     */
+    static flatbuffers::Offset<Entity> createEntity(flatbuffers::FlatBufferBuilder &fbb, flatbuffers::Offset<flatbuffers::Vector<uint8_t> > metadata, flatbuffers::Offset<flatbuffers::Vector<uint8_t> > resource, flatbuffers::Offset<flatbuffers::Vector<uint8_t> > local);
+
     static void extractResourceBuffer(void *dataValue, int dataSize, const std::function<void(const uint8_t *, size_t size)> &handler);
     static void assembleEntityBuffer(flatbuffers::FlatBufferBuilder &fbb, void const *metadataData, size_t metadataSize, void const *resourceData, size_t resourceSize, void const *localData, size_t localSize);
 
@@ -14,10 +14,45 @@ void Index::add(const QByteArray &key, const QByteArray &value)
     mStorage.commitTransaction();
 }
 
+void Index::remove(const QByteArray &key, const QByteArray &value)
+{
+    //Removing a key removes all of its values, so the remaining ones are written again in the same transaction
+    mStorage.startTransaction(Akonadi2::Storage::ReadWrite);
+    bool found = false;
+    QList<QByteArray> remaining;
+    mStorage.scan(key.data(), key.size(), [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        //The scan starts at the next larger key if the key doesn't exist
+        if (QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize) != key) {
+            return false;
+        }
+        const QByteArray existing(static_cast<char*>(valuePtr), valueSize);
+        if (existing == value) {
+            found = true;
+        } else {
+            remaining << existing;
+        }
+        return true;
+    },
+    [](const Akonadi2::Storage::Error &error) {
+        qDebug() << "Error while removing value" << QString::fromStdString(error.message);
+    });
+    if (found) {
+        mStorage.remove(key.data(), key.size());
+        for (const auto &existing : remaining) {
+            mStorage.write(key.data(), key.size(), existing.data(), existing.size());
+        }
+    }
+    mStorage.commitTransaction();
+}
+
 void Index::lookup(const QByteArray &key, const std::function<void(const QByteArray &value)> &resultHandler,
                                           const std::function<void(const Error &error)> &errorHandler)
 {
-    mStorage.scan(key.data(), key.size(), [this, resultHandler](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+    mStorage.scan(key.data(), key.size(), [this, key, resultHandler](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        //The scan starts at the next larger key if the key doesn't exist
+        if (QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize) != key) {
+            return false;
+        }
         resultHandler(QByteArray(static_cast<char*>(valuePtr), valueSize));
         return true;
     },
@@ -24,7 +24,7 @@ public:
     Index(const QString &storageRoot, const QString &name, Akonadi2::Storage::AccessMode mode = Akonadi2::Storage::ReadOnly);
 
     void add(const QByteArray &key, const QByteArray &value);
-    // void remove(const QByteArray &key, const QByteArray &value);
+    void remove(const QByteArray &key, const QByteArray &value);
 
     void lookup(const QByteArray &key, const std::function<void(const QByteArray &value)> &resultHandler,
                                        const std::function<void(const Error &error)> &errorHandler);
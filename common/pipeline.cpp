@@ -25,10 +25,16 @@
 #include <QVector>
 #include <QUuid>
 #include <QDebug>
+#include <QFutureWatcher>
+#include <QtConcurrent/QtConcurrentRun>
 #include "entity_generated.h"
 #include "metadata_generated.h"
 #include "createentity_generated.h"
+#include "modifyentity_generated.h"
+#include "deleteentity_generated.h"
 #include "entitybuffer.h"
+#include "builderpool.h"
+#include "blobstore.h"
 #include "async/src/async.h"
 
 namespace Akonadi2
@@ -38,24 +44,172 @@ class Pipeline::Private
 {
 public:
     Private(const QString &resourceName)
-        : storage(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", resourceName, Storage::ReadWrite),
+        : storageRoot(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage"),
+          resourceName(resourceName),
+          storage(storageRoot, resourceName, Storage::ReadWrite),
+          blobs(storageRoot, resourceName, Storage::ReadWrite),
           stepScheduled(false)
     {
     }
 
+    const QString storageRoot;
+    const QString resourceName;
     Storage storage;
+    BlobStore blobs;
     QHash<QString, QVector<Preprocessor *> > nullPipeline;
     QHash<QString, QVector<Preprocessor *> > newPipeline;
     QHash<QString, QVector<Preprocessor *> > modifiedPipeline;
     QHash<QString, QVector<Preprocessor *> > deletedPipeline;
+    QHash<QString, std::function<bool(const Akonadi2::Entity &)> > bufferVerifiers;
+    QHash<QString, std::function<QVector<QByteArray>(const Akonadi2::Entity &, BlobStore &, flatbuffers::FlatBufferBuilder &, flatbuffers::FlatBufferBuilder &)> > blobExtractors;
+    QHash<QString, std::function<bool(const Akonadi2::Entity &, const Akonadi2::Entity &, const QStringList &, flatbuffers::FlatBufferBuilder &, flatbuffers::FlatBufferBuilder &)> > entityMergers;
     QVector<PipelineState> activePipelines;
     bool stepScheduled;
+
+    Akonadi2::Entity const *verifyEntity(const QString &entityType, const flatbuffers::Vector<uint8_t> *data);
+    bool storeEntity(const QByteArray &key, const QString &entityType, const Akonadi2::Entity &entity, Storage::ChangeType changeType);
+    QVector<QByteArray> storedBlobReferences(const QByteArray &key, bool &found);
+    void releaseBlobs(const QVector<QByteArray> &references);
 };
 
+//Verifies the entity buffer @param data of a command. This is the only place buffers are verified, from here on they are trusted
+Akonadi2::Entity const *Pipeline::Private::verifyEntity(const QString &entityType, const flatbuffers::Vector<uint8_t> *data)
+{
+    if (!data) {
+        qWarning() << "invalid buffer, no entity buffer";
+        return nullptr;
+    }
+    {
+        flatbuffers::Verifier verifyer(data->Data(), data->size());
+        if (!Akonadi2::VerifyEntityBuffer(verifyer)) {
+            qWarning() << "invalid buffer, not an entity buffer";
+            return nullptr;
+        }
+    }
+    auto entity = Akonadi2::GetEntity(data->Data());
+    const auto bufferVerifier = bufferVerifiers.value(entityType);
+    if (!bufferVerifier) {
+        //Readers have to verify the buffers of this storage from now on
+        if (storage.schemaVersion() >= 0) {
+            qWarning() << "No buffer verifier for entity type " << entityType << ", the stored buffers can no longer be trusted";
+            storage.setSchemaVersion(-1);
+        }
+    } else if (!bufferVerifier(*entity)) {
+        qWarning() << "invalid buffer, not a valid " << entityType;
+        return nullptr;
+    }
+    return entity;
+}
+
+//Writes @param entity with new metadata as the next revision of @param key, after moving its large values to the blob store
+bool Pipeline::Private::storeEntity(const QByteArray &key, const QString &entityType, const Akonadi2::Entity &entity, Storage::ChangeType changeType)
+{
+    const qint64 newRevision = storage.maxRevision() + 1;
+
+    const uint8_t *resourceData = entity.resource()->Data();
+    size_t resourceSize = entity.resource()->size();
+    const uint8_t *localData = entity.local()->Data();
+    size_t localSize = entity.local()->size();
+    //The blobs are added before the entity is written, so a crash in between leaks them instead of leaving dangling references
+    BuilderPool::Builder resourceBuilder;
+    BuilderPool::Builder localBuilder;
+    QVector<QByteArray> references;
+    const auto blobExtractor = blobExtractors.value(entityType);
+    if (blobExtractor) {
+        references = blobExtractor(entity, blobs, *resourceBuilder, *localBuilder);
+        if (!references.isEmpty()) {
+            resourceData = resourceBuilder->GetBufferPointer();
+            resourceSize = resourceBuilder->GetSize();
+            localData = localBuilder->GetBufferPointer();
+            localSize = localBuilder->GetSize();
+        }
+    }
+
+    //Add metadata buffer, it is built first so it can be built in place
+    BuilderPool::Builder builder;
+    auto &fbb = *builder;
+    //The metadata keeps the references, so they can be released without knowing the type of the entity
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String> > > blobReferences;
+    if (!references.isEmpty()) {
+        std::vector<flatbuffers::Offset<flatbuffers::String> > referenceStrings;
+        for (const auto &reference : references) {
+            referenceStrings.push_back(fbb.CreateString(reference.constData(), reference.size()));
+        }
+        blobReferences = fbb.CreateVector(referenceStrings);
+    }
+    auto metadataBuilder = Akonadi2::MetadataBuilder(fbb);
+    metadataBuilder.add_revision(newRevision);
+    metadataBuilder.add_processed(false);
+    metadataBuilder.add_blobs(blobReferences);
+    auto metadata = EntityBuffer::finishNestedBuffer(fbb, metadataBuilder.Finish());
+    //TODO we should reserve some space in metadata for in-place updates
+
+    auto resource = EntityBuffer::createNestedBuffer(fbb, resourceData, resourceSize);
+    auto local = EntityBuffer::createNestedBuffer(fbb, localData, localSize);
+    Akonadi2::FinishEntityBuffer(fbb, EntityBuffer::createEntity(fbb, metadata, resource, local));
+
+    //The entity, its changelog entry and the revision are written in one transaction, so readers never see one without the other
+    storage.startTransaction(Storage::ReadWrite);
+    //Allows live queries to only read what changed since they last looked
+    const bool written = storage.write(key.data(), key.size(), fbb.GetBufferPointer(), fbb.GetSize())
+                      && storage.recordChange(newRevision, changeType, key)
+                      && storage.setMaxRevision(newRevision);
+    if (!written) {
+        qWarning() << "Pipeline: failed to write entity " << key;
+        storage.abortTransaction();
+        releaseBlobs(references);
+        return false;
+    }
+    if (!storage.commitTransaction()) {
+        releaseBlobs(references);
+        return false;
+    }
+    qDebug() << "Pipeline: wrote entity: "<< newRevision;
+    return true;
+}
+
+//The blob references the stored entity @param key holds
+QVector<QByteArray> Pipeline::Private::storedBlobReferences(const QByteArray &key, bool &found)
+{
+    QVector<QByteArray> references;
+    found = false;
+    storage.scan(key.constData(), key.size(), [&](void *, int, void *dataValue, int dataSize) -> bool {
+        found = true;
+        EntityBuffer buffer(dataValue, dataSize, EntityBuffer::verificationRequired(storage.schemaVersion()));
+        auto metadata = EntityBuffer::readBuffer(buffer.entity().metadata(), &Akonadi2::VerifyMetadataBuffer, &Akonadi2::GetMetadata);
+        if (metadata && metadata->blobs()) {
+            for (flatbuffers::uoffset_t i = 0; i < metadata->blobs()->size(); i++) {
+                const auto reference = metadata->blobs()->Get(i);
+                references << QByteArray(reference->c_str(), reference->size());
+            }
+        }
+        return false;
+    },
+    [](const Storage::Error &) {
+        //A missing entity is reported through found
+    });
+    return references;
+}
+
+//Releases the references of an entity once it is no longer stored, so a crash before leaks the blobs instead of leaving dangling references
+void Pipeline::Private::releaseBlobs(const QVector<QByteArray> &references)
+{
+    for (const auto &reference : references) {
+        blobs.release(reference);
+    }
+}
+
 Pipeline::Pipeline(const QString &resourceName, QObject *parent)
     : QObject(parent),
       d(new Private(resourceName))
 {
+    //A new storage only ever contains buffers that were verified before they were written, so readers can trust them.
+    //Storages that already contain entities stay untagged, and are verified on read.
+    if (d->storage.schemaVersion() < 0 && d->storage.maxRevision() == 0) {
+        d->storage.setSchemaVersion(EntityBuffer::schemaVersion);
+    }
+    //Since readers no longer verify the buffers, corruption is only detected by scrubbing the stored values
+    d->storage.setChecksumsEnabled(true);
 }
 
 Pipeline::~Pipeline()
@@ -80,6 +234,21 @@ void Pipeline::setPreprocessors(const QString &entityType, Type pipelineType, co
     };
 }
 
+void Pipeline::setBufferVerifier(const QString &entityType, const std::function<bool(const Akonadi2::Entity &entity)> &verifier)
+{
+    d->bufferVerifiers.insert(entityType, verifier);
+}
+
+void Pipeline::setBlobExtractor(const QString &entityType, const std::function<QVector<QByteArray>(const Akonadi2::Entity &entity, BlobStore &blobs, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb)> &extractor)
+{
+    d->blobExtractors.insert(entityType, extractor);
+}
+
+void Pipeline::setEntityMerger(const QString &entityType, const std::function<bool(const Akonadi2::Entity &current, const Akonadi2::Entity &delta, const QStringList &deletions, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb)> &merger)
+{
+    d->entityMergers.insert(entityType, merger);
+}
+
 Storage &Pipeline::storage() const
 {
     return d->storage;
@@ -100,8 +269,6 @@ Async::Job<void> Pipeline::newEntity(void const *command, size_t size)
     //TODO toRFC4122 would probably be more efficient, but results in non-printable keys.
     const auto key = QUuid::createUuid().toString().toUtf8();
 
-    const qint64 newRevision = storage().maxRevision() + 1;
-
     {
         flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(command), size);
         if (!Akonadi2::Commands::VerifyCreateEntityBuffer(verifyer)) {
@@ -113,52 +280,193 @@ Async::Job<void> Pipeline::newEntity(void const *command, size_t size)
 
     //TODO rename createEntitiy->domainType to bufferType
     const QString entityType = QString::fromUtf8(reinterpret_cast<char const*>(createEntity->domainType()->Data()), createEntity->domainType()->size());
+    auto entity = d->verifyEntity(entityType, createEntity->delta());
+    if (!entity) {
+        return Async::error<void>();
+    }
+
+    if (!d->storeEntity(key, entityType, *entity, Storage::EntityCreated)) {
+        qWarning() << "Pipeline: failed to write entity " << key;
+        return Async::error<void>();
+    }
+
+    return Async::start<void>([this, key, entityType](Async::Future<void> &future) {
+        PipelineState state(this, NewPipeline, key, d->newPipeline[entityType], [&future]() {
+            future.setFinished();
+        });
+        d->activePipelines << state;
+        state.step();
+    });
+}
+
+Async::Job<void> Pipeline::modifiedEntity(void const *command, size_t size)
+{
+    qDebug() << "Pipeline: Modified Entity";
+
     {
-        flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(createEntity->delta()->Data()), createEntity->delta()->size());
-        if (!Akonadi2::VerifyEntityBuffer(verifyer)) {
-            qWarning() << "invalid buffer, not an entity buffer";
+        flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(command), size);
+        if (!Akonadi2::VerifyModifyEntityBuffer(verifyer)) {
+            qWarning() << "invalid buffer, not a modify entity buffer";
             return Async::error<void>();
         }
     }
-    auto entity = Akonadi2::GetEntity(createEntity->delta()->Data());
+    auto modifyEntity = Akonadi2::GetModifyEntity(command);
+    if (!modifyEntity->entityId() || !modifyEntity->domainType()) {
+        qWarning() << "invalid buffer, the modified entity is not specified";
+        return Async::error<void>();
+    }
 
-    //Add metadata buffer
-    flatbuffers::FlatBufferBuilder metadataFbb;
-    auto metadataBuilder = Akonadi2::MetadataBuilder(metadataFbb);
-    metadataBuilder.add_revision(newRevision);
-    metadataBuilder.add_processed(false);
-    auto metadataBuffer = metadataBuilder.Finish();
-    Akonadi2::FinishMetadataBuffer(metadataFbb, metadataBuffer);
-    //TODO we should reserve some space in metadata for in-place updates
+    const QByteArray key(modifyEntity->entityId()->c_str(), modifyEntity->entityId()->size());
+    const QString entityType = QString::fromUtf8(modifyEntity->domainType()->c_str(), modifyEntity->domainType()->size());
+    auto delta = d->verifyEntity(entityType, modifyEntity->delta());
+    if (!delta) {
+        return Async::error<void>();
+    }
+    const auto merger = d->entityMergers.value(entityType);
+    if (!merger) {
+        qWarning() << "Pipeline: no merger for entity type " << entityType;
+        return Async::error<void>();
+    }
+    QStringList deletions;
+    if (modifyEntity->deletions()) {
+        for (flatbuffers::uoffset_t i = 0; i < modifyEntity->deletions()->size(); i++) {
+            const auto deletion = modifyEntity->deletions()->Get(i);
+            deletions << QString::fromUtf8(deletion->c_str(), deletion->size());
+        }
+    }
 
-    flatbuffers::FlatBufferBuilder fbb;
-    EntityBuffer::assembleEntityBuffer(fbb, metadataFbb.GetBufferPointer(), metadataFbb.GetSize(), entity->resource()->Data(), entity->resource()->size(), entity->local()->Data(), entity->local()->size());
+    //The current entity is merged with the delta, and replaced by the result
+    bool found = false;
+    const auto previousReferences = d->storedBlobReferences(key, found);
+    BuilderPool::Builder resourceBuilder;
+    BuilderPool::Builder localBuilder;
+    bool merged = false;
+    //The preprocessors get the previous entity as well, so e.g. indexes can remove the previous values
+    QByteArray previousEntity;
+    storage().scan(key.constData(), key.size(), [&](void *, int, void *dataValue, int dataSize) -> bool {
+        EntityBuffer current(dataValue, dataSize, EntityBuffer::verificationRequired(storage().schemaVersion()));
+        merged = merger(current.entity(), *delta, deletions, *resourceBuilder, *localBuilder);
+        if (merged) {
+            previousEntity = QByteArray(static_cast<char*>(dataValue), dataSize);
+        }
+        return false;
+    },
+    [](const Storage::Error &) {
+        //A missing entity is reported through found
+    });
+    if (!found || !merged) {
+        qWarning() << "Pipeline: failed to modify entity " << key;
+        return Async::error<void>();
+    }
 
-    storage().write(key.data(), key.size(), fbb.GetBufferPointer(), fbb.GetSize());
-    storage().setMaxRevision(newRevision);
-    qDebug() << "Pipeline: wrote entity: "<< newRevision;
+    //The merged buffers are assembled into an entity, so they are stored like the ones of a new entity
+    BuilderPool::Builder entityBuilder;
+    EntityBuffer::assembleEntityBuffer(*entityBuilder, nullptr, 0, resourceBuilder->GetBufferPointer(), resourceBuilder->GetSize(), localBuilder->GetBufferPointer(), localBuilder->GetSize());
+    if (!d->storeEntity(key, entityType, *Akonadi2::GetEntity(entityBuilder->GetBufferPointer()), Storage::EntityModified)) {
+        qWarning() << "Pipeline: failed to write entity " << key;
+        return Async::error<void>();
+    }
+    d->releaseBlobs(previousReferences);
 
-    return Async::start<void>([this, key, entityType](Async::Future<void> &future) {
-        PipelineState state(this, NewPipeline, key, d->newPipeline[entityType], [&future]() {
+    return Async::start<void>([this, key, entityType, previousEntity](Async::Future<void> &future) {
+        PipelineState state(this, ModifiedPipeline, key, d->modifiedPipeline[entityType], [&future]() {
             future.setFinished();
-        });
+        }, previousEntity);
         d->activePipelines << state;
         state.step();
     });
 }
 
-void Pipeline::modifiedEntity(const QString &entityType, const QByteArray &key, void *data, size_t size)
+Async::Job<void> Pipeline::deletedEntity(void const *command, size_t size)
 {
-    PipelineState state(this, ModifiedPipeline, key, d->modifiedPipeline[entityType], [](){});
-    d->activePipelines << state;
-    state.step();
+    qDebug() << "Pipeline: Deleted Entity";
+
+    {
+        flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(command), size);
+        if (!Akonadi2::VerifyDeleteEntityBuffer(verifyer)) {
+            qWarning() << "invalid buffer, not a delete entity buffer";
+            return Async::error<void>();
+        }
+    }
+    auto deleteEntity = Akonadi2::GetDeleteEntity(command);
+    if (!deleteEntity->entityId() || !deleteEntity->domainType()) {
+        qWarning() << "invalid buffer, the deleted entity is not specified";
+        return Async::error<void>();
+    }
+    const QByteArray key(deleteEntity->entityId()->c_str(), deleteEntity->entityId()->size());
+    const QString entityType = QString::fromUtf8(deleteEntity->domainType()->c_str(), deleteEntity->domainType()->size());
+
+    bool found = false;
+    const auto references = d->storedBlobReferences(key, found);
+    if (!found) {
+        qWarning() << "Pipeline: failed to delete missing entity " << key;
+        return Async::error<void>();
+    }
+    //The entity is gone once the preprocessors run, so they get the removed entity instead
+    QByteArray removedEntity;
+    storage().scan(key.constData(), key.size(), [&](void *, int, void *dataValue, int dataSize) -> bool {
+        removedEntity = QByteArray(static_cast<char*>(dataValue), dataSize);
+        return false;
+    },
+    [](const Storage::Error &) {
+        //The entity was found above
+    });
+
+    const qint64 newRevision = storage().maxRevision() + 1;
+    storage().startTransaction(Storage::ReadWrite);
+    bool removed = true;
+    storage().remove(key.constData(), key.size(), [&removed](const Storage::Error &error) {
+        qWarning() << "Pipeline: failed to remove entity: " << QString::fromStdString(error.message);
+        removed = false;
+    });
+    if (!removed || !storage().recordChange(newRevision, Storage::EntityRemoved, key) || !storage().setMaxRevision(newRevision)) {
+        qWarning() << "Pipeline: failed to delete entity " << key;
+        storage().abortTransaction();
+        return Async::error<void>();
+    }
+    if (!storage().commitTransaction()) {
+        qWarning() << "Pipeline: failed to delete entity " << key;
+        return Async::error<void>();
+    }
+    d->releaseBlobs(references);
+    qDebug() << "Pipeline: deleted entity: "<< newRevision;
+
+    return Async::start<void>([this, key, entityType, removedEntity](Async::Future<void> &future) {
+        PipelineState state(this, DeletedPipeline, key, d->deletedPipeline[entityType], [&future]() {
+            future.setFinished();
+        }, removedEntity);
+        d->activePipelines << state;
+        state.step();
+    });
 }
 
-void Pipeline::deletedEntity(const QString &entityType, const QByteArray &key)
+Async::Job<void> Pipeline::scrub()
 {
-    PipelineState state(this, DeletedPipeline, key, d->deletedPipeline[entityType], [](){});
-    d->activePipelines << state;
-    state.step();
+    const QString storageRoot = d->storageRoot;
+    const QString resourceName = d->resourceName;
+    return Async::start<void>([storageRoot, resourceName](Async::Future<void> &future) {
+        auto watcher = new QFutureWatcher<qint64>;
+        QObject::connect(watcher, &QFutureWatcher<qint64>::finished, [watcher, resourceName, &future]() {
+            qDebug() << "Pipeline: scrubbed " << resourceName << ", corrupt values: " << watcher->result();
+            watcher->deleteLater();
+            future.setFinished();
+        });
+        //The scrub runs in its own read transaction, so it doesn't block the pipeline
+        watcher->setFuture(QtConcurrent::run([storageRoot, resourceName]() -> qint64 {
+            Storage storage(storageRoot, resourceName, Storage::ReadOnly);
+            const qint64 corrupt = storage.scrub([](const QByteArray &key) -> bool {
+                qWarning() << "Pipeline: corrupt value for key " << key;
+                return true;
+            });
+            //Adding a reference and collecting are both write transactions, so a blob is never collected while it is referenced again
+            BlobStore blobs(storageRoot, resourceName, Storage::ReadWrite);
+            const qint64 collected = blobs.collectGarbage();
+            qDebug() << "Pipeline: collected unreferenced blobs: " << collected;
+            const auto statistics = blobs.statistics();
+            qDebug() << "Pipeline: blobs: " << statistics.blobs << ", references: " << statistics.references << ", saved by deduplication: " << statistics.savedBytes() << " bytes, disk usage: " << blobs.diskUsage();
+            return corrupt;
+        }));
+    });
 }
 
 void Pipeline::pipelineStepped(const PipelineState &state)
@@ -207,13 +515,14 @@ void Pipeline::pipelineCompleted(PipelineState state)
 class PipelineState::Private : public QSharedData
 {
 public:
-    Private(Pipeline *p, Pipeline::Type t, const QByteArray &k, QVector<Preprocessor *> filters, const std::function<void()> &c)
+    Private(Pipeline *p, Pipeline::Type t, const QByteArray &k, QVector<Preprocessor *> filters, const std::function<void()> &c, const QByteArray &previous)
         : pipeline(p),
           type(t),
           key(k),
           filterIt(filters),
           idle(true),
-          callback(c)
+          callback(c),
+          previousEntity(previous)
     {}
 
     Private()
@@ -228,6 +537,7 @@ public:
     QVectorIterator<Preprocessor *> filterIt;
     bool idle;
     std::function<void()> callback;
+    QByteArray previousEntity;
 };
 
 PipelineState::PipelineState()
@@ -236,8 +546,8 @@ PipelineState::PipelineState()
 
 }
 
-PipelineState::PipelineState(Pipeline *pipeline, Pipeline::Type type, const QByteArray &key, const QVector<Preprocessor *> &filters, const std::function<void()> &callback)
-    : d(new Private(pipeline, type, key, filters, callback))
+PipelineState::PipelineState(Pipeline *pipeline, Pipeline::Type type, const QByteArray &key, const QVector<Preprocessor *> &filters, const std::function<void()> &callback, const QByteArray &previousEntity)
+    : d(new Private(pipeline, type, key, filters, callback, previousEntity))
 {
 }
 
@@ -276,6 +586,14 @@ Pipeline::Type PipelineState::type() const
     return d->type;
 }
 
+Akonadi2::Entity const *PipelineState::previousEntity() const
+{
+    if (d->previousEntity.isEmpty()) {
+        return nullptr;
+    }
+    return Akonadi2::GetEntity(d->previousEntity.constData());
+}
+
 void PipelineState::step()
 {
     if (!d->pipeline) {
@@ -288,6 +606,14 @@ void PipelineState::step()
         //TODO skip step if already processed
         //FIXME error handling if no result is found
         auto preprocessor = d->filterIt.next();
+        if (d->type == Pipeline::DeletedPipeline) {
+            if (auto entity = previousEntity()) {
+                preprocessor->process(*this, *entity);
+            } else {
+                processingCompleted(preprocessor);
+            }
+            return;
+        }
         d->pipeline->storage().scan(d->key.toStdString(), [this, preprocessor](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
             auto entity = Akonadi2::GetEntity(dataValue);
             preprocessor->process(*this, *entity);
@@ -24,6 +24,7 @@
 
 #include <QSharedDataPointer>
 #include <QObject>
+#include <QStringList>
 
 #include <akonadi2common_export.h>
 #include <storage.h>
@@ -34,6 +35,7 @@
 namespace Akonadi2
 {
 
+class BlobStore;
 class PipelineState;
 class Preprocessor;
 
@@ -50,12 +52,40 @@ public:
     Storage &storage() const;
 
     void setPreprocessors(const QString &entityType, Type pipelineType, const QVector<Preprocessor *> &preprocessors);
+    /**
+     * Verifies the resource and local buffers of new entities of @param entityType before they are written.
+     *
+     * Readers trust the stored buffers without verifying them again, so resources have to set a verifier for each entity type they store.
+     */
+    void setBufferVerifier(const QString &entityType, const std::function<bool(const Akonadi2::Entity &entity)> &verifier);
+    /**
+     * Moves the large values of new and modified entities of @param entityType to the blob store of the resource before they are written.
+     *
+     * The extractor adds the values to the blob store and builds the resource and local buffers that reference them into the given builders.
+     * It returns the references it added, which are released again once the entity is modified or removed.
+     * If it returns no references the entity is written as is.
+     */
+    void setBlobExtractor(const QString &entityType, const std::function<QVector<QByteArray>(const Akonadi2::Entity &entity, BlobStore &blobs, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb)> &extractor);
+    /**
+     * Applies a modification of an entity of @param entityType to the stored entity.
+     *
+     * The merger builds the resource and local buffers of @param current with the properties set in @param delta, and without the @param deletions, into the given builders.
+     * Values of @param current that were moved to the blob store have to be resolved, so the blob extractor can add them again.
+     */
+    void setEntityMerger(const QString &entityType, const std::function<bool(const Akonadi2::Entity &current, const Akonadi2::Entity &delta, const QStringList &deletions, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb)> &merger);
 
     void null();
 
     Async::Job<void> newEntity(void const *command, size_t size);
-    void modifiedEntity(const QString &entityType, const QByteArray &key, void *data, size_t size);
-    void deletedEntity(const QString &entityType, const QByteArray &key);
+    Async::Job<void> modifiedEntity(void const *command, size_t size);
+    Async::Job<void> deletedEntity(void const *command, size_t size);
+
+    /**
+     * Checks the stored values against their checksums in a background thread, and reports the keys of corrupted values.
+     *
+     * Blobs that are no longer referenced by any entity are removed as well.
+     */
+    Async::Job<void> scrub();
 
 Q_SIGNALS:
     void revisionUpdated();
@@ -80,7 +110,7 @@ class AKONADI2COMMON_EXPORT PipelineState
 {
 public:
     PipelineState();
-    PipelineState(Pipeline *pipeline, Pipeline::Type type, const QByteArray &key, const QVector<Preprocessor *> &filters, const std::function<void()> &callback);
+    PipelineState(Pipeline *pipeline, Pipeline::Type type, const QByteArray &key, const QVector<Preprocessor *> &filters, const std::function<void()> &callback, const QByteArray &previousEntity = QByteArray());
     PipelineState(const PipelineState &other);
     ~PipelineState();
 
@@ -90,6 +120,12 @@ public:
     bool isIdle() const;
     QByteArray key() const;
     Pipeline::Type type() const;
+    /**
+     * The entity as it was stored before a modification, or the removed entity of a deletion.
+     *
+     * The preprocessors of a deletion are passed the removed entity as well. Returns nullptr for new entities.
+     */
+    Akonadi2::Entity const *previousEntity() const;
     //TODO expose command
 
     void step();
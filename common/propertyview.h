@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <cstring>
+
+namespace Akonadi2
+{
+
+namespace Domain
+{
+
+/**
+ * A string or byte property that points directly into the buffer it was read from.
+ *
+ * The view is only valid as long as that buffer is, use toByteArray to keep a copy of the value.
+ * Strings are viewed as their UTF-8 encoded bytes, a missing property is a null view.
+ */
+class PropertyView
+{
+public:
+    PropertyView()
+        : mData(nullptr),
+        mSize(0)
+    {
+    }
+
+    PropertyView(const char *data, int size)
+        : mData(data),
+        mSize(size)
+    {
+    }
+
+    bool isNull() const { return !mData; }
+    const char *data() const { return mData; }
+    int size() const { return mSize; }
+
+    QByteArray toByteArray() const { return QByteArray(mData, mSize); }
+    /**
+     * A QByteArray that doesn't copy the data, so it's only valid as long as the view is.
+     */
+    QByteArray toRawByteArray() const { return QByteArray::fromRawData(mData, mSize); }
+
+    bool operator==(const QByteArray &other) const
+    {
+        return mData && mSize == other.size() && std::memcmp(mData, other.constData(), mSize) == 0;
+    }
+
+    bool operator!=(const QByteArray &other) const
+    {
+        return !(*this == other);
+    }
+
+private:
+    const char *mData;
+    int mSize;
+};
+
+}
+
+} // namespace Akonadi2
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "querycache.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QHash>
+#include <algorithm>
+
+#include "clientapi.h"
+
+namespace Akonadi2
+{
+
+QueryCache::Ptr QueryCache::forResource(const QString &resource)
+{
+    static QMutex sMutex;
+    static QHash<QString, Ptr> sCaches;
+    QMutexLocker locker(&sMutex);
+    auto cache = sCaches.value(resource);
+    if (!cache) {
+        cache = Ptr::create();
+        sCaches.insert(resource, cache);
+    }
+    return cache;
+}
+
+bool QueryCache::isCacheable(const Query &query)
+{
+    return query.limit == 0 && query.continuation.isEmpty() && query.sortProperty.isEmpty();
+}
+
+QByteArray QueryCache::cacheKey(const QString &type, const Query &query)
+{
+    //Ids and filters are sorted, so the order in which they were added doesn't matter
+    QStringList ids = query.ids;
+    std::sort(ids.begin(), ids.end());
+    QStringList filterProperties = query.propertyFilter.keys();
+    std::sort(filterProperties.begin(), filterProperties.end());
+
+    QByteArray key;
+    QDataStream stream(&key, QIODevice::WriteOnly);
+    stream << type << ids;
+    for (const auto &property : filterProperties) {
+        stream << property << query.propertyFilter.value(property);
+    }
+    return key;
+}
+
+QueryCache::QueryCache(int maxCost)
+    : mEntries(maxCost)
+{
+}
+
+int QueryCache::cost(const QVector<QByteArray> &keys)
+{
+    int cost = sizeof(Entry);
+    for (const auto &key : keys) {
+        cost += key.size() + sizeof(QByteArray);
+    }
+    return cost;
+}
+
+bool QueryCache::lookup(const QByteArray &cacheKey, qint64 revision, Storage &storage,
+                        const std::function<QVector<QByteArray>(const QVector<QByteArray> &changedKeys)> &matcher,
+                        QVector<QByteArray> &keys)
+{
+    Entry entry;
+    {
+        QMutexLocker locker(&mMutex);
+        //Accessing the entry marks it as most recently used
+        Entry *cached = mEntries.object(cacheKey);
+        if (!cached || cached->revision > revision) {
+            mStatistics.misses++;
+            return false;
+        }
+        if (cached->revision == revision) {
+            mStatistics.hits++;
+            keys = cached->keys;
+            return true;
+        }
+        entry = *cached;
+    }
+
+    //The changelog no longer reaches back to the cached revision, so we can't tell what changed
+    const qint64 oldestChange = storage.oldestChange();
+    if (oldestChange < 0 || oldestChange > entry.revision + 1) {
+        QMutexLocker locker(&mMutex);
+        mEntries.remove(cacheKey);
+        mStatistics.misses++;
+        return false;
+    }
+
+    //Patch the cached keys without holding the lock, so other queries are not blocked in the meantime
+    QVector<QByteArray> changedKeys;
+    storage.readChanges(entry.revision, [&](qint64 changeRevision, Storage::ChangeType, const QByteArray &key) -> bool {
+        if (changeRevision > revision) {
+            return false;
+        }
+        changedKeys << key;
+        return true;
+    });
+    std::sort(changedKeys.begin(), changedKeys.end());
+    changedKeys.erase(std::unique(changedKeys.begin(), changedKeys.end()), changedKeys.end());
+
+    QVector<QByteArray> patched;
+    patched.reserve(entry.keys.size());
+    std::set_difference(entry.keys.constBegin(), entry.keys.constEnd(), changedKeys.constBegin(), changedKeys.constEnd(), std::back_inserter(patched));
+    if (!changedKeys.isEmpty()) {
+        patched += matcher(changedKeys);
+        std::sort(patched.begin(), patched.end());
+    }
+    keys = patched;
+    insert(cacheKey, revision, patched);
+
+    QMutexLocker locker(&mMutex);
+    mStatistics.patchedHits++;
+    return true;
+}
+
+void QueryCache::insert(const QByteArray &cacheKey, qint64 revision, const QVector<QByteArray> &keys)
+{
+    Entry *entry = new Entry;
+    entry->revision = revision;
+    entry->keys = keys;
+    std::sort(entry->keys.begin(), entry->keys.end());
+
+    QMutexLocker locker(&mMutex);
+    //Don't replace the keys with the ones of a query that started on an older revision
+    Entry *existing = mEntries.object(cacheKey);
+    if (existing && existing->revision > revision) {
+        delete entry;
+        return;
+    }
+    //Entries that exceed the maximum cost on their own are not cached
+    mEntries.insert(cacheKey, entry, cost(entry->keys));
+}
+
+void QueryCache::clear()
+{
+    QMutexLocker locker(&mMutex);
+    mEntries.clear();
+}
+
+void QueryCache::setMaxCost(int maxCost)
+{
+    QMutexLocker locker(&mMutex);
+    mEntries.setMaxCost(maxCost);
+}
+
+QueryCache::Statistics QueryCache::statistics() const
+{
+    QMutexLocker locker(&mMutex);
+    return mStatistics;
+}
+
+void QueryCache::resetStatistics()
+{
+    QMutexLocker locker(&mMutex);
+    mStatistics = Statistics();
+}
+
+} // namespace Akonadi2
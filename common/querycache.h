@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <akonadi2common_export.h>
+#include <QByteArray>
+#include <QCache>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+#include <functional>
+
+#include "storage.h"
+
+namespace Akonadi2
+{
+
+class Query;
+
+/**
+ * Caches the keys of the entities matching a query, together with the revision they were computed at.
+ *
+ * Repeating a query then only requires point lookups of the cached keys instead of a full scan.
+ * If the revision changed in the meantime, the cached keys are patched with the changes from the changelog,
+ * so only the changed entities have to be matched against the query again.
+ *
+ * The cache is shared by all facades of a resource, its memory is bounded by the size of the cached keys,
+ * and the least recently used entries are evicted first.
+ */
+class AKONADI2COMMON_EXPORT QueryCache
+{
+public:
+    typedef QSharedPointer<QueryCache> Ptr;
+
+    struct Statistics
+    {
+        Statistics() : hits(0), patchedHits(0), misses(0) {}
+        //The cached keys were up to date
+        qint64 hits;
+        //The cached keys were patched from the changelog
+        qint64 patchedHits;
+        qint64 misses;
+        double hitRate() const
+        {
+            const qint64 total = hits + patchedHits + misses;
+            return total ? double(hits + patchedHits) / total : 0;
+        }
+    };
+
+    //The default size in bytes of the cached keys of a resource
+    static const int defaultMaxCost = 4 * 1024 * 1024;
+
+    /**
+     * The cache of @param resource.
+     */
+    static Ptr forResource(const QString &resource);
+
+    /**
+     * Only complete result sets are cached, so paginated and sorted queries are never cached.
+     */
+    static bool isCacheable(const Query &query);
+
+    /**
+     * Normalizes the parts of @param query that affect the result set of @param type to a key,
+     * so equivalent queries share the cached keys.
+     */
+    static QByteArray cacheKey(const QString &type, const Query &query);
+
+    QueryCache(int maxCost = defaultMaxCost);
+
+    /**
+     * Looks up the keys matching the query @param cacheKey at @param revision of @param storage.
+     *
+     * If the cached keys are from an older revision, the keys that changed since then are passed to @param matcher,
+     * which has to return the ones that match the query at @param revision.
+     * Returns false if nothing usable is cached.
+     */
+    bool lookup(const QByteArray &cacheKey, qint64 revision, Storage &storage,
+                const std::function<QVector<QByteArray>(const QVector<QByteArray> &changedKeys)> &matcher,
+                QVector<QByteArray> &keys);
+
+    /**
+     * Caches the @param keys matching the query @param cacheKey at @param revision.
+     */
+    void insert(const QByteArray &cacheKey, qint64 revision, const QVector<QByteArray> &keys);
+
+    void clear();
+    void setMaxCost(int maxCost);
+    Statistics statistics() const;
+    void resetStatistics();
+
+private:
+    struct Entry
+    {
+        qint64 revision;
+        QVector<QByteArray> keys;
+    };
+
+    static int cost(const QVector<QByteArray> &keys);
+
+    mutable QMutex mMutex;
+    QCache<QByteArray, Entry> mEntries;
+    Statistics mStatistics;
+};
+
+} // namespace Akonadi2
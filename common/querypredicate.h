@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QPair>
+#include <QVector>
+#include <algorithm>
+#include <cstring>
+#include <flatbuffers/flatbuffers.h>
+
+#include "propertyview.h"
+
+/**
+ * A property filter compiled against the buffer types of an entity.
+ *
+ * Property names are resolved to the view accessors of the property mappers once when the predicate is built,
+ * so evaluating it for every entity of a scan is a plain comparison on the flatbuffers,
+ * without accessor lookups, QVariant conversions or allocations.
+ */
+template<typename LocalBuffer, typename ResourceBuffer>
+class QueryPredicate
+{
+public:
+    typedef Akonadi2::Domain::PropertyView (*LocalStringField)(LocalBuffer const *buffer);
+    typedef Akonadi2::Domain::PropertyView (*ResourceStringField)(ResourceBuffer const *buffer);
+
+    QueryPredicate()
+        : mMatchNothing(false)
+    {
+    }
+
+    void addLocalFilter(LocalStringField field, const QByteArray &value)
+    {
+        mLocalFilters.append(qMakePair(field, value));
+    }
+
+    void addResourceFilter(ResourceStringField field, const QByteArray &value)
+    {
+        mResourceFilters.append(qMakePair(field, value));
+    }
+
+    /**
+     * Makes the predicate reject all entities, i.e. because a filtered property is not available.
+     */
+    void setMatchNothing()
+    {
+        mMatchNothing = true;
+    }
+
+    bool matchesEverything() const
+    {
+        return !mMatchNothing && mLocalFilters.isEmpty() && mResourceFilters.isEmpty();
+    }
+
+    bool matches(LocalBuffer const *local, ResourceBuffer const *resource) const
+    {
+        if (mMatchNothing) {
+            return false;
+        }
+        for (const auto &filter : mResourceFilters) {
+            if (!resource || filter.first(resource) != filter.second) {
+                return false;
+            }
+        }
+        for (const auto &filter : mLocalFilters) {
+            if (!local || filter.first(local) != filter.second) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+
+    QVector<QPair<LocalStringField, QByteArray> > mLocalFilters;
+    QVector<QPair<ResourceStringField, QByteArray> > mResourceFilters;
+    bool mMatchNothing;
+};
+
+/**
+ * A sort property resolved to the field of either the local or the resource buffer.
+ *
+ * The value is read directly from the buffer, so it's only valid as long as the buffer is.
+ */
+template<typename LocalBuffer, typename ResourceBuffer>
+class QuerySortField
+{
+public:
+    typedef flatbuffers::String const *(LocalBuffer::*LocalStringField)() const;
+    typedef flatbuffers::String const *(ResourceBuffer::*ResourceStringField)() const;
+
+    QuerySortField()
+        : mLocalField(0),
+        mResourceField(0)
+    {
+    }
+
+    void setLocalField(LocalStringField field)
+    {
+        mLocalField = field;
+    }
+
+    void setResourceField(ResourceStringField field)
+    {
+        mResourceField = field;
+    }
+
+    bool isValid() const
+    {
+        return mLocalField || mResourceField;
+    }
+
+    flatbuffers::String const *value(LocalBuffer const *local, ResourceBuffer const *resource) const
+    {
+        if (mResourceField) {
+            return resource ? (resource->*mResourceField)() : 0;
+        }
+        if (mLocalField) {
+            return local ? (local->*mLocalField)() : 0;
+        }
+        return 0;
+    }
+
+    /**
+     * Orders by byte value, missing values are ordered first.
+     */
+    static bool lessThan(flatbuffers::String const *left, flatbuffers::String const *right)
+    {
+        if (!left || !right) {
+            return !left && right;
+        }
+        const int result = std::memcmp(left->c_str(), right->c_str(), std::min(left->size(), right->size()));
+        return result < 0 || (result == 0 && left->size() < right->size());
+    }
+
+private:
+    LocalStringField mLocalField;
+    ResourceStringField mResourceField;
+};
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "snapshot.h"
+
+#include <QAtomicInt>
+#include <QDebug>
+
+namespace Akonadi2
+{
+
+static QAtomicInt sOpenSnapshots;
+
+Snapshot::Ptr Snapshot::create(const QSharedPointer<Storage> &storage)
+{
+    Q_ASSERT(storage->isInTransaction());
+    //Reserve a slot first so concurrent queries can't exceed the limit
+    if (sOpenSnapshots.fetchAndAddOrdered(1) >= maxSnapshots) {
+        sOpenSnapshots.deref();
+        qWarning() << "Too many open snapshots: " << maxSnapshots;
+        return Ptr();
+    }
+    return Ptr(new Snapshot(storage));
+}
+
+Snapshot::Ptr Snapshot::open(const QString &storageRoot, const QString &name)
+{
+    auto storage = QSharedPointer<Storage>::create(storageRoot, name);
+    if (!storage->exists() || !storage->startTransaction(Storage::ReadOnly)) {
+        return Ptr();
+    }
+    return create(storage);
+}
+
+int Snapshot::openSnapshots()
+{
+    return sOpenSnapshots.load();
+}
+
+Snapshot::Snapshot(const QSharedPointer<Storage> &storage)
+    : mStorage(storage),
+    mRevision(storage->maxRevision())
+{
+    mAge.start();
+}
+
+Snapshot::~Snapshot()
+{
+    if (mAge.elapsed() > maxAge) {
+        qWarning() << "A snapshot was held for " << mAge.elapsed() << "ms, copy the results instead of loading them lazily if you need to keep them.";
+    }
+    //Closes the read transaction
+    mStorage.clear();
+    sOpenSnapshots.deref();
+}
+
+Storage &Snapshot::storage() const
+{
+    return *mStorage;
+}
+
+qint64 Snapshot::revision() const
+{
+    return mRevision;
+}
+
+QMutex &Snapshot::mutex() const
+{
+    return mMutex;
+}
+
+} // namespace Akonadi2
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <akonadi2common_export.h>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QMutex>
+
+#include "storage.h"
+
+namespace Akonadi2
+{
+
+/**
+ * A read transaction that is kept open as long as a reference to it exists.
+ *
+ * Buffers read from the storage point directly into the database and are only valid while
+ * the transaction they were read in is open, so lazily loaded results hold a reference to their snapshot.
+ *
+ * An open read transaction prevents the storage from reusing pages that have been freed since it started,
+ * so the database grows for as long as a snapshot is held. Snapshots should therefore only be held for
+ * short periods (i.e. while a view is rendered); results that are kept around should be copied instead.
+ * To enforce this at most maxSnapshots can be open at the same time, and releasing a snapshot after more
+ * than maxAge milliseconds prints a warning.
+ *
+ * A snapshot always sees the revision that was current when it was opened. Passing the same snapshot to
+ * multiple steps of an operation (i.e. the lookups of a synchronization, or a query that must not see
+ * changes since an earlier query) gives them one consistent view.
+ */
+class AKONADI2COMMON_EXPORT Snapshot
+{
+public:
+    typedef QSharedPointer<Snapshot> Ptr;
+
+    static const int maxSnapshots = 64;
+    static const int maxAge = 10000;
+
+    /**
+     * Takes ownership of @param storage, which has to be in a read transaction.
+     *
+     * Returns a null pointer if the limit of open snapshots is reached.
+     */
+    static Ptr create(const QSharedPointer<Storage> &storage);
+
+    /**
+     * Opens a snapshot of the storage @param name in @param storageRoot.
+     *
+     * Returns a null pointer if the storage doesn't exist or the limit of open snapshots is reached.
+     */
+    static Ptr open(const QString &storageRoot, const QString &name);
+
+    /**
+     * The number of currently open snapshots.
+     */
+    static int openSnapshots();
+
+    ~Snapshot();
+
+    Storage &storage() const;
+
+    /**
+     * The revision the snapshot sees.
+     */
+    qint64 revision() const;
+
+    /**
+     * The transaction must only be used by one thread at a time, lock this while reading from the storage.
+     */
+    QMutex &mutex() const;
+
+private:
+    Snapshot(const QSharedPointer<Storage> &storage);
+    Q_DISABLE_COPY(Snapshot)
+
+    QSharedPointer<Storage> mStorage;
+    QElapsedTimer mAge;
+    qint64 mRevision;
+    mutable QMutex mMutex;
+};
+
+} // namespace Akonadi2
@@ -25,6 +25,8 @@
 #include <string>
 #include <functional>
 #include <QString>
+#include <QByteArray>
+#include <QVector>
 
 namespace Akonadi2
 {
@@ -32,6 +34,7 @@ namespace Akonadi2
 class AKONADI2COMMON_EXPORT Storage {
 public:
     enum AccessMode { ReadOnly, ReadWrite };
+    enum ChangeType { EntityCreated = 'c', EntityModified = 'm', EntityRemoved = 'r' };
 
     class Error
     {
@@ -67,6 +70,23 @@ public:
     void scan(const char *keyData, uint keySize,
               const std::function<bool(void *keyPtr, int keySize, void *ptr, int size)> &resultHandler,
               const std::function<void(const Storage::Error &error)> &errorHandler);
+    /**
+     * Point lookup of a set of keys using a single cursor.
+     *
+     * The keys are looked up in sorted order, missing keys are skipped.
+     * The lookup stops as soon as the result handler returns false.
+     */
+    void scan(const QVector<QByteArray> &keys,
+              const std::function<bool(void *keyPtr, int keySize, void *ptr, int size)> &resultHandler,
+              const std::function<void(const Storage::Error &error)> &errorHandler);
+    /**
+     * Scans all entries with a key greater or equal to @param startKey in key order.
+     *
+     * The scan stops as soon as the result handler returns false.
+     */
+    void scanFrom(const QByteArray &startKey,
+                  const std::function<bool(void *keyPtr, int keySize, void *ptr, int size)> &resultHandler,
+                  const std::function<void(const Storage::Error &error)> &errorHandler);
     void remove(void const *keyData, uint keySize);
     void remove(void const *keyData, uint keySize,
                 const std::function<void(const Storage::Error &error)> &errorHandler);
@@ -76,7 +96,74 @@ public:
     void removeFromDisk() const;
 
     qint64 maxRevision();
-    void setMaxRevision(qint64 revision);
+    bool setMaxRevision(qint64 revision);
+
+    /**
+     * The version the writer tagged the stored buffers with, or -1 if the storage is not tagged.
+     */
+    qint64 schemaVersion();
+    void setSchemaVersion(qint64 version);
+
+    /**
+     * Records that the entity @param key changed in @param revision, so changes since a revision can be replayed.
+     *
+     * The changelog is append only, @param revision has to be larger than the last recorded revision.
+     * Record the change in the same transaction as the write, so the log never diverges from the data.
+     */
+    bool recordChange(qint64 revision, ChangeType type, const QByteArray &key);
+    /**
+     * Reads the changes recorded after @param fromRevision in revision order.
+     *
+     * Reading stops as soon as the result handler returns false.
+     */
+    void readChanges(qint64 fromRevision, const std::function<bool(qint64 revision, ChangeType type, const QByteArray &key)> &resultHandler);
+    /**
+     * The oldest revision that is still in the changelog, or -1 if the changelog is empty.
+     *
+     * Reading the changes since an older revision misses the changes that have been compacted away.
+     */
+    qint64 oldestChange();
+    /**
+     * Compacts the changelog by removing the changes before @param revision.
+     */
+    void removeChangesBefore(qint64 revision);
+
+    /**
+     * Records a CRC32C checksum of every value written through this instance, so corrupted values can be found by scrub().
+     *
+     * Checksums are only recorded for values of non-internal keys, and not for storages that allow duplicates.
+     */
+    void setChecksumsEnabled(bool enabled);
+    /**
+     * Checks all values that have a checksum in key order, and passes the keys of the values that don't match their checksum to @param corruptKeyHandler.
+     *
+     * The scrub stops as soon as the handler returns false. Returns the number of corrupt values that were found.
+     */
+    qint64 scrub(const std::function<bool(const QByteArray &key)> &corruptKeyHandler);
+
+    /**
+     * Compresses the values of non-internal keys from now on, values that are too small or don't get smaller are stored uncompressed.
+     *
+     * Every value of a compressed storage starts with a header (see Compression), which is stripped on read.
+     * So only a storage that doesn't contain any values yet can be switched, and it can't be switched back.
+     * Storages that allow duplicates are never compressed. Returns whether the values of the storage are compressed.
+     *
+     * Values that were compressed are decompressed into a buffer of the reading thread, so the pointers passed to
+     * the result handlers are only valid until the thread reads the next value, unlike the pointers into the storage (see isTransient).
+     */
+    bool enableCompression();
+    bool isCompressed();
+    /**
+     * Compresses the values written through this instance with the preset @param dictionary, so small values compress as well.
+     *
+     * The dictionary should contain what the values have in common, i.e. a few typical values, and is stored as well so readers can find it.
+     * A value remains readable with the dictionary it was written with, so the dictionary can be changed at any time.
+     */
+    void setCompressionDictionary(const QByteArray &dictionary);
+    /**
+     * Whether the value @param value was decompressed into the buffer of the current thread, and has to be copied to keep it beyond the next read.
+     */
+    static bool isTransient(const void *value);
 
     bool exists() const;
 
@@ -19,6 +19,7 @@
  */
 
 #include "storage.h"
+#include "compression.h"
 
 #include <iostream>
 
@@ -55,9 +56,9 @@ void Storage::scan(const std::string &sKey, const std::function<bool(void *keyPt
     scan(sKey.data(), sKey.size(), resultHandler, &errorHandler);
 }
 
-void Storage::setMaxRevision(qint64 revision)
+bool Storage::setMaxRevision(qint64 revision)
 {
-    write("__internal_maxRevision", QString::number(revision).toStdString());
+    return write("__internal_maxRevision", QString::number(revision).toStdString());
 }
 
 qint64 Storage::maxRevision()
@@ -74,6 +75,29 @@ qint64 Storage::maxRevision()
     return r;
 }
 
+void Storage::setSchemaVersion(qint64 version)
+{
+    write("__internal_schemaVersion", QString::number(version).toStdString());
+}
+
+qint64 Storage::schemaVersion()
+{
+    qint64 version = -1;
+    read(std::string("__internal_schemaVersion"), [&](const std::string &value) -> bool {
+        version = QString::fromStdString(value).toLongLong();
+        return false;
+    },
+    [](const Storage::Error &error) {
+        //Untagged storage
+    });
+    return version;
+}
+
+bool Storage::isTransient(const void *value)
+{
+    return Compression::isTransient(value);
+}
+
 bool Storage::isInternalKey(const char *key)
 {
     return key && strncmp(key, s_internalPrefix, s_internalPrefixSize) == 0;
@@ -20,12 +20,16 @@
  */
 
 #include "storage.h"
+#include "checksum.h"
+#include "compression.h"
 
 #include <iostream>
+#include <algorithm>
 
 #include <QAtomicInt>
 #include <QDebug>
 #include <QDir>
+#include <QHash>
 #include <QReadWriteLock>
 #include <QString>
 #include <QTime>
@@ -36,38 +40,90 @@
 namespace Akonadi2
 {
 
+//The named databases are stored as keys of the main database, so they use internal keys to be skipped by scans
+static const char *s_changelogDbName = "__internal_changelog";
+static const char *s_checksumDbName = "__internal_checksums";
+//Marks a storage whose values start with a header, see enableCompression
+static const char *s_compressionKey = "__internal_compression";
+//The dictionaries are stored by their id, so every value can find the one it was compressed with
+static const char *s_dictionaryPrefix = "__internal_dictionary_";
+static const int s_maxNamedDatabases = 8;
+
 class Storage::Private
 {
 public:
     Private(const QString &s, const QString &n, AccessMode m, bool duplicates);
     ~Private();
 
+    void lookupNamedDatabases();
+    int writeChecksum(MDB_val *key, MDB_val *value);
+    int removeChecksum(MDB_val *key);
+    bool readCompressionFlag();
+    QByteArray lookupDictionary(quint32 id);
+    std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> decodingHandler(
+        const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+        const std::function<void(const Storage::Error &error)> &errorHandler);
+
     QString storageRoot;
     QString name;
 
     MDB_dbi dbi;
+    //0 is the database of free pages, so it never refers to an open named database
+    MDB_dbi checksumDbi;
+    MDB_dbi changelogDbi;
     MDB_env *env;
     MDB_txn *transaction;
     AccessMode mode;
     bool readTransaction;
     bool firstOpen;
     bool allowDuplicates;
+    bool checksums;
+    bool compressed;
+    QByteArray dictionary;
+    QHash<quint32, QByteArray> dictionaries;
     static QMutex sMutex;
     static QHash<QString, MDB_env*> sEnvironments;
+    static QHash<QString, MDB_dbi> sChecksumDbis;
+    static QHash<QString, MDB_dbi> sChangelogDbis;
 };
 
 QMutex Storage::Private::sMutex;
 QHash<QString, MDB_env*> Storage::Private::sEnvironments;
+QHash<QString, MDB_dbi> Storage::Private::sChecksumDbis;
+QHash<QString, MDB_dbi> Storage::Private::sChangelogDbis;
+
+/*
+ * mdb_dbi_open must not be called from concurrent transactions, so the named databases are opened only once per environment,
+ * with sMutex held, and the handles are shared by all storages of the environment.
+ * The handle is only kept beyond the transaction that opened it if the transaction is committed.
+ */
+static int openNamedDatabase(MDB_env *env, const char *dbName, unsigned int flags, MDB_dbi *namedDbi)
+{
+    MDB_txn *transaction;
+    int rc = mdb_txn_begin(env, NULL, (flags & MDB_CREATE) ? 0 : MDB_RDONLY, &transaction);
+    if (!rc) {
+        if ((rc = mdb_dbi_open(transaction, dbName, flags, namedDbi))) {
+            mdb_txn_abort(transaction);
+        } else {
+            rc = mdb_txn_commit(transaction);
+        }
+    }
+    return rc;
+}
 
 Storage::Private::Private(const QString &s, const QString &n, AccessMode m, bool duplicates)
     : storageRoot(s),
       name(n),
+      checksumDbi(0),
+      changelogDbi(0),
       env(0),
       transaction(0),
       mode(m),
       readTransaction(false),
       firstOpen(true),
-      allowDuplicates(duplicates)
+      allowDuplicates(duplicates),
+      checksums(false),
+      compressed(false)
 {
     const QString fullPath(storageRoot + '/' + name);
     QDir dir;
@@ -88,7 +144,10 @@ Storage::Private::Private(const QString &s, const QString &n, AccessMode m, bool
             // TODO: handle error
             std::cerr << "mdb_env_create: " << rc << " " << mdb_strerror(rc) << std::endl;
         } else {
-            if ((rc = mdb_env_open(env, fullPath.toStdString().data(), mode == ReadOnly ? MDB_RDONLY : 0 , 0664))) {
+            mdb_env_set_maxdbs(env, s_maxNamedDatabases);
+            //MDB_NOTLS ties read transactions to the transaction object instead of the thread,
+            //so a snapshot opened in a query thread can be released from the thread that consumed the results.
+            if ((rc = mdb_env_open(env, fullPath.toStdString().data(), (mode == ReadOnly ? MDB_RDONLY : 0) | MDB_NOTLS, 0664))) {
                 std::cerr << "mdb_env_open: " << rc << " " << mdb_strerror(rc) << std::endl;
                 mdb_env_close(env);
                 env = 0;
@@ -97,9 +156,27 @@ Storage::Private::Private(const QString &s, const QString &n, AccessMode m, bool
                 const size_t dbSize = (size_t)10485760 * (size_t)100 * (size_t)80; //10MB * 800
                 mdb_env_set_mapsize(env, dbSize);
                 sEnvironments.insert(fullPath, env);
+
+                //Named databases can't be stored in a main database with duplicates.
+                //A read-only environment only opens existing databases, see lookupNamedDatabases.
+                if (!allowDuplicates) {
+                    const unsigned int create = mode == ReadWrite ? MDB_CREATE : 0;
+                    MDB_dbi namedDbi;
+                    if (!openNamedDatabase(env, s_checksumDbName, create, &namedDbi)) {
+                        sChecksumDbis.insert(fullPath, namedDbi);
+                    }
+                    //The revision is used as native integer key, so entries are compared as numbers and never need to be padded
+                    if (!openNamedDatabase(env, s_changelogDbName, MDB_INTEGERKEY | create, &namedDbi)) {
+                        sChangelogDbis.insert(fullPath, namedDbi);
+                    }
+                }
             }
         }
     }
+    if (env) {
+        checksumDbi = sChecksumDbis.value(fullPath);
+        changelogDbi = sChangelogDbis.value(fullPath);
+    }
 }
 
 Storage::Private::~Private()
@@ -116,6 +193,97 @@ Storage::Private::~Private()
     // }
 }
 
+//The databases are missing if a read-only environment was opened before they have been created, so they are looked up again.
+//This has to happen before a transaction is started, since a transaction only knows about the databases opened before it.
+void Storage::Private::lookupNamedDatabases()
+{
+    if ((checksumDbi && changelogDbi) || allowDuplicates) {
+        return;
+    }
+    const QString fullPath(storageRoot + '/' + name);
+    QMutexLocker locker(&sMutex);
+    MDB_dbi namedDbi;
+    if (!sChecksumDbis.contains(fullPath) && !openNamedDatabase(env, s_checksumDbName, 0, &namedDbi)) {
+        sChecksumDbis.insert(fullPath, namedDbi);
+    }
+    if (!sChangelogDbis.contains(fullPath) && !openNamedDatabase(env, s_changelogDbName, MDB_INTEGERKEY, &namedDbi)) {
+        sChangelogDbis.insert(fullPath, namedDbi);
+    }
+    checksumDbi = sChecksumDbis.value(fullPath);
+    changelogDbi = sChangelogDbis.value(fullPath);
+}
+
+//The checksums are kept in a separate database with the same keys, so the values themselves remain untouched
+int Storage::Private::writeChecksum(MDB_val *key, MDB_val *value)
+{
+    if (!checksumDbi) {
+        //The database is created when the environment is opened, so it's only missing if that failed
+        return MDB_NOTFOUND;
+    }
+    quint32 checksum = Checksum::crc32c(value->mv_data, value->mv_size);
+    MDB_val data;
+    data.mv_size = sizeof(checksum);
+    data.mv_data = &checksum;
+    return mdb_put(transaction, checksumDbi, key, &data, 0);
+}
+
+//Removes the checksum even if checksums are not enabled, so a stale checksum is never reported as corruption
+int Storage::Private::removeChecksum(MDB_val *key)
+{
+    if (!checksumDbi) {
+        return 0;
+    }
+    const int rc = mdb_del(transaction, checksumDbi, key, 0);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+bool Storage::Private::readCompressionFlag()
+{
+    MDB_val key, data;
+    key.mv_size = strlen(s_compressionKey);
+    key.mv_data = const_cast<char*>(s_compressionKey);
+    return mdb_get(transaction, dbi, &key, &data) == 0;
+}
+
+QByteArray Storage::Private::lookupDictionary(quint32 id)
+{
+    if (!dictionaries.contains(id)) {
+        const QByteArray dictionaryKey = s_dictionaryPrefix + QByteArray::number(id, 16);
+        MDB_val key, data;
+        key.mv_size = dictionaryKey.size();
+        key.mv_data = const_cast<char*>(dictionaryKey.constData());
+        if (mdb_get(transaction, dbi, &key, &data)) {
+            return QByteArray();
+        }
+        dictionaries.insert(id, QByteArray(static_cast<const char*>(data.mv_data), data.mv_size));
+    }
+    return dictionaries.value(id);
+}
+
+//Strips the headers of the values before they are passed to @param resultHandler, and skips corrupt values.
+//The returned handler refers to the given ones, so it must not outlive the scan.
+std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> Storage::Private::decodingHandler(
+    const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+    const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    if (!compressed) {
+        return resultHandler;
+    }
+    return [this, &resultHandler, &errorHandler](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        if (Storage::isInternalKey(keyPtr, keySize)) {
+            return resultHandler(keyPtr, keySize, valuePtr, valueSize);
+        }
+        void *data = nullptr;
+        size_t dataSize = 0;
+        if (!Compression::decode(valuePtr, valueSize, [this](quint32 id) { return lookupDictionary(id); }, data, dataSize)) {
+            Error error(name.toStdString(), -4, "Corrupt value for key: " + std::string(static_cast<char*>(keyPtr), keySize));
+            errorHandler(error);
+            return true;
+        }
+        return resultHandler(keyPtr, keySize, data, dataSize);
+    };
+}
+
 Storage::Storage(const QString &storageRoot, const QString &name, AccessMode mode, bool allowDuplicates)
     : d(new Private(storageRoot, name, mode, allowDuplicates))
 {
@@ -167,12 +335,17 @@ bool Storage::startTransaction(AccessMode type)
         // mdb_txn_abort(d->transaction);
     }
 
+    d->lookupNamedDatabases();
+
     int rc;
     rc = mdb_txn_begin(d->env, NULL, requestedRead ? MDB_RDONLY : 0, &d->transaction);
     if (!rc) {
         rc = mdb_dbi_open(d->transaction, NULL, d->allowDuplicates ? MDB_DUPSORT : 0, &d->dbi);
         if (rc) {
             qWarning() << "Error while opening transaction: " << mdb_strerror(rc);
+        } else if (!d->compressed && !d->allowDuplicates) {
+            //The flag is never removed, so it is only looked up until it's found
+            d->compressed = d->readCompressionFlag();
         }
     } else {
         if (rc) {
@@ -214,6 +387,10 @@ void Storage::abortTransaction()
 
     mdb_txn_abort(d->transaction);
     d->transaction = 0;
+    if (!d->readTransaction) {
+        //The flag might have been written in the aborted transaction
+        d->compressed = false;
+    }
 }
 
 bool Storage::write(const void *keyPtr, size_t keySize, const void *valuePtr, size_t valueSize)
@@ -245,7 +422,18 @@ bool Storage::write(const void *keyPtr, size_t keySize, const void *valuePtr, si
     key.mv_data = const_cast<void*>(keyPtr);
     data.mv_size = valueSize;
     data.mv_data = const_cast<void*>(valuePtr);
+    if (d->compressed && !isInternalKey(key.mv_data, key.mv_size)) {
+        const void *encoded;
+        size_t encodedSize;
+        Compression::encode(valuePtr, valueSize, d->dictionary, encoded, encodedSize);
+        data.mv_size = encodedSize;
+        data.mv_data = const_cast<void*>(encoded);
+    }
+    //The checksum covers the value as it is stored, so scrubbing doesn't have to decompress
     rc = mdb_put(d->transaction, d->dbi, &key, &data, 0);
+    if (!rc && d->checksums && !d->allowDuplicates && !isInternalKey(key.mv_data, key.mv_size)) {
+        rc = d->writeChecksum(&key, &data);
+    }
 
     if (rc) {
         std::cerr << "mdb_put: " << rc << " " << mdb_strerror(rc) << std::endl;
@@ -314,6 +502,7 @@ void Storage::scan(const char *keyData, uint keySize,
         }
     }
 
+    const auto handler = d->decodingHandler(resultHandler, errorHandler);
     rc = mdb_cursor_open(d->transaction, d->dbi, &cursor);
     if (rc) {
         Error error(d->name.toStdString(), rc, std::string("Error during mdb_cursor open: ") + mdb_strerror(rc));
@@ -323,9 +512,9 @@ void Storage::scan(const char *keyData, uint keySize,
 
     if (!keyData || keySize == 0 || d->allowDuplicates) {
         if ((rc = mdb_cursor_get(cursor, &key, &data, d->allowDuplicates ? MDB_SET_RANGE : MDB_FIRST)) == 0) {
-            if (resultHandler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
+            if (handler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
                 while ((rc = mdb_cursor_get(cursor, &key, &data, d->allowDuplicates ? MDB_NEXT_DUP : MDB_NEXT)) == 0) {
-                    if (!resultHandler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
+                    if (!handler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
                         break;
                     }
                 }
@@ -338,7 +527,7 @@ void Storage::scan(const char *keyData, uint keySize,
         }
     } else {
         if ((rc = mdb_cursor_get(cursor, &key, &data, MDB_SET)) == 0) {
-            resultHandler(key.mv_data, key.mv_size, data.mv_data, data.mv_size);
+            handler(key.mv_data, key.mv_size, data.mv_data, data.mv_size);
         }
     }
 
@@ -354,6 +543,142 @@ void Storage::scan(const char *keyData, uint keySize,
     }
 }
 
+void Storage::scan(const QVector<QByteArray> &keys,
+                   const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+                   const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    if (!d->env) {
+        Error error(d->name.toStdString(), -1, "Not open");
+        errorHandler(error);
+        return;
+    }
+
+    const bool implicitTransaction = !d->transaction;
+    if (implicitTransaction) {
+        if (!startTransaction(ReadOnly)) {
+            Error error(d->name.toStdString(), -2, "Could not start transaction");
+            errorHandler(error);
+            return;
+        }
+    }
+
+    int rc;
+    MDB_cursor *cursor;
+    const auto handler = d->decodingHandler(resultHandler, errorHandler);
+    rc = mdb_cursor_open(d->transaction, d->dbi, &cursor);
+    if (rc) {
+        Error error(d->name.toStdString(), rc, std::string("Error during mdb_cursor open: ") + mdb_strerror(rc));
+        errorHandler(error);
+        if (implicitTransaction) {
+            abortTransaction();
+        }
+        return;
+    }
+
+    //Seeking in key order allows lmdb to find the next key on the leaf page the cursor is already positioned on,
+    //instead of descending from the root for every key.
+    QVector<QByteArray> sortedKeys = keys;
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+    sortedKeys.erase(std::unique(sortedKeys.begin(), sortedKeys.end()), sortedKeys.end());
+
+    MDB_val key;
+    MDB_val data;
+    bool done = false;
+    for (const auto &k : sortedKeys) {
+        if (done) {
+            break;
+        }
+        key.mv_data = const_cast<char*>(k.constData());
+        key.mv_size = k.size();
+        if ((rc = mdb_cursor_get(cursor, &key, &data, MDB_SET)) == 0) {
+            done = !handler(key.mv_data, key.mv_size, data.mv_data, data.mv_size);
+            while (!done && d->allowDuplicates && (rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT_DUP)) == 0) {
+                done = !handler(key.mv_data, key.mv_size, data.mv_data, data.mv_size);
+            }
+        }
+
+        //Missing keys are not an error
+        if (rc == MDB_NOTFOUND) {
+            rc = 0;
+        }
+        if (rc) {
+            Error error(d->name.toStdString(), rc, std::string("Key: ") + std::string(k.constData(), k.size()) + " : " + mdb_strerror(rc));
+            errorHandler(error);
+            break;
+        }
+    }
+
+    mdb_cursor_close(cursor);
+
+    if (implicitTransaction) {
+        abortTransaction();
+    }
+}
+
+void Storage::scanFrom(const QByteArray &startKey,
+                       const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+                       const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    if (!d->env) {
+        Error error(d->name.toStdString(), -1, "Not open");
+        errorHandler(error);
+        return;
+    }
+
+    const bool implicitTransaction = !d->transaction;
+    if (implicitTransaction) {
+        if (!startTransaction(ReadOnly)) {
+            Error error(d->name.toStdString(), -2, "Could not start transaction");
+            errorHandler(error);
+            return;
+        }
+    }
+
+    int rc;
+    MDB_cursor *cursor;
+    const auto handler = d->decodingHandler(resultHandler, errorHandler);
+    rc = mdb_cursor_open(d->transaction, d->dbi, &cursor);
+    if (rc) {
+        Error error(d->name.toStdString(), rc, std::string("Error during mdb_cursor open: ") + mdb_strerror(rc));
+        errorHandler(error);
+        if (implicitTransaction) {
+            abortTransaction();
+        }
+        return;
+    }
+
+    MDB_val key;
+    MDB_val data;
+    key.mv_data = const_cast<char*>(startKey.constData());
+    key.mv_size = startKey.size();
+    //An empty start key starts at the first entry
+    if ((rc = mdb_cursor_get(cursor, &key, &data, startKey.isEmpty() ? MDB_FIRST : MDB_SET_RANGE)) == 0) {
+        if (handler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
+            while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+                if (!handler(key.mv_data, key.mv_size, data.mv_data, data.mv_size)) {
+                    break;
+                }
+            }
+        }
+    }
+
+    //We never find the last value
+    if (rc == MDB_NOTFOUND) {
+        rc = 0;
+    }
+
+    mdb_cursor_close(cursor);
+
+    if (rc) {
+        Error error(d->name.toStdString(), rc, std::string("Key: ") + std::string(startKey.constData(), startKey.size()) + " : " + mdb_strerror(rc));
+        errorHandler(error);
+    }
+
+    if (implicitTransaction) {
+        abortTransaction();
+    }
+}
+
 void Storage::remove(const void *keyData, uint keySize)
 {
     remove(keyData, keySize, basicErrorHandler());
@@ -387,6 +712,9 @@ void Storage::remove(const void *keyData, uint keySize, const std::function<void
     key.mv_size = keySize;
     key.mv_data = const_cast<void*>(keyData);
     rc = mdb_del(d->transaction, d->dbi, &key, 0);
+    if (!rc) {
+        rc = d->removeChecksum(&key);
+    }
 
     if (rc) {
         Error error(d->name.toStdString(), -1, QString("Error on mdb_del: %1 %2").arg(rc).arg(mdb_strerror(rc)).toStdString());
@@ -404,6 +732,293 @@ void Storage::remove(const void *keyData, uint keySize, const std::function<void
     return;
 }
 
+bool Storage::recordChange(qint64 revision, ChangeType type, const QByteArray &key)
+{
+    if (!d->env) {
+        return false;
+    }
+
+    if (d->mode == ReadOnly) {
+        std::cerr << "tried to write in read-only mode." << std::endl;
+        return false;
+    }
+
+    const bool implicitTransaction = !d->transaction || d->readTransaction;
+    if (implicitTransaction) {
+        if (!startTransaction()) {
+            return false;
+        }
+    }
+
+    //The changelog is created when the environment is opened, so it's only missing if that failed
+    int rc = d->changelogDbi ? 0 : MDB_NOTFOUND;
+    if (!rc) {
+        size_t changeRevision = revision;
+        const QByteArray value = char(type) + key;
+        MDB_val changeKey, data;
+        changeKey.mv_size = sizeof(changeRevision);
+        changeKey.mv_data = &changeRevision;
+        data.mv_size = value.size();
+        data.mv_data = const_cast<char*>(value.constData());
+        //Revisions only ever grow, so the entry is appended to the last page instead of searching the tree.
+        //This fails with MDB_KEYEXIST if the revision is not larger than the last recorded one.
+        rc = mdb_put(d->transaction, d->changelogDbi, &changeKey, &data, MDB_APPEND);
+    }
+
+    if (rc) {
+        std::cerr << "recordChange: " << rc << " " << mdb_strerror(rc) << std::endl;
+    }
+
+    if (implicitTransaction) {
+        if (rc) {
+            abortTransaction();
+        } else {
+            rc = commitTransaction();
+        }
+    }
+
+    return !rc;
+}
+
+void Storage::readChanges(qint64 fromRevision, const std::function<bool(qint64 revision, ChangeType type, const QByteArray &key)> &resultHandler)
+{
+    if (!d->env) {
+        return;
+    }
+
+    const bool implicitTransaction = !d->transaction;
+    if (implicitTransaction) {
+        if (!startTransaction(ReadOnly)) {
+            return;
+        }
+    }
+
+    MDB_cursor *cursor;
+    int rc = d->changelogDbi ? 0 : MDB_NOTFOUND;
+    if (!rc && !(rc = mdb_cursor_open(d->transaction, d->changelogDbi, &cursor))) {
+        size_t startRevision = std::max<qint64>(fromRevision + 1, 0);
+        MDB_val changeKey, data;
+        changeKey.mv_size = sizeof(startRevision);
+        changeKey.mv_data = &startRevision;
+        if ((rc = mdb_cursor_get(cursor, &changeKey, &data, MDB_SET_RANGE)) == 0) {
+            do {
+                if (data.mv_size < 1) {
+                    continue;
+                }
+                const qint64 revision = *static_cast<size_t*>(changeKey.mv_data);
+                const char *value = static_cast<char*>(data.mv_data);
+                if (!resultHandler(revision, static_cast<ChangeType>(value[0]), QByteArray(value + 1, data.mv_size - 1))) {
+                    break;
+                }
+            } while ((rc = mdb_cursor_get(cursor, &changeKey, &data, MDB_NEXT)) == 0);
+        }
+        mdb_cursor_close(cursor);
+    }
+
+    //Nothing has been recorded yet, or we read up to the last change
+    if (rc && rc != MDB_NOTFOUND) {
+        qWarning() << "Error while reading changes: " << mdb_strerror(rc);
+    }
+
+    if (implicitTransaction) {
+        abortTransaction();
+    }
+}
+
+qint64 Storage::oldestChange()
+{
+    qint64 revision = -1;
+    readChanges(-1, [&revision](qint64 r, ChangeType, const QByteArray &) -> bool {
+        revision = r;
+        return false;
+    });
+    return revision;
+}
+
+void Storage::removeChangesBefore(qint64 revision)
+{
+    if (!d->env || d->mode == ReadOnly) {
+        return;
+    }
+
+    const bool implicitTransaction = !d->transaction || d->readTransaction;
+    if (implicitTransaction) {
+        if (!startTransaction()) {
+            return;
+        }
+    }
+
+    MDB_cursor *cursor;
+    int rc = d->changelogDbi ? 0 : MDB_NOTFOUND;
+    if (!rc && !(rc = mdb_cursor_open(d->transaction, d->changelogDbi, &cursor))) {
+        MDB_val changeKey, data;
+        //The oldest entries are always first, so we remove from the front until we reach the revision
+        while ((rc = mdb_cursor_get(cursor, &changeKey, &data, MDB_FIRST)) == 0) {
+            if (qint64(*static_cast<size_t*>(changeKey.mv_data)) >= revision) {
+                break;
+            }
+            if ((rc = mdb_cursor_del(cursor, 0))) {
+                break;
+            }
+        }
+        mdb_cursor_close(cursor);
+    }
+
+    if (rc == MDB_NOTFOUND) {
+        rc = 0;
+    }
+    if (rc) {
+        qWarning() << "Error while compacting the changelog: " << mdb_strerror(rc);
+    }
+
+    if (implicitTransaction) {
+        if (rc) {
+            abortTransaction();
+        } else {
+            commitTransaction();
+        }
+    }
+}
+
+void Storage::setChecksumsEnabled(bool enabled)
+{
+    d->checksums = enabled;
+}
+
+bool Storage::enableCompression()
+{
+    if (!d->env || d->mode == ReadOnly || d->allowDuplicates) {
+        return isCompressed();
+    }
+
+    const bool implicitTransaction = !d->transaction || d->readTransaction;
+    if (implicitTransaction) {
+        if (!startTransaction()) {
+            return false;
+        }
+    }
+
+    int rc = 0;
+    if (!d->compressed) {
+        //Existing values have no header, so they would be misread
+        bool empty = true;
+        MDB_cursor *cursor;
+        if (!(rc = mdb_cursor_open(d->transaction, d->dbi, &cursor))) {
+            MDB_val key, data;
+            while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+                if (!isInternalKey(key.mv_data, key.mv_size)) {
+                    empty = false;
+                    break;
+                }
+            }
+            mdb_cursor_close(cursor);
+        }
+        if (rc == MDB_NOTFOUND) {
+            rc = 0;
+        }
+        if (!rc && empty) {
+            MDB_val key, data;
+            key.mv_size = strlen(s_compressionKey);
+            key.mv_data = const_cast<char*>(s_compressionKey);
+            data.mv_size = 1;
+            data.mv_data = const_cast<char*>("1");
+            if (!(rc = mdb_put(d->transaction, d->dbi, &key, &data, 0))) {
+                d->compressed = true;
+            }
+        }
+    }
+
+    if (rc) {
+        qWarning() << "Error while enabling compression: " << mdb_strerror(rc);
+    }
+
+    if (implicitTransaction) {
+        if (rc) {
+            abortTransaction();
+        } else {
+            commitTransaction();
+        }
+    }
+    return d->compressed;
+}
+
+bool Storage::isCompressed()
+{
+    if (!d->env) {
+        return false;
+    }
+    if (!d->transaction) {
+        //Starting the transaction looks up the flag
+        if (startTransaction(ReadOnly)) {
+            abortTransaction();
+        }
+    }
+    return d->compressed;
+}
+
+void Storage::setCompressionDictionary(const QByteArray &dictionary)
+{
+    d->dictionary = dictionary;
+    if (!dictionary.isEmpty()) {
+        const quint32 id = Compression::dictionaryId(dictionary);
+        d->dictionaries.insert(id, dictionary);
+        const QByteArray key = s_dictionaryPrefix + QByteArray::number(id, 16);
+        write(key.constData(), key.size(), dictionary.constData(), dictionary.size());
+    }
+}
+
+qint64 Storage::scrub(const std::function<bool(const QByteArray &key)> &corruptKeyHandler)
+{
+    if (!d->env) {
+        return 0;
+    }
+
+    const bool implicitTransaction = !d->transaction;
+    if (implicitTransaction) {
+        if (!startTransaction(ReadOnly)) {
+            return 0;
+        }
+    }
+
+    qint64 corrupt = 0;
+    MDB_cursor *checksumCursor;
+    MDB_cursor *cursor;
+    int rc = d->checksumDbi ? 0 : MDB_NOTFOUND;
+    if (!rc && !(rc = mdb_cursor_open(d->transaction, d->checksumDbi, &checksumCursor))) {
+        if (!(rc = mdb_cursor_open(d->transaction, d->dbi, &cursor))) {
+            MDB_val key, checksum, data;
+            //Both databases are sorted by key, so the values are looked up in key order as well
+            while ((rc = mdb_cursor_get(checksumCursor, &key, &checksum, MDB_NEXT)) == 0) {
+                MDB_val valueKey = key;
+                bool valid = false;
+                if (checksum.mv_size == sizeof(quint32) && mdb_cursor_get(cursor, &valueKey, &data, MDB_SET) == 0) {
+                    quint32 expected;
+                    memcpy(&expected, checksum.mv_data, sizeof(expected));
+                    valid = Checksum::crc32c(data.mv_data, data.mv_size) == expected;
+                }
+                if (!valid) {
+                    corrupt++;
+                    if (!corruptKeyHandler(QByteArray(static_cast<char*>(key.mv_data), key.mv_size))) {
+                        break;
+                    }
+                }
+            }
+            mdb_cursor_close(cursor);
+        }
+        mdb_cursor_close(checksumCursor);
+    }
+
+    //No checksums have been recorded, or we checked all of them
+    if (rc && rc != MDB_NOTFOUND) {
+        qWarning() << "Error while scrubbing: " << mdb_strerror(rc);
+    }
+
+    if (implicitTransaction) {
+        abortTransaction();
+    }
+    return corrupt;
+}
+
 qint64 Storage::diskUsage() const
 {
     QFileInfo info(d->storageRoot + '/' + d->name + "/data.mdb");
@@ -419,6 +1034,8 @@ void Storage::removeFromDisk() const
         qWarning() << "Failed to remove directory" << d->storageRoot << d->name;
     }
     auto env = d->sEnvironments.take(fullPath);
+    d->sChecksumDbis.remove(fullPath);
+    d->sChangelogDbis.remove(fullPath);
     mdb_env_close(env);
 }
 
@@ -19,8 +19,10 @@
  */
 
 #include "storage.h"
+#include "checksum.h"
 
 #include <iostream>
+#include <algorithm>
 
 #include <QAtomicInt>
 #include <QDebug>
@@ -28,6 +30,7 @@
 #include <QReadWriteLock>
 #include <QString>
 #include <QTime>
+#include <QMap>
 
 extern "C" {
     #include "unqlite/unqlite.h"
@@ -37,6 +40,8 @@ namespace Akonadi2
 {
 
 static const char *s_unqliteDir = "/unqlite/";
+//unqlite has no separate databases, so the checksums are stored in the main database under internal keys
+static const char *s_checksumPrefix = "__internal_checksum_";
 
 class Storage::Private
 {
@@ -55,6 +60,7 @@ public:
     unqlite *db;
     bool allowDuplicates;
     bool inTransaction;
+    bool checksums;
 };
 
 Storage::Private::Private(const QString &s, const QString &n, AccessMode m, bool duplicates)
@@ -63,7 +69,8 @@ Storage::Private::Private(const QString &s, const QString &n, AccessMode m, bool
       mode(m),
       db(0),
       allowDuplicates(duplicates), //FIXME: currently does nothing ... should do what it says
-      inTransaction(false)
+      inTransaction(false),
+      checksums(false)
 {
     const QString fullPath(storageRoot + s_unqliteDir + name);
     QDir dir;
@@ -198,6 +205,11 @@ bool Storage::write(const void *key, size_t keySize, const void *value, size_t v
     }
 
     int rc = unqlite_kv_store(d->db, key, keySize, value, valueSize);
+    if (rc == UNQLITE_OK && d->checksums && !isInternalKey(const_cast<void*>(key), keySize)) {
+        const QByteArray checksumKey = s_checksumPrefix + QByteArray(static_cast<const char*>(key), keySize);
+        const quint32 checksum = Checksum::crc32c(value, valueSize);
+        rc = unqlite_kv_store(d->db, checksumKey.constData(), checksumKey.size(), &checksum, sizeof(checksum));
+    }
 
     if (rc != UNQLITE_OK) {
         d->reportDbError("unqlite_kv_store");
@@ -250,6 +262,8 @@ void Storage::remove(const void *keyData, uint keySize,
     }
 
     unqlite_kv_delete(d->db, keyData, keySize);
+    const QByteArray checksumKey = s_checksumPrefix + QByteArray(static_cast<const char*>(keyData), keySize);
+    unqlite_kv_delete(d->db, checksumKey.constData(), checksumKey.size());
 }
 
 
@@ -321,6 +335,156 @@ void Storage::scan(const char *keyData, uint keySize,
     unqlite_kv_cursor_release(d->db, cursor);
 }
 
+void Storage::scan(const QVector<QByteArray> &keys,
+                   const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+                   const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    QVector<QByteArray> sortedKeys = keys;
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+    sortedKeys.erase(std::unique(sortedKeys.begin(), sortedKeys.end()), sortedKeys.end());
+
+    bool done = false;
+    for (const auto &key : sortedKeys) {
+        if (done) {
+            break;
+        }
+        scan(key.constData(), key.size(), [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+            done = !resultHandler(keyPtr, keySize, valuePtr, valueSize);
+            return !done;
+        }, errorHandler);
+    }
+}
+
+void Storage::scanFrom(const QByteArray &startKey,
+                       const std::function<bool(void *keyPtr, int keySize, void *valuePtr, int valueSize)> &resultHandler,
+                       const std::function<void(const Storage::Error &error)> &errorHandler)
+{
+    //The unqlite key/value store is hash based and not ordered,
+    //so the keys are collected from a full scan and their values are then looked up in key order
+    QVector<QByteArray> keys;
+    scan(nullptr, 0, [&](void *keyPtr, int keySize, void *, int) -> bool {
+        const QByteArray key(static_cast<char*>(keyPtr), keySize);
+        if (key >= startKey) {
+            keys << key;
+        }
+        return true;
+    }, errorHandler);
+    scan(keys, resultHandler, errorHandler);
+}
+
+//unqlite has no separate databases, so the changelog is stored in the main database under internal keys
+static const char *s_changelogPrefix = "__internal_changelog_";
+
+static QByteArray changelogKey(qint64 revision)
+{
+    return s_changelogPrefix + QByteArray::number(revision);
+}
+
+//Collects the changelog by revision, since the scan is not ordered
+static QMap<qint64, QByteArray> changelogEntries(Storage &storage, qint64 fromRevision)
+{
+    const QByteArray prefix(s_changelogPrefix);
+    QMap<qint64, QByteArray> entries;
+    storage.scan(nullptr, 0, [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        const QByteArray changeKey = QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize);
+        if (changeKey.startsWith(prefix)) {
+            const qint64 revision = changeKey.mid(prefix.size()).toLongLong();
+            if (revision > fromRevision && valueSize > 0) {
+                entries.insert(revision, QByteArray(static_cast<char*>(valuePtr), valueSize));
+            }
+        }
+        return true;
+    }, Storage::basicErrorHandler());
+    return entries;
+}
+
+bool Storage::recordChange(qint64 revision, ChangeType type, const QByteArray &key)
+{
+    const QByteArray changeKey = changelogKey(revision);
+    const QByteArray value = char(type) + key;
+    return write(changeKey.constData(), changeKey.size(), value.constData(), value.size());
+}
+
+void Storage::readChanges(qint64 fromRevision, const std::function<bool(qint64 revision, ChangeType type, const QByteArray &key)> &resultHandler)
+{
+    const auto entries = changelogEntries(*this, fromRevision);
+    for (auto it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        if (!resultHandler(it.key(), static_cast<ChangeType>(it.value().at(0)), it.value().mid(1))) {
+            break;
+        }
+    }
+}
+
+qint64 Storage::oldestChange()
+{
+    const auto entries = changelogEntries(*this, -1);
+    return entries.isEmpty() ? -1 : entries.firstKey();
+}
+
+void Storage::removeChangesBefore(qint64 revision)
+{
+    const auto entries = changelogEntries(*this, -1);
+    for (auto it = entries.constBegin(); it != entries.constEnd() && it.key() < revision; ++it) {
+        const QByteArray changeKey = changelogKey(it.key());
+        remove(changeKey.constData(), changeKey.size());
+    }
+}
+
+void Storage::setChecksumsEnabled(bool enabled)
+{
+    d->checksums = enabled;
+}
+
+qint64 Storage::scrub(const std::function<bool(const QByteArray &key)> &corruptKeyHandler)
+{
+    //Collect the checksums by key, since the scan is not ordered
+    const QByteArray prefix(s_checksumPrefix);
+    QMap<QByteArray, quint32> checksums;
+    scan(nullptr, 0, [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+        const QByteArray checksumKey = QByteArray::fromRawData(static_cast<char*>(keyPtr), keySize);
+        if (checksumKey.startsWith(prefix)) {
+            quint32 checksum = 0;
+            if (valueSize == sizeof(checksum)) {
+                memcpy(&checksum, valuePtr, sizeof(checksum));
+            }
+            checksums.insert(checksumKey.mid(prefix.size()), checksum);
+        }
+        return true;
+    }, basicErrorHandler());
+
+    qint64 corrupt = 0;
+    for (auto it = checksums.constBegin(); it != checksums.constEnd(); ++it) {
+        bool valid = false;
+        scan(it.key().constData(), it.key().size(), [&](void *keyPtr, int keySize, void *valuePtr, int valueSize) -> bool {
+            valid = Checksum::crc32c(valuePtr, valueSize) == it.value();
+            return false;
+        }, [](const Storage::Error &) {});
+        if (!valid) {
+            corrupt++;
+            if (!corruptKeyHandler(it.key())) {
+                break;
+            }
+        }
+    }
+    return corrupt;
+}
+
+//Compression is only implemented by the lmdb backend, so the values of this backend are always stored uncompressed
+bool Storage::enableCompression()
+{
+    return false;
+}
+
+bool Storage::isCompressed()
+{
+    return false;
+}
+
+void Storage::setCompressionDictionary(const QByteArray &dictionary)
+{
+    Q_UNUSED(dictionary);
+}
+
 qint64 Storage::diskUsage() const
 {
     QFileInfo info(d->storageRoot + s_unqliteDir + d->name);
@@ -1,5 +1,6 @@
 #include <QtTest>
 #include <QDebug>
+#include <QtConcurrent/QtConcurrentRun>
 #include <functional>
 
 #include "../clientapi.h"
@@ -11,7 +12,7 @@ public:
     virtual Async::Job<void> create(const Akonadi2::Domain::Event &domainObject){ return Async::null<void>(); };
     virtual Async::Job<void> modify(const Akonadi2::Domain::Event &domainObject){ return Async::null<void>(); };
     virtual Async::Job<void> remove(const Akonadi2::Domain::Event &domainObject){ return Async::null<void>(); };
-    virtual Async::Job<void> load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback)
+    virtual Async::Job<void> load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const std::function<void(const Akonadi2::ResumePoint &)> &resumeCallback)
     {
         return Async::start<void>([this, resultCallback](Async::Future<void> &future) {
             qDebug() << "load called";
@@ -25,6 +26,21 @@ public:
     QList<Akonadi2::Domain::Event::Ptr> results;
 };
 
+//A facade of a resource that never answers
+class HangingResourceFacade : public Akonadi2::StoreFacade<Akonadi2::Domain::Event>
+{
+public:
+    ~HangingResourceFacade(){};
+    virtual Async::Job<void> create(const Akonadi2::Domain::Event &domainObject){ return Async::null<void>(); };
+    virtual Async::Job<void> modify(const Akonadi2::Domain::Event &domainObject){ return Async::null<void>(); };
+    virtual Async::Job<void> remove(const Akonadi2::Domain::Event &domainObject){ return Async::null<void>(); };
+    virtual Async::Job<void> load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const std::function<void(const Akonadi2::ResumePoint &)> &resumeCallback)
+    {
+        return Async::start<void>([](Async::Future<void> &future) {
+        });
+    }
+};
+
 class ClientAPITest : public QObject
 {
     Q_OBJECT
@@ -45,6 +61,69 @@ private Q_SLOTS:
         QCOMPARE(result.size(), 1);
     }
 
+    void testBatchedLoad()
+    {
+        DummyResourceFacade facade;
+        for (int i = 0; i < 2500; i++) {
+            facade.results << QSharedPointer<Akonadi2::Domain::Event>::create("resource", QString::number(i), 0, QSharedPointer<Akonadi2::Domain::BufferAdaptor>());
+        }
+
+        Akonadi2::FacadeFactory::instance().registerFacade<Akonadi2::Domain::Event, DummyResourceFacade>("batchresource", [facade](){ return new DummyResourceFacade(facade); });
+
+        Akonadi2::Query query;
+        query.resources << "batchresource";
+
+        int batches = 0;
+        int values = 0;
+        QEventLoop loop;
+        auto emitter = Akonadi2::Store::load<Akonadi2::Domain::Event>(query);
+        emitter->onAddedBatch([&](const QList<Akonadi2::Domain::Event::Ptr> &batch) {
+            batches++;
+            values += batch.size();
+        });
+        emitter->onComplete([&]() {
+            loop.quit();
+        });
+        loop.exec();
+        QCOMPARE(values, 2500);
+        //At least three batches due to the batch size, but far less than one per value
+        QVERIFY(batches >= 3);
+        QVERIFY(batches < 2500);
+    }
+
+    void testResultsOfASlowResource()
+    {
+        async::ResultProvider<int> resultProvider;
+        auto emitter = resultProvider.emitter();
+        QList<int> values;
+        emitter->onAdded([&values](const int &value) {
+            values << value;
+        });
+        //No further value follows and the query doesn't complete, the value is delivered anyways
+        QtConcurrent::run([&resultProvider]() {
+            resultProvider.add(1);
+        }).waitForFinished();
+        QTRY_COMPARE(values.size(), 1);
+    }
+
+    void testLoadWithHangingResource()
+    {
+        DummyResourceFacade facade;
+        facade.results << QSharedPointer<Akonadi2::Domain::Event>::create("resource", "id", 0, QSharedPointer<Akonadi2::Domain::BufferAdaptor>());
+
+        Akonadi2::FacadeFactory::instance().registerFacade<Akonadi2::Domain::Event, DummyResourceFacade>("dummyresource", [facade](){ return new DummyResourceFacade(facade); });
+        Akonadi2::FacadeFactory::instance().registerFacade<Akonadi2::Domain::Event, HangingResourceFacade>("hangingresource", [](){ return new HangingResourceFacade; });
+
+        Akonadi2::Query query;
+        query.resources << "hangingresource" << "dummyresource";
+        query.resourceTimeout = 100;
+
+        //The hanging resource neither blocks the results of the other one, nor the completion of the query
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+    }
+
 };
 
 QTEST_MAIN(ClientAPITest)
@@ -20,10 +20,73 @@
 
 #include "threadboundary.h"
 
-Q_DECLARE_METATYPE(std::function<void()>);
+#include <QPointer>
 
 namespace async {
-ThreadBoundary::ThreadBoundary(): QObject() { qRegisterMetaType<std::function<void()> >("std::function<void()>"); }
-ThreadBoundary:: ~ThreadBoundary() {}
+ThreadBoundary::ThreadBoundary()
+    : QObject(),
+    mScheduled(false)
+{
+    Node *stub = new Node;
+    stub->next.store(nullptr, std::memory_order_relaxed);
+    mHead.store(stub, std::memory_order_relaxed);
+    mTail = stub;
 }
 
+ThreadBoundary::~ThreadBoundary()
+{
+    //Drop calls that didn't get executed anymore
+    std::function<void()> f;
+    while (takeNext(f)) {
+    }
+    delete mTail;
+}
+
+void ThreadBoundary::callInMainThread(std::function<void()> f)
+{
+    Node *node = new Node;
+    node->function = std::move(f);
+    node->next.store(nullptr, std::memory_order_relaxed);
+    //Producers serialize on the exchange only, the previous head is then linked to the new node
+    Node *previous = mHead.exchange(node, std::memory_order_acq_rel);
+    previous->next.store(node, std::memory_order_release);
+
+    //Only wake the main thread up if no run is pending already
+    if (!mScheduled.exchange(true)) {
+        QMetaObject::invokeMethod(this, "runPendingCalls", Qt::QueuedConnection);
+    }
+}
+
+bool ThreadBoundary::takeNext(std::function<void()> &f)
+{
+    Node *tail = mTail;
+    Node *next = tail->next.load(std::memory_order_acquire);
+    //Either empty, or a producer has not linked its node yet; in that case the producer schedules another run.
+    if (!next) {
+        return false;
+    }
+    f = std::move(next->function);
+    //The consumed node becomes the new stub
+    mTail = next;
+    delete tail;
+    return true;
+}
+
+void ThreadBoundary::runPendingCalls()
+{
+    //Reset before draining, so calls added from now on schedule another run
+    mScheduled.store(false);
+    //A call may delete the boundary, e.g. by releasing the last reference to its owner
+    QPointer<ThreadBoundary> guard(this);
+    std::function<void()> f;
+    while (takeNext(f)) {
+        f();
+        //The captures may hold the last reference as well, so they are released before the members are touched again
+        f = nullptr;
+        if (!guard) {
+            return;
+        }
+    }
+}
+
+}
@@ -21,12 +21,16 @@
 #pragma once
 
 #include <QObject>
+#include <atomic>
 #include <functional>
 
 namespace async {
     /*
      * A helper class to invoke a method in a different thread using the event loop.
      * The ThreadBoundary object must live in the thread where the function should be called.
+     *
+     * Calls are passed through a lock-free multi-producer/single-consumer queue,
+     * and the eventloop of the main thread is only woken up once for all calls that are pending by then.
      */
     class ThreadBoundary : public QObject {
         Q_OBJECT
@@ -35,13 +39,25 @@ namespace async {
         virtual ~ThreadBoundary();
 
         //Call in worker thread
-        void callInMainThread(std::function<void()> f) {
-            QMetaObject::invokeMethod(this, "addValueInMainThread", Qt::QueuedConnection, QGenericReturnArgument(), Q_ARG(std::function<void()>, f));
-        }
+        void callInMainThread(std::function<void()> f);
+
     public slots:
         //Get's called in main thread by it's eventloop
-        void addValueInMainThread(std::function<void()> f) {
-            f();
-        }
+        void runPendingCalls();
+
+    private:
+        struct Node {
+            std::function<void()> function;
+            std::atomic<Node*> next;
+        };
+
+        bool takeNext(std::function<void()> &f);
+
+        //Producers append at mHead, the main thread consumes from mTail.
+        //mTail always points to a node whose function has been consumed already (initially a stub).
+        std::atomic<Node*> mHead;
+        Node *mTail;
+        //Set while a call to runPendingCalls is queued, so the main thread is only woken up once
+        std::atomic<bool> mScheduled;
     };
 }
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014 Christian Mollekopf <chrigi_1@fastmail.fm>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) version 3, or any
+ * later version accepted by the membership of KDE e.V. (or its
+ * successor approved by the membership of KDE e.V.), which shall
+ * act as a proxy defined in Section 6 of version 3 of the license.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QVector>
+#include <algorithm>
+#include <functional>
+
+/**
+ * Collects the k smallest values according to @param lessThan.
+ *
+ * The values are kept in a bounded max-heap, so adding a value is O(log k) and memory is O(k),
+ * independent of the number of values that are added.
+ * A @param k of std::numeric_limits<int>::max() collects all values.
+ */
+template<typename T>
+class TopK
+{
+public:
+    TopK(int k, const std::function<bool(const T &, const T &)> &lessThan)
+        : mK(k),
+        mLessThan(lessThan)
+    {
+        //Unbounded heaps grow with the values that are added
+        mHeap.reserve(std::min(k, 1024));
+    }
+
+    void add(const T &value)
+    {
+        if (mK <= 0) {
+            return;
+        }
+        if (mHeap.size() < mK) {
+            mHeap.append(value);
+            std::push_heap(mHeap.begin(), mHeap.end(), mLessThan);
+        } else if (mLessThan(value, mHeap.first())) {
+            //Replace the largest value we have so far
+            std::pop_heap(mHeap.begin(), mHeap.end(), mLessThan);
+            mHeap.last() = value;
+            std::push_heap(mHeap.begin(), mHeap.end(), mLessThan);
+        }
+    }
+
+    /**
+     * Returns the collected values in ascending order and resets the heap.
+     */
+    QVector<T> takeSorted()
+    {
+        QVector<T> result;
+        result.swap(mHeap);
+        std::sort_heap(result.begin(), result.end(), mLessThan);
+        return result;
+    }
+
+private:
+    int mK;
+    std::function<bool(const T &, const T &)> mLessThan;
+    QVector<T> mHeap;
+};
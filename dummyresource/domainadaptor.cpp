@@ -8,143 +8,130 @@
 #include "event_generated.h"
 #include "entity_generated.h"
 #include "metadata_generated.h"
-#include "domainadaptor.h"
+#include "dummyevent_adaptor_generated.h"
 #include <common/entitybuffer.h>
+#include <common/builderpool.h>
 
 using namespace DummyCalendar;
 using namespace flatbuffers;
 
-using namespace DummyCalendar;
-using namespace flatbuffers;
-
-//This will become a generic implementation that simply takes the resource buffer and local buffer pointer
-class DummyEventAdaptor : public Akonadi2::Domain::BufferAdaptor
-{
-public:
-    DummyEventAdaptor()
-        : BufferAdaptor()
-    {
-
-    }
-
-    void setProperty(const QString &key, const QVariant &value)
-    {
-        if (mResourceMapper && mResourceMapper->mWriteAccessors.contains(key)) {
-            // mResourceMapper->setProperty(key, value, mResourceBuffer);
-        } else {
-            // mLocalMapper.;
-        }
-    }
-
-    virtual QVariant getProperty(const QString &key) const
-    {
-        if (mResourceBuffer && mResourceMapper->mReadAccessors.contains(key)) {
-            return mResourceMapper->getProperty(key, mResourceBuffer);
-        } else if (mLocalBuffer && mLocalMapper->mReadAccessors.contains(key)) {
-            return mLocalMapper->getProperty(key, mLocalBuffer);
-        }
-        qWarning() << "no mapping available for key " << key;
-        return QVariant();
-    }
-
-    virtual QStringList availableProperties() const
-    {
-        QStringList props;
-        props << mResourceMapper->mReadAccessors.keys();
-        props << mLocalMapper->mReadAccessors.keys();
-        return props;
-    }
-
-    Akonadi2::Domain::Buffer::Event const *mLocalBuffer;
-    DummyEvent const *mResourceBuffer;
-
-    QSharedPointer<PropertyMapper<Akonadi2::Domain::Buffer::Event> > mLocalMapper;
-    QSharedPointer<PropertyMapper<DummyEvent> > mResourceMapper;
-};
-
+typedef Akonadi2::Domain::Buffer::Event LocalEvent;
 
 DummyEventAdaptorFactory::DummyEventAdaptorFactory()
     : DomainTypeAdaptorFactory()
 {
     mResourceMapper = QSharedPointer<PropertyMapper<DummyEvent> >::create();
-    mResourceMapper->mReadAccessors.insert("summary", [](DummyEvent const *buffer) -> QVariant {
-        if (buffer->summary()) {
-            return QString::fromStdString(buffer->summary()->c_str());
-        }
-        return QVariant();
-    });
-    mLocalMapper = QSharedPointer<PropertyMapper<Akonadi2::Domain::Buffer::Event> >::create();
-    mLocalMapper->mReadAccessors.insert("summary", [](Akonadi2::Domain::Buffer::Event const *buffer) -> QVariant {
-        if (buffer->summary()) {
-            return QString::fromStdString(buffer->summary()->c_str());
-        }
-        return QVariant();
-    });
-    mLocalMapper->mReadAccessors.insert("uid", [](Akonadi2::Domain::Buffer::Event const *buffer) -> QVariant {
-        if (buffer->uid()) {
-            return QString::fromStdString(buffer->uid()->c_str());
-        }
-        return QVariant();
-    });
+    mResourceMapper->setProperties(DummyEventResourceProperties);
+    mLocalMapper = QSharedPointer<PropertyMapper<LocalEvent> >::create();
+    mLocalMapper->setProperties(DummyEventLocalProperties);
 
+    //Attachments can be large, so they are not copied into results unless requested
+    mOnDemandProperties << "attachment";
+
+    //Large attachments are replaced by a reference to the blob store (see extractBlobs)
+    mBlobs = QSharedPointer<Akonadi2::BlobStore>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy");
 }
 
 //TODO pass EntityBuffer instead?
 QSharedPointer<Akonadi2::Domain::BufferAdaptor> DummyEventAdaptorFactory::createAdaptor(const Akonadi2::Entity &entity)
 {
-    DummyEvent const *resourceBuffer = 0;
-    if (auto resourceData = entity.resource()) {
-        flatbuffers::Verifier verifyer(resourceData->Data(), resourceData->size());
-        if (VerifyDummyEventBuffer(verifyer)) {
-            resourceBuffer = GetDummyEvent(resourceData->Data());
-        }
-    }
-
-    Akonadi2::Metadata const *metadataBuffer = 0;
-    if (auto metadataData = entity.metadata()) {
-        flatbuffers::Verifier verifyer(metadataData->Data(), metadataData->size());
-        if (Akonadi2::VerifyMetadataBuffer(verifyer)) {
-            metadataBuffer = Akonadi2::GetMetadata(metadataData->Data());
-        }
-    }
+    return createAdaptor(entity, true);
+}
 
-    Akonadi2::Domain::Buffer::Event const *localBuffer = 0;
-    if (auto localData = entity.local()) {
-        flatbuffers::Verifier verifyer(localData->Data(), localData->size());
-        if (Akonadi2::Domain::Buffer::VerifyEventBuffer(verifyer)) {
-            localBuffer = Akonadi2::Domain::Buffer::GetEvent(localData->Data());
-        }
-    }
+QSharedPointer<Akonadi2::Domain::BufferAdaptor> DummyEventAdaptorFactory::createAdaptor(const Akonadi2::Entity &entity, bool verify)
+{
+    auto resourceBuffer = Akonadi2::EntityBuffer::readBuffer(entity.resource(), &VerifyDummyEventBuffer, &GetDummyEvent, verify);
+    auto localBuffer = Akonadi2::EntityBuffer::readBuffer(entity.local(), &Akonadi2::Domain::Buffer::VerifyEventBuffer, &Akonadi2::Domain::Buffer::GetEvent, verify);
 
     auto adaptor = QSharedPointer<DummyEventAdaptor>::create();
     adaptor->mLocalBuffer = localBuffer;
     adaptor->mLocalMapper = mLocalMapper;
     adaptor->mResourceBuffer = resourceBuffer;
     adaptor->mResourceMapper = mResourceMapper;
+    adaptor->mBlobs = mBlobs;
     return adaptor;
 }
 
-void DummyEventAdaptorFactory::createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb)
+bool DummyEventAdaptorFactory::verify(const Akonadi2::Entity &entity)
+{
+    //Both buffers are optional, but if they are there they have to be valid
+    if (entity.resource() && entity.resource()->size() && !Akonadi2::EntityBuffer::readBuffer(entity.resource(), &VerifyDummyEventBuffer, &GetDummyEvent)) {
+        return false;
+    }
+    if (entity.local() && entity.local()->size() && !Akonadi2::EntityBuffer::readBuffer(entity.local(), &Akonadi2::Domain::Buffer::VerifyEventBuffer, &Akonadi2::Domain::Buffer::GetEvent)) {
+        return false;
+    }
+    return true;
+}
+
+QVector<QByteArray> DummyEventAdaptorFactory::extractBlobs(const Akonadi2::Entity &entity, Akonadi2::BlobStore &blobs, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb)
 {
-    flatbuffers::FlatBufferBuilder eventFbb;
-    eventFbb.Clear();
-    {
-        auto summary = eventFbb.CreateString(event.getProperty("summary").toString().toStdString());
-        DummyCalendar::DummyEventBuilder eventBuilder(eventFbb);
-        eventBuilder.add_summary(summary);
-        auto eventLocation = eventBuilder.Finish();
-        DummyCalendar::FinishDummyEventBuffer(eventFbb, eventLocation);
+    //The pipeline verified the buffers already
+    auto adaptor = createAdaptor(entity, false);
+    const auto attachment = adaptor->getBytes("attachment");
+    if (attachment.size() < Akonadi2::BlobStore::threshold) {
+        return QVector<QByteArray>();
     }
+    //Equal attachments have the same reference, so they are only stored once
+    const QByteArray reference = blobs.add(attachment.data(), attachment.size());
+    //The attachment was read once already, so only the remaining properties are copied into the new buffers
+    auto properties = adaptor->availableProperties();
+    properties.removeAll("attachment");
+    Akonadi2::Domain::MemoryBufferAdaptor event(*adaptor, properties);
+    event.setProperty("attachmentRef", reference);
+
+    FinishDummyEventBuffer(resourceFbb, createDummyEventResourceBuffer(resourceFbb, event));
+    Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, createDummyEventLocalBuffer(localFbb, event));
+    return QVector<QByteArray>() << reference;
+}
 
-    flatbuffers::FlatBufferBuilder localFbb;
-    {
-        auto uid = localFbb.CreateString(event.getProperty("uid").toString().toStdString());
-        auto localBuilder = Akonadi2::Domain::Buffer::EventBuilder(localFbb);
-        localBuilder.add_uid(uid);
-        auto location = localBuilder.Finish();
-        Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, location);
+bool DummyEventAdaptorFactory::mergeEntity(const Akonadi2::Entity &current, const Akonadi2::Entity &delta, const QStringList &deletions, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb)
+{
+    //The attachment is read back from the blob store, and added again by extractBlobs, which keeps the reference count of unchanged attachments
+    Akonadi2::Domain::MemoryBufferAdaptor event(*createAdaptor(current));
+    event.setProperty("attachmentRef", QVariant());
+
+    //The pipeline verified the delta already
+    auto changes = createAdaptor(delta, false);
+    for (const auto &property : changes->availableProperties()) {
+        const auto value = changes->getProperty(property);
+        if (value.isValid()) {
+            event.setProperty(property, value);
+        }
     }
+    for (const auto &property : deletions) {
+        event.setProperty(property, QVariant());
+    }
+
+    FinishDummyEventBuffer(resourceFbb, createDummyEventResourceBuffer(resourceFbb, event));
+    Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, createDummyEventLocalBuffer(localFbb, event));
+    return true;
+}
 
-    Akonadi2::EntityBuffer::assembleEntityBuffer(fbb, 0, 0, eventFbb.GetBufferPointer(), eventFbb.GetSize(), localFbb.GetBufferPointer(), localFbb.GetSize());
+QuerySortField<Akonadi2::Domain::Buffer::Event, DummyEvent> DummyEventAdaptorFactory::createSortField(const QString &property) const
+{
+    QuerySortField<Akonadi2::Domain::Buffer::Event, DummyEvent> field;
+    if (property == "summary") {
+        field.setResourceField(&DummyEvent::summary);
+    } else if (property == "description") {
+        field.setResourceField(&DummyEvent::description);
+    } else if (property == "uid") {
+        field.setLocalField(&Akonadi2::Domain::Buffer::Event::uid);
+    }
+    //Other properties return an invalid field, the query fails on those
+    return field;
 }
 
+flatbuffers::Offset<flatbuffers::Vector<uint8_t> > DummyEventAdaptorFactory::createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb)
+{
+    Q_ASSERT(fbb.GetSize() == 0);
+    //The resource buffer is built first, so it can be built in place
+    auto resource = Akonadi2::EntityBuffer::finishNestedBuffer(fbb, createDummyEventResourceBuffer(fbb, event), DummyCalendar::DummyEventIdentifier());
+
+    //The local buffer could share vtables with the resource buffer, so it needs a builder of its own
+    Akonadi2::BuilderPool::Builder localFbb;
+    Akonadi2::Domain::Buffer::FinishEventBuffer(*localFbb, createDummyEventLocalBuffer(*localFbb, event));
+    auto local = Akonadi2::EntityBuffer::createNestedBuffer(fbb, localFbb->GetBufferPointer(), localFbb->GetSize());
+
+    return Akonadi2::EntityBuffer::finishNestedBuffer(fbb, Akonadi2::EntityBuffer::createEntity(fbb, 0, resource, local));
+}
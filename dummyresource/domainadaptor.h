@@ -11,5 +11,19 @@ class DummyEventAdaptorFactory : public DomainTypeAdaptorFactory<Akonadi2::Domai
 public:
     DummyEventAdaptorFactory();
     virtual QSharedPointer<Akonadi2::Domain::BufferAdaptor> createAdaptor(const Akonadi2::Entity &entity);
-    virtual void createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb);
+    virtual QSharedPointer<Akonadi2::Domain::BufferAdaptor> createAdaptor(const Akonadi2::Entity &entity, bool verify);
+    /**
+     * Verifies the resource and local buffer of @param entity, the pipeline does this once before an entity is stored.
+     */
+    static bool verify(const Akonadi2::Entity &entity);
+    /**
+     * Moves the attachment of @param entity to @param blobs if it is too large to be stored inline, see Akonadi2::Pipeline::setBlobExtractor.
+     */
+    QVector<QByteArray> extractBlobs(const Akonadi2::Entity &entity, Akonadi2::BlobStore &blobs, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb);
+    /**
+     * Applies the properties set in @param delta and the @param deletions to @param current, see Akonadi2::Pipeline::setEntityMerger.
+     */
+    bool mergeEntity(const Akonadi2::Entity &current, const Akonadi2::Entity &delta, const QStringList &deletions, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb);
+    virtual flatbuffers::Offset<flatbuffers::Vector<uint8_t> > createBuffer(const Akonadi2::Domain::Event &event, flatbuffers::FlatBufferBuilder &fbb);
+    virtual QuerySortField<Akonadi2::Domain::Buffer::Event, DummyCalendar::DummyEvent> createSortField(const QString &property) const;
 };
@@ -21,6 +21,7 @@
 
 #include <QDebug>
 #include <functional>
+#include <limits>
 
 #include "common/resourceaccess.h"
 #include "common/commands.h"
@@ -29,9 +30,14 @@
 #include "entity_generated.h"
 #include "metadata_generated.h"
 #include "createentity_generated.h"
+#include "modifyentity_generated.h"
+#include "deleteentity_generated.h"
 #include "domainadaptor.h"
 #include <common/entitybuffer.h>
+#include <common/builderpool.h>
 #include <common/index.h>
+#include <common/topk.h>
+#include <common/querycache.h>
 
 using namespace DummyCalendar;
 using namespace flatbuffers;
@@ -49,13 +55,12 @@ DummyResourceFacade::~DummyResourceFacade()
 
 Async::Job<void> DummyResourceFacade::create(const Akonadi2::Domain::Event &domainObject)
 {
-    flatbuffers::FlatBufferBuilder entityFbb;
-    mFactory->createBuffer(domainObject, entityFbb);
-
-    flatbuffers::FlatBufferBuilder fbb;
+    Akonadi2::BuilderPool::Builder builder;
+    auto &fbb = *builder;
+    //The entity is built in place as delta of the command
+    auto delta = mFactory->createBuffer(domainObject, fbb);
     //This is the resource buffer type and not the domain type
     auto type = fbb.CreateString("event");
-    auto delta = fbb.CreateVector<uint8_t>(entityFbb.GetBufferPointer(), entityFbb.GetSize());
     auto location = Akonadi2::Commands::CreateCreateEntity(fbb, type, delta);
     Akonadi2::Commands::FinishCreateEntityBuffer(fbb, location);
     mResourceAccess->open();
@@ -64,55 +69,30 @@ Async::Job<void> DummyResourceFacade::create(const Akonadi2::Domain::Event &doma
 
 Async::Job<void> DummyResourceFacade::modify(const Akonadi2::Domain::Event &domainObject)
 {
-    //Create message buffer and send to resource
-    return Async::null<void>();
+    Akonadi2::BuilderPool::Builder builder;
+    auto &fbb = *builder;
+    //The entity is built in place as delta of the command, the resource merges it with the stored entity
+    auto delta = mFactory->createBuffer(domainObject, fbb);
+    auto entityId = fbb.CreateString(domainObject.identifier().toStdString());
+    //This is the resource buffer type and not the domain type
+    auto type = fbb.CreateString("event");
+    auto location = Akonadi2::CreateModifyEntity(fbb, domainObject.revision(), entityId, 0, type, delta);
+    Akonadi2::FinishModifyEntityBuffer(fbb, location);
+    mResourceAccess->open();
+    return mResourceAccess->sendCommand(Akonadi2::Commands::ModifyEntityCommand, fbb);
 }
 
 Async::Job<void> DummyResourceFacade::remove(const Akonadi2::Domain::Event &domainObject)
 {
-    //Create message buffer and send to resource
-    return Async::null<void>();
-}
-
-static std::function<bool(const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)> prepareQuery(const Akonadi2::Query &query)
-{
-    //Compose some functions to make query matching fast.
-    //This way we can process the query once, and convert all values into something that can be compared quickly
-    std::function<bool(const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)> preparedQuery;
-    if (!query.ids.isEmpty()) {
-        //Match by id
-        //TODO: for id's a direct lookup would be way faster
-
-        //We convert the id's to std::string so we don't have to convert each key during the scan. (This runs only once, and the query will be run for every key)
-        //Probably a premature optimization, but perhaps a useful technique to be investigated.
-        QVector<std::string> ids;
-        for (const auto &id : query.ids) {
-            ids << id.toStdString();
-        }
-        preparedQuery = [ids](const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local) {
-            if (ids.contains(key)) {
-                return true;
-            }
-            return false;
-        };
-    } else if (!query.propertyFilter.isEmpty()) {
-        if (query.propertyFilter.contains("uid")) {
-            const QByteArray uid = query.propertyFilter.value("uid").toByteArray();
-            preparedQuery = [uid](const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local) {
-                if (local && local->uid() && (QByteArray::fromRawData(local->uid()->c_str(), local->uid()->size()) == uid)) {
-                    qDebug() << "uid match";
-                    return true;
-                }
-                return false;
-            };
-        }
-    } else {
-        //Match everything
-        preparedQuery = [](const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local) {
-            return true;
-        };
-    }
-    return preparedQuery;
+    Akonadi2::BuilderPool::Builder builder;
+    auto &fbb = *builder;
+    auto entityId = fbb.CreateString(domainObject.identifier().toStdString());
+    //This is the resource buffer type and not the domain type
+    auto type = fbb.CreateString("event");
+    auto location = Akonadi2::CreateDeleteEntity(fbb, domainObject.revision(), entityId, type);
+    Akonadi2::FinishDeleteEntityBuffer(fbb, location);
+    mResourceAccess->open();
+    return mResourceAccess->sendCommand(Akonadi2::Commands::DeleteEntityCommand, fbb);
 }
 
 Async::Job<void> DummyResourceFacade::synchronizeResource(bool sync, bool processAll)
@@ -133,97 +113,344 @@ Async::Job<void> DummyResourceFacade::synchronizeResource(bool sync, bool proces
     return Async::null<void>();
 }
 
-void DummyResourceFacade::readValue(QSharedPointer<Akonadi2::Storage> storage, const QByteArray &key, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, std::function<bool(const std::string &key, DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)> preparedQuery)
+static void extractBuffers(const Akonadi2::Entity &entity, DummyEvent const *&resourceBuffer, Akonadi2::Domain::Buffer::Event const *&localBuffer, bool verify)
 {
-    storage->scan(key.data(), key.size(), [=](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+    resourceBuffer = Akonadi2::EntityBuffer::readBuffer(entity.resource(), &VerifyDummyEventBuffer, &GetDummyEvent, verify);
+    localBuffer = Akonadi2::EntityBuffer::readBuffer(entity.local(), &Akonadi2::Domain::Buffer::VerifyEventBuffer, &Akonadi2::Domain::Buffer::GetEvent, verify);
+}
 
-        //Skip internals
-        if (Akonadi2::Storage::isInternalKey(keyValue, keySize)) {
-            return true;
+//A candidate of a sorted query, all pointers point into the storage or into the copy of a decompressed value
+struct SortCandidate
+{
+    flatbuffers::String const *sortValue;
+    void *key;
+    int keySize;
+    void *data;
+    int dataSize;
+    QByteArray copy;
+};
+
+bool DummyResourceFacade::readValue(void *keyValue, int keySize, void *dataValue, int dataSize, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const QueryPredicate<Akonadi2::Domain::Buffer::Event, DummyEvent> &predicate, const QStringList &properties, const QVector<ResolvedProperty> &resolvedProperties, const Akonadi2::Snapshot::Ptr &snapshot, bool verify)
+{
+    //Skip internals
+    if (Akonadi2::Storage::isInternalKey(keyValue, keySize)) {
+        return true;
+    }
+
+    //Extract buffers
+    Akonadi2::EntityBuffer buffer(dataValue, dataSize, verify);
+
+    DummyEvent const *resourceBuffer = 0;
+    Akonadi2::Domain::Buffer::Event const *localBuffer = 0;
+    extractBuffers(buffer.entity(), resourceBuffer, localBuffer, verify);
+
+    auto metadataBuffer = Akonadi2::EntityBuffer::readBuffer(buffer.entity().metadata(), &Akonadi2::VerifyMetadataBuffer, &Akonadi2::GetMetadata, verify);
+
+    if (!resourceBuffer || !metadataBuffer) {
+        qWarning() << "invalid buffer " << QString::fromStdString(std::string(static_cast<char*>(keyValue), keySize));
+        return true;
+    }
+
+    //We probably only want to create all buffers after the scan
+    if (predicate.matches(localBuffer, resourceBuffer)) {
+        qint64 revision = metadataBuffer ? metadataBuffer->revision() : -1;
+        //This only works for a 1:1 mapping of resource to domain types.
+        //Not i.e. for tags that are stored as flags in each entity of an imap store.
+        QSharedPointer<Akonadi2::Domain::BufferAdaptor> resultAdaptor;
+        if (snapshot && !Akonadi2::Storage::isTransient(dataValue)) {
+            //The adaptor points directly into the storage, which stays valid as long as the snapshot is held.
+            //A decompressed value is overwritten by the next one, so its properties are copied instead.
+            resultAdaptor = QSharedPointer<LazyBufferAdaptor>::create(mFactory->createAdaptor(buffer.entity(), verify), snapshot, properties);
+        } else {
+            //Only the requested properties are copied, the rest of the buffer is never touched
+            resultAdaptor = mFactory->copyProperties(resolvedProperties, localBuffer, resourceBuffer);
         }
+        auto event = QSharedPointer<Akonadi2::Domain::Event>::create("org.kde.dummy", QString::fromUtf8(static_cast<char*>(keyValue), keySize), revision, resultAdaptor);
+        resultCallback(event);
+    }
+    return true;
+}
 
-        //Extract buffers
-        Akonadi2::EntityBuffer buffer(dataValue, dataSize);
+Async::Job<void> DummyResourceFacade::load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const std::function<void(const Akonadi2::ResumePoint &)> &resumeCallback)
+{
+    return synchronizeResource(query.syncOnDemand, query.processAll).then<void>([=](Async::Future<void> &future) {
+        //Sorted results are always the first page, the continuation can't resume the sort order
+        if (!query.continuation.isEmpty() && !query.sortProperty.isEmpty()) {
+            future.setError(1, "Sorted queries can't be continued");
+            return;
+        }
+        //Results in key order would look sorted to the caller, so an unsupported sort property fails the query
+        QuerySortField<Akonadi2::Domain::Buffer::Event, DummyEvent> sortField;
+        if (!query.sortProperty.isEmpty()) {
+            sortField = mFactory->createSortField(query.sortProperty);
+            if (!sortField.isValid()) {
+                future.setError(1, QString("Can't sort on property %1").arg(query.sortProperty));
+                return;
+            }
+        }
+        //Now that the sync is complete we can execute the query
+        //The filter is resolved once, so matching an entity during the scan only compares buffer fields.
+        //Id's are not part of the predicate, the requested entities are directly looked up by key instead.
+        const auto predicate = mFactory->createPredicate(query.propertyFilter);
+        //Same for the properties that end up in the results
+        const auto properties = mFactory->resolveRequestedProperties(query.requestedProperties);
+        const auto resolvedProperties = mFactory->resolveProperties(properties);
 
-        DummyEvent const *resourceBuffer = 0;
-        if (auto resourceData = buffer.entity().resource()) {
-            flatbuffers::Verifier verifyer(resourceData->Data(), resourceData->size());
-            if (VerifyDummyEventBuffer(verifyer)) {
-                resourceBuffer = GetDummyEvent(resourceData->Data());
+        //If we know the keys in advance we can do point lookups instead of a full scan
+        bool lookupByKey = false;
+        QVector<QByteArray> keys;
+        if (!query.ids.isEmpty()) {
+            lookupByKey = true;
+            for (const auto &id : query.ids) {
+                keys << id.toUtf8();
             }
+        } else if (query.propertyFilter.contains("uid")) {
+            lookupByKey = true;
+            static Index uidIndex(Akonadi2::Store::storageLocation(), "org.kde.dummy.index.uid", Akonadi2::Storage::ReadOnly);
+            uidIndex.lookup(query.propertyFilter.value("uid").toByteArray(), [&](const QByteArray &value) {
+                keys << value;
+            },
+            [](const Index::Error &error) {
+                qWarning() << "Error in index: " <<  QString::fromStdString(error.message);
+            });
+        }
+
+        //A pinned query reads from the snapshot it was given, otherwise we read the latest revision
+        const auto pinnedSnapshot = query.snapshots.value("org.kde.dummy");
+        QSharedPointer<Akonadi2::Storage> ownStorage;
+        if (!pinnedSnapshot) {
+            ownStorage = QSharedPointer<Akonadi2::Storage>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy");
+            //We start a transaction explicitly that we'll leave open so the values can be read.
+            //The transaction will be closed automatically once the storage object is destroyed.
+            ownStorage->startTransaction(Akonadi2::Storage::ReadOnly);
         }
+        Akonadi2::Storage &storage = pinnedSnapshot ? pinnedSnapshot->storage() : *ownStorage;
+        QMutexLocker snapshotLocker(pinnedSnapshot ? &pinnedSnapshot->mutex() : nullptr);
 
-        Akonadi2::Domain::Buffer::Event const *localBuffer = 0;
-        if (auto localData = buffer.entity().local()) {
-            flatbuffers::Verifier verifyer(localData->Data(), localData->size());
-            if (Akonadi2::Domain::Buffer::VerifyEventBuffer(verifyer)) {
-                localBuffer = Akonadi2::Domain::Buffer::GetEvent(localData->Data());
+        //Lazily loaded results keep the transaction open until the last of them is released
+        Akonadi2::Snapshot::Ptr snapshot;
+        if (query.lazyLoading) {
+            snapshot = pinnedSnapshot ? pinnedSnapshot : Akonadi2::Snapshot::create(ownStorage);
+            if (!snapshot) {
+                qWarning() << "Falling back to copying the results";
             }
         }
 
-        Akonadi2::Metadata const *metadataBuffer = 0;
-        if (auto metadataData = buffer.entity().metadata()) {
-            flatbuffers::Verifier verifyer(metadataData->Data(), metadataData->size());
-            if (Akonadi2::VerifyMetadataBuffer(verifyer)) {
-                metadataBuffer = Akonadi2::GetMetadata(metadataData->Data());
+        //Pages are returned in key order and continue after the last key of the previous page
+        const bool nextPage = !query.continuation.isEmpty();
+        const auto resumePoint = Akonadi2::ResumePoint::fromToken(query.continuation);
+        const qint64 revision = pinnedSnapshot ? pinnedSnapshot->revision() : storage.maxRevision();
+        //The pipeline verified the buffers before it stored them, so they are only verified again if the storage isn't trusted
+        const bool verify = Akonadi2::EntityBuffer::verificationRequired(storage.schemaVersion());
+        if (nextPage && resumePoint.revision != revision) {
+            qDebug() << "The storage changed since the previous page, new entities before the resume point are skipped";
+        }
+
+        //Matches an entity without creating a domain object for it
+        const auto matches = [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            if (Akonadi2::Storage::isInternalKey(keyValue, keySize)) {
+                return false;
+            }
+            Akonadi2::EntityBuffer buffer(dataValue, dataSize, verify);
+            DummyEvent const *resourceBuffer = 0;
+            Akonadi2::Domain::Buffer::Event const *localBuffer = 0;
+            extractBuffers(buffer.entity(), resourceBuffer, localBuffer, verify);
+            return predicate.matches(localBuffer, resourceBuffer);
+        };
+
+        //Complete result sets are cached as key lists, so repeating a query only requires point lookups.
+        //If the revision changed since, only the changed entities are matched again.
+        const bool cacheable = Akonadi2::QueryCache::isCacheable(query);
+        auto cache = Akonadi2::QueryCache::forResource("org.kde.dummy");
+        const QByteArray cacheKey = cacheable ? Akonadi2::QueryCache::cacheKey(Akonadi2::Domain::getTypeName<Akonadi2::Domain::Event>(), query) : QByteArray();
+        QVector<QByteArray> cachedKeys;
+        const bool cached = cacheable && cache->lookup(cacheKey, revision, storage, [&](const QVector<QByteArray> &changedKeys) {
+            QVector<QByteArray> matching;
+            //Id's are not part of the predicate, so a query by id only matches the requested entities
+            QVector<QByteArray> candidates;
+            if (query.ids.isEmpty()) {
+                candidates = changedKeys;
+            } else {
+                for (const auto &key : changedKeys) {
+                    if (keys.contains(key)) {
+                        candidates << key;
+                    }
+                }
             }
+            storage.scan(candidates, [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+                if (matches(keyValue, keySize, dataValue, dataSize)) {
+                    matching << QByteArray(static_cast<char*>(keyValue), keySize);
+                }
+                return true;
+            },
+            [](const Akonadi2::Storage::Error &error) {
+                qWarning() << "Error while patching the query cache: " << QString::fromStdString(error.message);
+            });
+            return matching;
+        }, cachedKeys);
+        if (cached) {
+            lookupByKey = true;
+            keys = cachedKeys;
         }
+        QVector<QByteArray> matchedKeys;
+
+        int count = 0;
+        bool pageFull = false;
+        QByteArray lastKey;
+        const std::function<void(const Akonadi2::Domain::Event::Ptr &)> countingCallback = [&count, &resultCallback](const Akonadi2::Domain::Event::Ptr &event) {
+            count++;
+            resultCallback(event);
+        };
+        const auto resultHandler = [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            //Skips the last key of the previous page, and earlier keys of a key lookup
+            if (nextPage && QByteArray::fromRawData(static_cast<char*>(keyValue), keySize) <= resumePoint.key) {
+                return true;
+            }
+            //We only stop once we know there is at least one more matching entity, otherwise the next page would be empty
+            if (query.limit > 0 && count >= query.limit) {
+                if (matches(keyValue, keySize, dataValue, dataSize)) {
+                    pageFull = true;
+                    return false;
+                }
+                return true;
+            }
+            const int previousCount = count;
+            readValue(keyValue, keySize, dataValue, dataSize, countingCallback, predicate, properties, resolvedProperties, snapshot, verify);
+            if (count > previousCount) {
+                lastKey = QByteArray(static_cast<char*>(keyValue), keySize);
+                if (cacheable && !cached) {
+                    matchedKeys << lastKey;
+                }
+            }
+            return true;
+        };
+        const auto errorHandler = [](const Akonadi2::Storage::Error &error) {
+            qWarning() << "Error during query: " << QString::fromStdString(error.message);
+        };
 
-        if (!resourceBuffer || !metadataBuffer) {
-            qWarning() << "invalid buffer " << QString::fromStdString(std::string(static_cast<char*>(keyValue), keySize));
+        //Without an index on the sort property we keep the best candidates in a bounded heap during the scan,
+        //and only create domain objects for the final ones. Without a limit all matching entities are candidates.
+        const bool descending = query.sortDescending;
+        TopK<SortCandidate> topK(query.limit > 0 ? query.limit : std::numeric_limits<int>::max(), [descending](const SortCandidate &left, const SortCandidate &right) {
+            return descending ? QuerySortField<Akonadi2::Domain::Buffer::Event, DummyEvent>::lessThan(right.sortValue, left.sortValue)
+                              : QuerySortField<Akonadi2::Domain::Buffer::Event, DummyEvent>::lessThan(left.sortValue, right.sortValue);
+        });
+        const auto sortHandler = [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            if (Akonadi2::Storage::isInternalKey(keyValue, keySize)) {
+                return true;
+            }
+            Akonadi2::EntityBuffer buffer(dataValue, dataSize, verify);
+            DummyEvent const *resourceBuffer = 0;
+            Akonadi2::Domain::Buffer::Event const *localBuffer = 0;
+            extractBuffers(buffer.entity(), resourceBuffer, localBuffer, verify);
+            if (predicate.matches(localBuffer, resourceBuffer)) {
+                SortCandidate candidate{sortField.value(localBuffer, resourceBuffer), keyValue, keySize, dataValue, dataSize, QByteArray()};
+                //A decompressed value is overwritten by the next one, so the candidate keeps a copy
+                if (Akonadi2::Storage::isTransient(dataValue)) {
+                    candidate.copy = QByteArray(static_cast<char*>(dataValue), dataSize);
+                    candidate.data = const_cast<char*>(candidate.copy.constData());
+                    if (candidate.sortValue) {
+                        candidate.sortValue = reinterpret_cast<flatbuffers::String const *>(candidate.copy.constData() + (reinterpret_cast<const char*>(candidate.sortValue) - static_cast<const char*>(dataValue)));
+                    }
+                }
+                topK.add(candidate);
+            }
             return true;
+        };
+
+        if (sortField.isValid()) {
+            //Sorted results are always the first page
+            if (lookupByKey) {
+                storage.scan(keys, sortHandler, errorHandler);
+            } else {
+                storage.scan(nullptr, 0, sortHandler, errorHandler);
+            }
+            //The transaction is still open, so the candidates still point to valid data, decompressed ones to their copy.
+            //The copy goes with the candidate, so the properties of those are copied instead of read lazily.
+            for (const auto &candidate : topK.takeSorted()) {
+                readValue(candidate.key, candidate.keySize, candidate.data, candidate.dataSize, resultCallback, predicate, properties, resolvedProperties, candidate.copy.isNull() ? snapshot : Akonadi2::Snapshot::Ptr(), verify);
+            }
+        } else if (lookupByKey) {
+            //All lookups happen in the same transaction, sorted by key and using a single cursor
+            storage.scan(keys, resultHandler, errorHandler);
+        } else if (nextPage) {
+            storage.scanFrom(resumePoint.key, resultHandler, errorHandler);
+        } else {
+            qDebug() << "full scan";
+            storage.scan(nullptr, 0, resultHandler, errorHandler);
+        }
+        if (cacheable && !cached) {
+            cache->insert(cacheKey, revision, matchedKeys);
         }
 
-        //We probably only want to create all buffers after the scan
-        //TODO use adapter for query and scan?
-        if (preparedQuery && preparedQuery(std::string(static_cast<char*>(keyValue), keySize), resourceBuffer, localBuffer)) {
-            qint64 revision = metadataBuffer ? metadataBuffer->revision() : -1;
-            //This only works for a 1:1 mapping of resource to domain types.
-            //Not i.e. for tags that are stored as flags in each entity of an imap store.
-            auto adaptor = mFactory->createAdaptor(buffer.entity());
-            //TODO only copy requested properties
-            auto memoryAdaptor = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create(*adaptor);
-            auto event = QSharedPointer<Akonadi2::Domain::Event>::create("org.kde.dummy", QString::fromUtf8(static_cast<char*>(keyValue), keySize), revision, memoryAdaptor);
-            resultCallback(event);
+        //The revision is also reported for complete result sets, a live query continues from it
+        Akonadi2::ResumePoint next;
+        if (pageFull) {
+            next.key = lastKey;
         }
-        return true;
-    },
-    [](const Akonadi2::Storage::Error &error) {
-        qWarning() << "Error during query: " << QString::fromStdString(error.message);
+        next.revision = revision;
+        resumeCallback(next);
+        future.setFinished();
     });
 }
 
-Async::Job<void> DummyResourceFacade::load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback)
+Async::Job<void> DummyResourceFacade::loadChanges(const Akonadi2::Query &query, qint64 fromRevision, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &matchingCallback, const std::function<void(const QByteArray &key, qint64 revision)> &notMatchingCallback, const std::function<void(qint64 revision)> &revisionCallback)
 {
-    return synchronizeResource(query.syncOnDemand, query.processAll).then<void>([=](Async::Future<void> &future) {
-        //Now that the sync is complete we can execute the query
-        const auto preparedQuery = prepareQuery(query);
+    return Async::start<void>([=](Async::Future<void> &future) {
+        const auto predicate = mFactory->createPredicate(query.propertyFilter);
+        const auto properties = mFactory->resolveRequestedProperties(query.requestedProperties);
+        const auto resolvedProperties = mFactory->resolveProperties(properties);
 
         auto storage = QSharedPointer<Akonadi2::Storage>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy");
+        storage->startTransaction(Akonadi2::Storage::ReadOnly);
+        const qint64 revision = storage->maxRevision();
+        //Without a revision of the initial result set replaying the changelog would report the whole storage
+        if (fromRevision < 0) {
+            revisionCallback(revision);
+            future.setFinished();
+            return;
+        }
+        const bool verify = Akonadi2::EntityBuffer::verificationRequired(storage->schemaVersion());
+        //Every revision records a change, so the changes are incomplete if the one after fromRevision was removed by compaction
+        const qint64 oldestChange = storage->oldestChange();
+        if (revision > fromRevision && (oldestChange < 0 || oldestChange > fromRevision + 1)) {
+            future.setError(Akonadi2::ChangesIncompleteError, QString("The changelog has been compacted, changes since revision %1 are incomplete").arg(fromRevision));
+            return;
+        }
+
+        //Collapse the changes to the last change per entity
+        QHash<QByteArray, Akonadi2::Storage::ChangeType> changes;
+        storage->readChanges(fromRevision, [&](qint64, Akonadi2::Storage::ChangeType type, const QByteArray &key) -> bool {
+            changes.insert(key, type);
+            return true;
+        });
 
         QVector<QByteArray> keys;
-        if (query.propertyFilter.contains("uid")) {
-            static Index uidIndex(Akonadi2::Store::storageLocation(), "org.kde.dummy.index.uid", Akonadi2::Storage::ReadOnly);
-            uidIndex.lookup(query.propertyFilter.value("uid").toByteArray(), [&](const QByteArray &value) {
-                keys << value;
-            },
-            [](const Index::Error &error) {
-                qWarning() << "Error in index: " <<  QString::fromStdString(error.message);
-            });
+        for (auto it = changes.constBegin(); it != changes.constEnd(); ++it) {
+            if (it.value() == Akonadi2::Storage::EntityRemoved) {
+                notMatchingCallback(it.key(), revision);
+            } else {
+                keys << it.key();
+            }
         }
 
-        //We start a transaction explicitly that we'll leave open so the values can be read.
-        //The transaction will be closed automatically once the storage object is destroyed.
-        storage->startTransaction(Akonadi2::Storage::ReadOnly);
-        if (keys.isEmpty()) {
-            qDebug() << "full scan";
-            readValue(storage, QByteArray(), resultCallback, preparedQuery);
-        } else {
-            for (const auto &key : keys) {
-                readValue(storage, key, resultCallback, preparedQuery);
+        //The remaining entities are read like the results of a query by id, whether they are added or modified depends on the result set
+        storage->scan(keys, [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            bool matched = false;
+            readValue(keyValue, keySize, dataValue, dataSize, [&](const Akonadi2::Domain::Event::Ptr &event) {
+                matched = true;
+                matchingCallback(event);
+            }, predicate, properties, resolvedProperties, Akonadi2::Snapshot::Ptr(), verify);
+            if (!matched) {
+                notMatchingCallback(QByteArray(static_cast<char*>(keyValue), keySize), revision);
             }
-        }
+            return true;
+        },
+        [](const Akonadi2::Storage::Error &error) {
+            qWarning() << "Error while loading changes: " << QString::fromStdString(error.message);
+        });
+
+        revisionCallback(revision);
         future.setFinished();
     });
 }
-
@@ -21,6 +21,7 @@
 
 #include "common/clientapi.h"
 #include "common/storage.h"
+#include "common/snapshot.h"
 #include "resourcefactory.h"
 #include "entity_generated.h"
 #include "event_generated.h"
@@ -40,10 +41,11 @@ public:
     virtual Async::Job<void> create(const Akonadi2::Domain::Event &domainObject);
     virtual Async::Job<void> modify(const Akonadi2::Domain::Event &domainObject);
     virtual Async::Job<void> remove(const Akonadi2::Domain::Event &domainObject);
-    virtual Async::Job<void> load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback);
+    virtual Async::Job<void> load(const Akonadi2::Query &query, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const std::function<void(const Akonadi2::ResumePoint &)> &resumeCallback);
+    virtual Async::Job<void> loadChanges(const Akonadi2::Query &query, qint64 fromRevision, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &matchingCallback, const std::function<void(const QByteArray &key, qint64 revision)> &notMatchingCallback, const std::function<void(qint64 revision)> &revisionCallback);
 
 private:
-    void readValue(QSharedPointer<Akonadi2::Storage> storage, const QByteArray &key, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, std::function<bool(const std::string &key, DummyCalendar::DummyEvent const *buffer, Akonadi2::Domain::Buffer::Event const *local)>);
+    bool readValue(void *keyValue, int keySize, void *dataValue, int dataSize, const std::function<void(const Akonadi2::Domain::Event::Ptr &)> &resultCallback, const QueryPredicate<Akonadi2::Domain::Buffer::Event, DummyCalendar::DummyEvent> &predicate, const QStringList &properties, const QVector<ResolvedProperty> &resolvedProperties, const Akonadi2::Snapshot::Ptr &snapshot, bool verify);
     Async::Job<void> synchronizeResource(bool sync, bool processAll);
     QSharedPointer<Akonadi2::ResourceAccess> mResourceAccess;
     QSharedPointer<DomainTypeAdaptorFactory<Akonadi2::Domain::Event, Akonadi2::Domain::Buffer::Event, DummyCalendar::DummyEvent> > mFactory;
@@ -20,11 +20,14 @@
 #include "resourcefactory.h"
 #include "facade.h"
 #include "entitybuffer.h"
+#include "builderpool.h"
 #include "pipeline.h"
 #include "dummycalendar_generated.h"
 #include "metadata_generated.h"
 #include "queuedcommand_generated.h"
 #include "createentity_generated.h"
+#include "modifyentity_generated.h"
+#include "deleteentity_generated.h"
 #include "domainadaptor.h"
 #include "commands.h"
 #include "clientapi.h"
@@ -162,27 +165,13 @@ private slots:
                     //Throw command into appropriate pipeline
                     switch (queuedCommand->commandId()) {
                         case Akonadi2::Commands::DeleteEntityCommand:
-                            //mPipeline->removedEntity
+                            processCommand(mPipeline->deletedEntity(queuedCommand->command()->Data(), queuedCommand->command()->size()), "deleting", messageQueueCallback, whileCallback);
                             break;
                         case Akonadi2::Commands::ModifyEntityCommand:
-                            //mPipeline->modifiedEntity
+                            processCommand(mPipeline->modifiedEntity(queuedCommand->command()->Data(), queuedCommand->command()->size()), "modifying", messageQueueCallback, whileCallback);
                             break;
-                        case Akonadi2::Commands::CreateEntityCommand: {
-                            //TODO JOBAPI: job lifetime management
-                            //Right now we're just leaking jobs. In this case we'd like jobs that are heap allocated and delete
-                            //themselves once done. In other cases we'd like jobs that only live as long as their handle though.
-                            mPipeline->newEntity(queuedCommand->command()->Data(), queuedCommand->command()->size()).then<void>([messageQueueCallback, whileCallback](Async::Future<void> &future) {
-                                messageQueueCallback(true);
-                                whileCallback(false);
-                                future.setFinished();
-                            },
-                            [this, messageQueueCallback, whileCallback](int errorCode, const QString &errorMessage) {
-                                qWarning() << "Error while creating entity: " << errorCode << errorMessage;
-                                emit error(errorCode, errorMessage);
-                                messageQueueCallback(true);
-                                whileCallback(false);
-                            }).exec();
-                        }
+                        case Akonadi2::Commands::CreateEntityCommand:
+                            processCommand(mPipeline->newEntity(queuedCommand->command()->Data(), queuedCommand->command()->size()), "creating", messageQueueCallback, whileCallback);
                             break;
                         default:
                             //Unhandled command
@@ -229,6 +218,25 @@ private slots:
     }
 
 private:
+    //Acknowledges the dequeued command once @param job is done
+    void processCommand(Async::Job<void> job, const char *action, const std::function<void(bool success)> &messageQueueCallback, const std::function<void(bool)> &whileCallback)
+    {
+        //TODO JOBAPI: job lifetime management
+        //Right now we're just leaking jobs. In this case we'd like jobs that are heap allocated and delete
+        //themselves once done. In other cases we'd like jobs that only live as long as their handle though.
+        job.then<void>([messageQueueCallback, whileCallback](Async::Future<void> &future) {
+            messageQueueCallback(true);
+            whileCallback(false);
+            future.setFinished();
+        },
+        [this, action, messageQueueCallback, whileCallback](int errorCode, const QString &errorMessage) {
+            qWarning() << "Error while " << action << " entity: " << errorCode << errorMessage;
+            emit error(errorCode, errorMessage);
+            messageQueueCallback(true);
+            whileCallback(false);
+        }).exec();
+    }
+
     Akonadi2::Pipeline *mPipeline;
     //Ordered by priority
     QList<MessageQueue*> mCommandQueues;
@@ -250,18 +258,23 @@ void DummyResource::configurePipeline(Akonadi2::Pipeline *pipeline)
     //i.e. If a resource stores tags as part of each message it needs to update the tag index
     //TODO setup preprocessors for each domain type and pipeline type allowing full customization
     //Eventually the order should be self configuring, for now it's hardcoded.
+    //The pipeline verified the buffers before it stored them
     auto eventIndexer = new SimpleProcessor("summaryprocessor", [eventFactory](const Akonadi2::PipelineState &state, const Akonadi2::Entity &entity) {
-        auto adaptor = eventFactory->createAdaptor(entity);
+        auto adaptor = eventFactory->createAdaptor(entity, false);
         // qDebug() << "Summary preprocessor: " << adaptor->getProperty("summary").toString();
     });
 
-    auto uidIndexer = new SimpleProcessor("uidIndexer", [eventFactory](const Akonadi2::PipelineState &state, const Akonadi2::Entity &entity) {
-        static Index uidIndex(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", "org.kde.dummy.index.uid", Akonadi2::Storage::ReadWrite);
-
-        auto adaptor = eventFactory->createAdaptor(entity);
-        const auto uid = adaptor->getProperty("uid");
-        if (uid.isValid()) {
-            uidIndex.add(uid.toByteArray(), state.key());
+    auto uidIndex = QSharedPointer<Index>::create(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/akonadi2/storage", "org.kde.dummy.index.uid", Akonadi2::Storage::ReadWrite);
+    //The uid is indexed straight from the buffer, without a round trip through QString
+    auto uidOf = [eventFactory](const Akonadi2::Entity &entity) -> QByteArray {
+        auto adaptor = eventFactory->createAdaptor(entity, false);
+        const auto uid = adaptor->getStringView("uid");
+        return uid.isNull() ? QByteArray() : uid.toByteArray();
+    };
+    auto uidIndexer = new SimpleProcessor("uidIndexer", [uidIndex, uidOf](const Akonadi2::PipelineState &state, const Akonadi2::Entity &entity) {
+        const auto uid = uidOf(entity);
+        if (!uid.isNull()) {
+            uidIndex->add(uid, state.key());
         }
 
         //TODO would this be worthwhile for performance reasons?
@@ -277,8 +290,42 @@ void DummyResource::configurePipeline(Akonadi2::Pipeline *pipeline)
         // }
     });
 
+    //A modification may have changed the uid, so the entry of the previous one is replaced
+    auto uidReindexer = new SimpleProcessor("uidReindexer", [uidIndex, uidOf](const Akonadi2::PipelineState &state, const Akonadi2::Entity &entity) {
+        const auto previousUid = state.previousEntity() ? uidOf(*state.previousEntity()) : QByteArray();
+        const auto uid = uidOf(entity);
+        if (uid == previousUid) {
+            return;
+        }
+        if (!previousUid.isNull()) {
+            uidIndex->remove(previousUid, state.key());
+        }
+        if (!uid.isNull()) {
+            uidIndex->add(uid, state.key());
+        }
+    });
+
+    //The deleted pipeline is passed the removed entity
+    auto uidRemover = new SimpleProcessor("uidRemover", [uidIndex, uidOf](const Akonadi2::PipelineState &state, const Akonadi2::Entity &entity) {
+        const auto uid = uidOf(entity);
+        if (!uid.isNull()) {
+            uidIndex->remove(uid, state.key());
+        }
+    });
+
     //event is the entitytype and not the domain type
     pipeline->setPreprocessors("event", Akonadi2::Pipeline::NewPipeline, QVector<Akonadi2::Preprocessor*>() << eventIndexer << uidIndexer);
+    pipeline->setPreprocessors("event", Akonadi2::Pipeline::ModifiedPipeline, QVector<Akonadi2::Preprocessor*>() << eventIndexer << uidReindexer);
+    pipeline->setPreprocessors("event", Akonadi2::Pipeline::DeletedPipeline, QVector<Akonadi2::Preprocessor*>() << uidRemover);
+    //Descriptions compress well, existing storages keep their uncompressed values though
+    pipeline->storage().enableCompression();
+    pipeline->setBufferVerifier("event", &DummyEventAdaptorFactory::verify);
+    pipeline->setBlobExtractor("event", [eventFactory](const Akonadi2::Entity &entity, Akonadi2::BlobStore &blobs, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb) -> QVector<QByteArray> {
+        return eventFactory->extractBlobs(entity, blobs, resourceFbb, localFbb);
+    });
+    pipeline->setEntityMerger("event", [eventFactory](const Akonadi2::Entity &current, const Akonadi2::Entity &delta, const QStringList &deletions, flatbuffers::FlatBufferBuilder &resourceFbb, flatbuffers::FlatBufferBuilder &localFbb) -> bool {
+        return eventFactory->mergeEntity(current, delta, deletions, resourceFbb, localFbb);
+    });
     mProcessor = new Processor(pipeline, QList<MessageQueue*>() << &mUserQueue << &mSynchronizerQueue);
     QObject::connect(mProcessor, &Processor::error, [this](int errorCode, const QString &msg) { onProcessorError(errorCode, msg); });
 }
@@ -294,11 +341,11 @@ int DummyResource::error() const
     return mError;
 }
 
-void findByRemoteId(QSharedPointer<Akonadi2::Storage> storage, const QString &rid, std::function<void(void *keyValue, int keySize, void *dataValue, int dataSize)> callback)
+void findByRemoteId(Akonadi2::Storage &storage, const QString &rid, std::function<void(void *keyValue, int keySize, void *dataValue, int dataSize)> callback)
 {
     //TODO lookup in rid index instead of doing a full scan
     const std::string ridString = rid.toStdString();
-    storage->scan("", [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+    storage.scan("", [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
         if (Akonadi2::Storage::isInternalKey(keyValue, keySize)) {
             return true;
         }
@@ -320,55 +367,59 @@ void findByRemoteId(QSharedPointer<Akonadi2::Storage> storage, const QString &ri
 
 void DummyResource::enqueueCommand(MessageQueue &mq, int commandId, const QByteArray &data)
 {
-    m_fbb.Clear();
-    auto commandData = m_fbb.CreateVector(reinterpret_cast<uint8_t const *>(data.data()), data.size());
-    auto builder = Akonadi2::QueuedCommandBuilder(m_fbb);
+    Akonadi2::BuilderPool::Builder fbb;
+    auto commandData = fbb->CreateVector(reinterpret_cast<uint8_t const *>(data.data()), data.size());
+    auto builder = Akonadi2::QueuedCommandBuilder(*fbb);
     builder.add_commandId(commandId);
     builder.add_command(commandData);
     auto buffer = builder.Finish();
-    Akonadi2::FinishQueuedCommandBuffer(m_fbb, buffer);
-    mq.enqueue(m_fbb.GetBufferPointer(), m_fbb.GetSize());
+    Akonadi2::FinishQueuedCommandBuffer(*fbb, buffer);
+    mq.enqueue(fbb->GetBufferPointer(), fbb->GetSize());
 }
 
 Async::Job<void> DummyResource::synchronizeWithSource(Akonadi2::Pipeline *pipeline)
 {
     return Async::start<void>([this, pipeline](Async::Future<void> &f) {
-        //TODO use a read-only transaction during the complete sync to sync against a defined revision
-        auto storage = QSharedPointer<Akonadi2::Storage>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy");
+        //All lookups of the sync read the same snapshot, so we sync against a defined revision.
+        auto snapshot = Akonadi2::Snapshot::open(Akonadi2::Store::storageLocation(), "org.kde.dummy");
+        QSharedPointer<Akonadi2::Storage> fallbackStorage;
+        if (snapshot) {
+            qDebug() << "Synchronizing against revision " << snapshot->revision();
+        } else {
+            //Either the storage doesn't exist yet, or too many snapshots are open
+            fallbackStorage = QSharedPointer<Akonadi2::Storage>::create(Akonadi2::Store::storageLocation(), "org.kde.dummy");
+        }
         for (auto it = s_dataSource.constBegin(); it != s_dataSource.constEnd(); it++) {
             bool isNew = true;
-            if (storage->exists()) {
-                findByRemoteId(storage, it.key(), [&](void *keyValue, int keySize, void *dataValue, int dataSize) {
+            if (snapshot || fallbackStorage->exists()) {
+                findByRemoteId(snapshot ? snapshot->storage() : *fallbackStorage, it.key(), [&](void *keyValue, int keySize, void *dataValue, int dataSize) {
                     isNew = false;
                 });
             }
             if (isNew) {
-                m_fbb.Clear();
-
                 const QByteArray data = it.value().toUtf8();
                 auto eventBuffer = DummyCalendar::GetDummyEvent(data.data());
 
+                //The resource buffer and the entity are built in place as delta of the command
+                Akonadi2::BuilderPool::Builder commandBuilder;
+                auto &fbb = *commandBuilder;
                 //Map the source format to the buffer format (which happens to be an exact copy here)
-                auto summary = m_fbb.CreateString(eventBuffer->summary()->c_str());
-                auto rid = m_fbb.CreateString(it.key().toStdString().c_str());
-                auto description = m_fbb.CreateString(it.key().toStdString().c_str());
+                auto summary = fbb.CreateString(eventBuffer->summary()->c_str());
+                auto rid = fbb.CreateString(it.key().toStdString().c_str());
+                auto description = fbb.CreateString(it.key().toStdString().c_str());
                 static uint8_t rawData[100];
-                auto attachment = m_fbb.CreateVector(rawData, 100);
+                auto attachment = fbb.CreateVector(rawData, 100);
 
-                auto builder = DummyCalendar::DummyEventBuilder(m_fbb);
+                auto builder = DummyCalendar::DummyEventBuilder(fbb);
                 builder.add_summary(summary);
                 builder.add_remoteId(rid);
                 builder.add_description(description);
                 builder.add_attachment(attachment);
-                auto buffer = builder.Finish();
-                DummyCalendar::FinishDummyEventBuffer(m_fbb, buffer);
-                flatbuffers::FlatBufferBuilder entityFbb;
-                Akonadi2::EntityBuffer::assembleEntityBuffer(entityFbb, 0, 0, m_fbb.GetBufferPointer(), m_fbb.GetSize(), 0, 0);
+                auto resource = Akonadi2::EntityBuffer::finishNestedBuffer(fbb, builder.Finish(), DummyCalendar::DummyEventIdentifier());
+                auto delta = Akonadi2::EntityBuffer::finishNestedBuffer(fbb, Akonadi2::EntityBuffer::createEntity(fbb, 0, resource, 0));
 
-                flatbuffers::FlatBufferBuilder fbb;
                 //This is the resource type and not the domain type
                 auto type = fbb.CreateString("event");
-                auto delta = fbb.CreateVector<uint8_t>(entityFbb.GetBufferPointer(), entityFbb.GetSize());
                 auto location = Akonadi2::Commands::CreateCreateEntity(fbb, type, delta);
                 Akonadi2::Commands::FinishCreateEntityBuffer(fbb, location);
 
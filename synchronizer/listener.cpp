@@ -33,6 +33,9 @@
 #include <QLocalSocket>
 #include <QTimer>
 
+//The number of revisions whose changes are kept when the changelog is compacted
+static const qint64 s_changelogRetention = 10000;
+
 Listener::Listener(const QString &resourceName, QObject *parent)
     : QObject(parent),
       m_server(new QLocalServer(this)),
@@ -134,6 +137,7 @@ void Listener::clientDropped()
         }
     }
 
+    compactChangelog();
     checkConnections();
 }
 
@@ -243,6 +247,13 @@ void Listener::processCommand(int commandId, uint messageId, Client &client, uin
                 m_resource->processCommand(commandId, client.commandBuffer, size, m_pipeline);
             }
             break;
+        case Akonadi2::Commands::ScrubCommand:
+            log(QString("\tScrub request (id %1) from %2").arg(messageId).arg(client.name));
+            m_pipeline->scrub().then<void>([callback](Async::Future<void> &f){
+                callback();
+                f.setFinished();
+            }).exec();
+            return;
         case Akonadi2::Commands::ShutdownCommand:
             log(QString("\tReceived shutdown command from %1").arg(client.name));
             callback();
@@ -337,6 +348,16 @@ void Listener::updateClientsWithRevision()
     m_fbb.Clear();
 }
 
+void Listener::compactChangelog()
+{
+    //We don't know which revision the clients have read up to, so the latest changes are kept for live queries that catch up.
+    //A live query that fell further behind reloads its result set instead.
+    const qint64 oldestRevision = m_pipeline->storage().maxRevision() - s_changelogRetention;
+    if (oldestRevision > 0) {
+        m_pipeline->storage().removeChangesBefore(oldestRevision);
+    }
+}
+
 void Listener::loadResource()
 {
     if (m_resource) {
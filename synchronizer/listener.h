@@ -81,6 +81,7 @@ private:
     void sendCurrentRevision(Client &client);
     void sendCommandCompleted(Client &client, uint messageId);
     void updateClientsWithRevision();
+    void compactChangelog();
     void loadResource();
     void log(const QString &);
 
@@ -12,6 +12,7 @@
 #include "event_generated.h"
 #include "metadata_generated.h"
 #include "entity_generated.h"
+#include "dummyevent_adaptor_generated.h"
 
 class TestEventAdaptor : public Akonadi2::Domain::BufferAdaptor
 {
@@ -99,6 +100,35 @@ public:
     }
 };
 
+typedef Akonadi2::Domain::Buffer::Event EventBuffer;
+
+static constexpr PropertyMapper<EventBuffer>::Property s_eventProperties[] = {
+    stringProperty<EventBuffer, &EventBuffer::summary>("summary"),
+    stringProperty<EventBuffer, &EventBuffer::description>("description"),
+    bytesProperty<EventBuffer, &EventBuffer::attachment>("attachment")
+};
+
+static constexpr PropertyMapper<Akonadi2::Metadata>::Property s_metadataProperties[] = {
+    integerProperty<Akonadi2::Metadata, uint64_t, &Akonadi2::Metadata::revision>("revision")
+};
+
+static std::string createEventBuffer()
+{
+    flatbuffers::FlatBufferBuilder fbb;
+    auto summary = fbb.CreateString("summary1");
+    auto description = fbb.CreateString("description");
+    static uint8_t rawData[100];
+    auto attachment = fbb.CreateVector(rawData, 100);
+
+    auto builder = Akonadi2::Domain::Buffer::EventBuilder(fbb);
+    builder.add_summary(summary);
+    builder.add_description(description);
+    builder.add_attachment(attachment);
+    auto buffer = builder.Finish();
+    Akonadi2::Domain::Buffer::FinishEventBuffer(fbb, buffer);
+    return std::string(reinterpret_cast<const char*>(fbb.GetBufferPointer()), fbb.GetSize());
+}
+
 class DomainAdaptorTest : public QObject
 {
     Q_OBJECT
@@ -148,6 +178,141 @@ private Q_SLOTS:
         }
     }
 
+    void testPropertyIds()
+    {
+        const auto data = createEventBuffer();
+        auto buffer = Akonadi2::Domain::Buffer::GetEvent(data.data());
+
+        PropertyMapper<EventBuffer> mapper;
+        mapper.setProperties(s_eventProperties);
+        QCOMPARE(mapper.propertyId("summary"), 0);
+        QCOMPARE(mapper.propertyId("attachment"), 2);
+        QCOMPARE(mapper.propertyId("nonexistant"), -1);
+        QCOMPARE(mapper.getProperty(mapper.propertyId("description"), buffer).toString(), QString("description"));
+        QCOMPARE(mapper.getProperty(mapper.propertyId("attachment"), buffer).toByteArray().size(), 100);
+        //The string API resolves the id internally
+        QCOMPARE(mapper.getProperty("summary", buffer).toString(), QString("summary1"));
+        QVERIFY(!mapper.getProperty("nonexistant", buffer).isValid());
+    }
+
+    void testTypedAccess()
+    {
+        const auto data = createEventBuffer();
+        auto buffer = Akonadi2::Domain::Buffer::GetEvent(data.data());
+
+        PropertyMapper<EventBuffer> mapper;
+        mapper.setProperties(s_eventProperties);
+        const auto summary = mapper.getStringView(mapper.propertyId("summary"), buffer);
+        QVERIFY(summary == "summary1");
+        //The view points into the buffer
+        QVERIFY(summary.data() > data.data() && summary.data() < data.data() + data.size());
+        QCOMPARE(mapper.getBytes(mapper.propertyId("attachment"), buffer).size(), 100);
+        //Properties are only available with their own type
+        QVERIFY(mapper.getStringView(mapper.propertyId("attachment"), buffer).isNull());
+        qint64 value = 0;
+        QVERIFY(!mapper.getInteger(mapper.propertyId("summary"), buffer, value));
+
+        flatbuffers::FlatBufferBuilder metadataFbb;
+        auto metadataBuilder = Akonadi2::MetadataBuilder(metadataFbb);
+        metadataBuilder.add_revision(42);
+        Akonadi2::FinishMetadataBuffer(metadataFbb, metadataBuilder.Finish());
+        PropertyMapper<Akonadi2::Metadata> metadataMapper;
+        metadataMapper.setProperties(s_metadataProperties);
+        QVERIFY(metadataMapper.getInteger(0, Akonadi2::GetMetadata(metadataFbb.GetBufferPointer()), value));
+        QCOMPARE(value, qint64(42));
+        QCOMPARE(metadataMapper.getProperty("revision", Akonadi2::GetMetadata(metadataFbb.GetBufferPointer())).toLongLong(), qint64(42));
+    }
+
+    void testGeneratedAdaptor()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "uid1");
+        event.setProperty("summary", "summary1");
+        event.setProperty("attachment", QByteArray(100, 'a'));
+
+        flatbuffers::FlatBufferBuilder resourceFbb;
+        DummyCalendar::FinishDummyEventBuffer(resourceFbb, createDummyEventResourceBuffer(resourceFbb, event));
+        flatbuffers::FlatBufferBuilder localFbb;
+        Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, createDummyEventLocalBuffer(localFbb, event));
+        auto resourceBuffer = DummyCalendar::GetDummyEvent(resourceFbb.GetBufferPointer());
+        auto localBuffer = Akonadi2::Domain::Buffer::GetEvent(localFbb.GetBufferPointer());
+        //Properties mapped in the resource buffer are only written there
+        QVERIFY(resourceBuffer->summary());
+        QVERIFY(!localBuffer->summary());
+        QVERIFY(!resourceBuffer->description());
+
+        DummyEventView view(localBuffer, resourceBuffer);
+        QVERIFY(view.uid() == "uid1");
+        QVERIFY(view.summary() == "summary1");
+        QCOMPARE(view.attachment().size(), 100);
+        QVERIFY(view.description().isNull());
+
+        DummyEventAdaptor adaptor;
+        adaptor.mLocalBuffer = localBuffer;
+        adaptor.mLocalMapper = QSharedPointer<PropertyMapper<EventBuffer> >::create();
+        adaptor.mLocalMapper->setProperties(DummyEventLocalProperties);
+        adaptor.mResourceBuffer = resourceBuffer;
+        adaptor.mResourceMapper = QSharedPointer<PropertyMapper<DummyCalendar::DummyEvent> >::create();
+        adaptor.mResourceMapper->setProperties(DummyEventResourceProperties);
+        QCOMPARE(adaptor.getProperty("uid").toString(), QString("uid1"));
+        QCOMPARE(adaptor.getProperty("summary").toString(), QString("summary1"));
+        QCOMPARE(adaptor.getBytes("attachment").size(), 100);
+    }
+
+    void testPropertyAccess_data()
+    {
+        QTest::addColumn<QString>("access");
+
+        QTest::newRow("hashed std::function") << "function";
+        QTest::newRow("property name") << "name";
+        QTest::newRow("property id") << "id";
+    }
+
+    void testPropertyAccess()
+    {
+        QFETCH(QString, access);
+        const auto data = createEventBuffer();
+        auto buffer = Akonadi2::Domain::Buffer::GetEvent(data.data());
+
+        //The accessors as they were registered before properties could be declared in a table
+        PropertyMapper<EventBuffer> functionMapper;
+        functionMapper.mReadAccessors.insert("summary", [](EventBuffer const *buffer) -> QVariant {
+            if (buffer->summary()) {
+                return QString::fromStdString(buffer->summary()->c_str());
+            }
+            return QVariant();
+        });
+        functionMapper.mReadAccessors.insert("description", [](EventBuffer const *buffer) -> QVariant {
+            if (buffer->description()) {
+                return QString::fromStdString(buffer->description()->c_str());
+            }
+            return QVariant();
+        });
+        PropertyMapper<EventBuffer> mapper;
+        mapper.setProperties(s_eventProperties);
+        //Resolved once, like when a query is prepared
+        const int summaryId = mapper.propertyId("summary");
+        const int descriptionId = mapper.propertyId("description");
+
+        const int count = 10000;
+        int size = 0;
+        QBENCHMARK {
+            for (int i = 0; i < count; i++) {
+                if (access == "function") {
+                    size += functionMapper.getProperty("summary", buffer).toString().size();
+                    size += functionMapper.getProperty("description", buffer).toString().size();
+                } else if (access == "name") {
+                    size += mapper.getProperty("summary", buffer).toString().size();
+                    size += mapper.getProperty("description", buffer).toString().size();
+                } else {
+                    size += mapper.getProperty(summaryId, buffer).toString().size();
+                    size += mapper.getProperty(descriptionId, buffer).toString().size();
+                }
+            }
+        }
+        QVERIFY(size > 0);
+    }
+
 };
 
 QTEST_MAIN(DomainAdaptorTest)
@@ -3,9 +3,14 @@
 #include <QString>
 
 #include "dummyresource/resourcefactory.h"
+#include "dummyresource/domainadaptor.h"
 #include "clientapi.h"
 #include "commands.h"
 #include "entitybuffer.h"
+#include "builderpool.h"
+#include "pipeline.h"
+#include "createentity_generated.h"
+#include "hawd/dataset.h"
 
 static void removeFromDisk(const QString &name)
 {
@@ -25,6 +30,7 @@ private Q_SLOTS:
         removeFromDisk("org.kde.dummy.userqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.blobs");
     }
 
     void cleanup()
@@ -33,6 +39,7 @@ private Q_SLOTS:
         removeFromDisk("org.kde.dummy.userqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.blobs");
     }
 
     void testWriteToFacadeAndQueryByUid()
@@ -79,6 +86,104 @@ private Q_SLOTS:
         qDebug() << "All processed: " << allProcessedTime << "/sec " << num*1000/allProcessedTime;
         qDebug() << "Query Time: " << time.elapsed() << "/sec " << num*1000/time.elapsed();
     }
+
+    void testCreateAll()
+    {
+        const int num = 10000;
+        QList<Akonadi2::Domain::Event> events;
+        for (int i = 0; i < num; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", "testuid");
+            event.setProperty("summary", "summaryValue");
+            events << event;
+        }
+
+        //One round trip per entity
+        QTime time;
+        time.start();
+        for (const auto &event : events) {
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+        const auto sequentialTime = qMax(time.elapsed(), 1);
+
+        //All commands are sent before waiting for the acknowledgements
+        time.start();
+        auto job = Akonadi2::Store::createAll<Akonadi2::Domain::Event>(events, "org.kde.dummy");
+        auto future = job.exec();
+        future.waitForFinished();
+        QVERIFY(!future.errorCode());
+        const auto pipelinedTime = qMax(time.elapsed(), 1);
+
+        //Ensure everything is processed
+        {
+            Akonadi2::Query query;
+            query.resources << "org.kde.dummy";
+            query.syncOnDemand = false;
+            query.processAll = true;
+
+            query.propertyFilter.insert("uid", "testuid");
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 2 * num);
+        }
+
+        const qreal sequential = qreal(num) * 1000 / sequentialTime;
+        const qreal pipelined = qreal(num) * 1000 / pipelinedTime;
+        qDebug() << "Enqueued one by one[ms]: " << sequentialTime << "/sec " << sequential;
+        qDebug() << "Enqueued all at once[ms]: " << pipelinedTime << "/sec " << pipelined;
+
+        HAWD::Dataset dataset("facade_enqueue", m_hawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("entities", num);
+        row.setValue("sequential", sequential);
+        row.setValue("pipelined", pipelined);
+        dataset.insertRow(row);
+    }
+
+    void testProcessCommand()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        event.setProperty("summary", "summaryValue");
+
+        Akonadi2::Pipeline pipeline("org.kde.dummy");
+        DummyResource resource;
+        resource.configurePipeline(&pipeline);
+        DummyEventAdaptorFactory factory;
+
+        //The command is built and processed in this thread, so the statistics cover both
+        Akonadi2::BuilderPool::resetStatistics();
+        QTime time;
+        time.start();
+        const int num = 10000;
+        for (int i = 0; i < num; i++) {
+            Akonadi2::BuilderPool::Builder fbb;
+            auto delta = factory.createBuffer(event, *fbb);
+            auto type = fbb->CreateString("event");
+            Akonadi2::Commands::FinishCreateEntityBuffer(*fbb, Akonadi2::Commands::CreateCreateEntity(*fbb, type, delta));
+            const QByteArray command = QByteArray::fromRawData(reinterpret_cast<const char *>(fbb->GetBufferPointer()), fbb->GetSize());
+            resource.processCommand(Akonadi2::Commands::CreateEntityCommand, command, command.size(), &pipeline);
+        }
+        QTRY_COMPARE_WITH_TIMEOUT(pipeline.storage().maxRevision(), qint64(num), 60000);
+        const auto duration = time.elapsed();
+        const auto statistics = Akonadi2::BuilderPool::statistics();
+
+        const qreal allocations = qreal(statistics.allocations) / num;
+        const qreal createdBuilders = qreal(statistics.createdBuilders) / num;
+        qDebug() << "Processed " << num << " entities[ms]: " << duration;
+        qDebug() << "Buffer allocations per entity: " << allocations << "created builders per entity: " << createdBuilders;
+
+        HAWD::Dataset dataset("pipeline_allocations", m_hawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("entities", num);
+        row.setValue("time", duration);
+        row.setValue("allocations", allocations);
+        row.setValue("createdBuilders", createdBuilders);
+        dataset.insertRow(row);
+    }
+
+private:
+    HAWD::State m_hawdState;
 };
 
 QTEST_MAIN(DummyResourceBenchmark)
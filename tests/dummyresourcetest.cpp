@@ -8,9 +8,14 @@
 #include "metadata_generated.h"
 #include "createentity_generated.h"
 #include "dummyresource/resourcefactory.h"
+#include "dummyresource/domainadaptor.h"
 #include "clientapi.h"
 #include "commands.h"
 #include "entitybuffer.h"
+#include "snapshot.h"
+#include "querycache.h"
+#include "blobstore.h"
+#include "index.h"
 
 static void removeFromDisk(const QString &name)
 {
@@ -30,6 +35,7 @@ private Q_SLOTS:
         removeFromDisk("org.kde.dummy.userqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.blobs");
     }
 
     void cleanup()
@@ -39,6 +45,7 @@ private Q_SLOTS:
         removeFromDisk("org.kde.dummy.userqueue");
         removeFromDisk("org.kde.dummy.synchronizerqueue");
         removeFromDisk("org.kde.dummy.index.uid");
+        removeFromDisk("org.kde.dummy.blobs");
         auto factory = Akonadi2::ResourceFactory::load("org.kde.dummy");
         QVERIFY(factory);
     }
@@ -96,6 +103,41 @@ private Q_SLOTS:
         QCOMPARE(revisionSpy.count(), 2);
     }
 
+    void testCreateBuffer()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        event.setProperty("summary", "summaryValue");
+
+        DummyEventAdaptorFactory factory;
+        flatbuffers::FlatBufferBuilder fbb;
+        auto delta = factory.createBuffer(event, fbb);
+        auto type = fbb.CreateString("event");
+        Akonadi2::Commands::FinishCreateEntityBuffer(fbb, Akonadi2::Commands::CreateCreateEntity(fbb, type, delta));
+        {
+            flatbuffers::Verifier verifyer(fbb.GetBufferPointer(), fbb.GetSize());
+            QVERIFY(Akonadi2::Commands::VerifyCreateEntityBuffer(verifyer));
+        }
+
+        //The nested buffers are built in place, but have to be valid on their own
+        auto command = Akonadi2::Commands::GetCreateEntity(fbb.GetBufferPointer());
+        const QByteArray entityData(reinterpret_cast<const char *>(command->delta()->Data()), command->delta()->size());
+        Akonadi2::EntityBuffer buffer((void*)entityData.data(), entityData.size());
+        QVERIFY(DummyEventAdaptorFactory::verify(buffer.entity()));
+        //So the nested buffers can be read in place
+        QVERIFY((buffer.entity().resource()->Data() - reinterpret_cast<const uint8_t *>(entityData.data())) % Akonadi2::EntityBuffer::bufferAlignment == 0);
+        QVERIFY((buffer.entity().local()->Data() - reinterpret_cast<const uint8_t *>(entityData.data())) % Akonadi2::EntityBuffer::bufferAlignment == 0);
+        const QByteArray resourceData(reinterpret_cast<const char *>(buffer.entity().resource()->Data()), buffer.entity().resource()->size());
+        {
+            flatbuffers::Verifier verifyer(reinterpret_cast<const uint8_t *>(resourceData.data()), resourceData.size());
+            QVERIFY(DummyCalendar::VerifyDummyEventBuffer(verifyer));
+        }
+
+        auto adaptor = factory.createAdaptor(buffer.entity());
+        QCOMPARE(adaptor->getProperty("uid").toString(), QString("testuid"));
+        QCOMPARE(adaptor->getProperty("summary").toString(), QString("summaryValue"));
+    }
+
     void testProperty()
     {
         Akonadi2::Domain::Event event;
@@ -124,6 +166,734 @@ private Q_SLOTS:
         QCOMPARE(value->getProperty("uid").toByteArray(), QByteArray("testuid"));
     }
 
+    void testUidIndexFollowsModificationsAndRemovals()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("uid", "testuid");
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            auto modified = result.first();
+            modified->setProperty("uid", "testuid3");
+            Akonadi2::Store::modify<Akonadi2::Domain::Event>(*modified, "org.kde.dummy");
+        }
+
+        auto lookup = [](const QByteArray &uid) {
+            QList<QByteArray> keys;
+            Index uidIndex(Akonadi2::Store::storageLocation(), "org.kde.dummy.index.uid");
+            uidIndex.lookup(uid, [&keys](const QByteArray &key) {
+                keys << key;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+            return keys;
+        };
+
+        query.propertyFilter.insert("uid", "testuid3");
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        QCOMPARE(lookup("testuid").size(), 0);
+        QCOMPARE(lookup("testuid3"), QList<QByteArray>() << result.first()->identifier().toUtf8());
+
+        Akonadi2::Store::remove<Akonadi2::Domain::Event>(*result.first(), "org.kde.dummy");
+        //The removal is processed before the query is executed
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> afterRemoval(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        afterRemoval.exec();
+        QCOMPARE(afterRemoval.size(), 0);
+        QCOMPARE(lookup("testuid3").size(), 0);
+    }
+
+    void testWriteToFacadeAndQueryById()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        QString identifier;
+        {
+            Akonadi2::Query query;
+            query.resources << "org.kde.dummy";
+            query.syncOnDemand = false;
+            query.processAll = true;
+
+            query.propertyFilter.insert("uid", "testuid");
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            identifier = result.first()->identifier();
+            QVERIFY(!identifier.isEmpty());
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = false;
+
+        query.ids << identifier << "nonexistantid";
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        QCOMPARE(result.first()->identifier(), identifier);
+        QCOMPARE(result.first()->getProperty("uid").toByteArray(), QByteArray("testuid"));
+    }
+
+    void testCreateAll()
+    {
+        QList<Akonadi2::Domain::Event> events;
+        for (int i = 0; i < 3; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", "testuid");
+            event.setProperty("summary", QString("summary%1").arg(i));
+            events << event;
+        }
+        auto job = Akonadi2::Store::createAll<Akonadi2::Domain::Event>(events, "org.kde.dummy");
+        auto future = job.exec();
+        future.waitForFinished();
+        QVERIFY(!future.errorCode());
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        query.propertyFilter.insert("uid", "testuid");
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 3);
+    }
+
+    void testLargeAttachment()
+    {
+        const QByteArray attachment(Akonadi2::BlobStore::threshold, 'a');
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        event.setProperty("attachment", attachment);
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        query.propertyFilter.insert("uid", "testuid");
+        query.requestedProperties << "attachment" << "attachmentRef";
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        //The entity only holds the reference, the attachment is read from the blob store
+        const QByteArray reference = result.first()->getProperty("attachmentRef").toByteArray();
+        QCOMPARE(reference, Akonadi2::BlobStore::reference(attachment.constData(), attachment.size()));
+        QCOMPARE(result.first()->getProperty("attachment").toByteArray(), attachment);
+        QCOMPARE(Akonadi2::BlobStore(Akonadi2::Store::storageLocation(), "org.kde.dummy").referenceCount(reference), qint64(1));
+    }
+
+    void testDeduplicatedAttachments()
+    {
+        const QByteArray attachment(Akonadi2::BlobStore::threshold, 'a');
+        const QByteArray reference = Akonadi2::BlobStore::reference(attachment.constData(), attachment.size());
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        event.setProperty("attachment", attachment);
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        event.setProperty("uid", "testuid2");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("uid", "testuid");
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            //Both entities reference the same blob
+            Akonadi2::BlobStore blobs(Akonadi2::Store::storageLocation(), "org.kde.dummy");
+            QCOMPARE(blobs.referenceCount(reference), qint64(2));
+            const auto statistics = blobs.statistics();
+            QCOMPARE(statistics.blobs, qint64(1));
+            QCOMPARE(statistics.savedBytes(), qint64(attachment.size()));
+
+            Akonadi2::Store::remove<Akonadi2::Domain::Event>(*result.first(), "org.kde.dummy");
+        }
+
+        query.propertyFilter.insert("uid", "testuid2");
+        query.requestedProperties << "uid" << "summary" << "attachment";
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            QCOMPARE(Akonadi2::BlobStore(Akonadi2::Store::storageLocation(), "org.kde.dummy").referenceCount(reference), qint64(1));
+
+            //The unchanged attachment keeps its reference
+            auto modified = result.first();
+            modified->setProperty("summary", "summaryValue");
+            Akonadi2::Store::modify<Akonadi2::Domain::Event>(*modified, "org.kde.dummy");
+        }
+
+        query.requestedProperties << "attachmentRef";
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        QCOMPARE(result.first()->getProperty("summary").toString(), QString("summaryValue"));
+        QCOMPARE(result.first()->getProperty("attachmentRef").toByteArray(), reference);
+        QCOMPARE(result.first()->getProperty("attachment").toByteArray(), attachment);
+        QCOMPARE(Akonadi2::BlobStore(Akonadi2::Store::storageLocation(), "org.kde.dummy").referenceCount(reference), qint64(1));
+    }
+
+    void testQueryRequestedProperties()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        query.propertyFilter.insert("uid", "testuid");
+        query.requestedProperties << "summary";
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        auto value = result.first();
+        QCOMPARE(value->getProperty("summary").toString(), QString("summaryValue"));
+        //Not requested, so not loaded
+        QVERIFY(!value->getProperty("uid").isValid());
+    }
+
+    void testLazyQuery()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "testuid");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.lazyLoading = true;
+
+        query.propertyFilter.insert("uid", "testuid");
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        //The result is still reading from the storage
+        QVERIFY(Akonadi2::Snapshot::openSnapshots() > 0);
+        auto value = result.first();
+        QCOMPARE(value->getProperty("summary").toString(), QString("summaryValue"));
+        QCOMPARE(value->getProperty("uid").toByteArray(), QByteArray("testuid"));
+    }
+
+    void testPagination()
+    {
+        for (int i = 0; i < 3; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", QString("pageuid%1").arg(i));
+            event.setProperty("summary", "page");
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("summary", "page");
+        query.limit = 2;
+
+        QSet<QString> identifiers;
+        {
+            auto emitter = Akonadi2::Store::load<Akonadi2::Domain::Event>(query);
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(emitter);
+            result.exec();
+            QCOMPARE(result.size(), 2);
+            for (const auto &value : result) {
+                identifiers << value->identifier();
+            }
+            query.continuation = emitter->continuation();
+            QVERIFY(!query.continuation.isEmpty());
+        }
+
+        //The next page continues where the first one stopped
+        query.syncOnDemand = false;
+        query.processAll = false;
+        auto emitter = Akonadi2::Store::load<Akonadi2::Domain::Event>(query);
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(emitter);
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        QVERIFY(!identifiers.contains(result.first()->identifier()));
+        QVERIFY(emitter->continuation().isEmpty());
+    }
+
+    void testLastPageWithNonMatchingEntities()
+    {
+        for (int i = 0; i < 2; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", QString("pageuid%1").arg(i));
+            event.setProperty("summary", "page");
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+        //Entities that don't match are scanned as well, whichever order the keys end up in
+        for (int i = 0; i < 5; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", QString("otheruid%1").arg(i));
+            event.setProperty("summary", "other");
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("summary", "page");
+        query.limit = 2;
+
+        //All matching entities fit into the page, so there is no next page
+        auto emitter = Akonadi2::Store::load<Akonadi2::Domain::Event>(query);
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(emitter);
+        result.exec();
+        QCOMPARE(result.size(), 2);
+        QVERIFY(emitter->continuation().isEmpty());
+    }
+
+    void testSortedQuery()
+    {
+        for (const auto &summary : QStringList() << "b" << "a" << "c") {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", summary);
+            event.setProperty("summary", summary);
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.limit = 2;
+        query.sortProperty = "summary";
+        query.sortDescending = true;
+
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 2);
+        QCOMPARE(result.at(0)->getProperty("summary").toString(), QString("c"));
+        QCOMPARE(result.at(1)->getProperty("summary").toString(), QString("b"));
+    }
+
+    void testContinuedSortedQuery()
+    {
+        for (int i = 0; i < 3; i++) {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", QString("pageuid%1").arg(i));
+            event.setProperty("summary", "page");
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.limit = 2;
+        {
+            auto emitter = Akonadi2::Store::load<Akonadi2::Domain::Event>(query);
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(emitter);
+            result.exec();
+            QCOMPARE(result.size(), 2);
+            query.continuation = emitter->continuation();
+            QVERIFY(!query.continuation.isEmpty());
+        }
+
+        //The facade fails instead of returning the first page again
+        query.sortProperty = "summary";
+        query.processAll = false;
+        auto facade = Akonadi2::FacadeFactory::instance().getFacade<Akonadi2::Domain::Event>("org.kde.dummy");
+        QVERIFY(facade);
+        int results = 0;
+        auto future = facade->load(query, [&results](const Akonadi2::Domain::Event::Ptr &) {
+            results++;
+        },
+        [](const Akonadi2::ResumePoint &) {}).exec();
+        future.waitForFinished();
+        QVERIFY(future.errorCode());
+        QCOMPARE(results, 0);
+
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 0);
+    }
+
+    void testSortedQueryWithoutLimit()
+    {
+        for (const auto &summary : QStringList() << "b" << "a" << "c") {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", summary);
+            event.setProperty("summary", summary);
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.sortProperty = "summary";
+        query.sortDescending = true;
+
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 3);
+        QCOMPARE(result.at(0)->getProperty("summary").toString(), QString("c"));
+        QCOMPARE(result.at(1)->getProperty("summary").toString(), QString("b"));
+        QCOMPARE(result.at(2)->getProperty("summary").toString(), QString("a"));
+    }
+
+    void testUnsupportedSortProperty()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "sortuid");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.limit = 2;
+        query.sortProperty = "attachment";
+
+        //The facade fails instead of returning the results in key order
+        auto facade = Akonadi2::FacadeFactory::instance().getFacade<Akonadi2::Domain::Event>("org.kde.dummy");
+        QVERIFY(facade);
+        int results = 0;
+        auto future = facade->load(query, [&results](const Akonadi2::Domain::Event::Ptr &) {
+            results++;
+        },
+        [](const Akonadi2::ResumePoint &) {}).exec();
+        future.waitForFinished();
+        QVERIFY(future.errorCode());
+        QCOMPARE(results, 0);
+    }
+
+    void testSortedLazyQueryOnCompressedValues()
+    {
+        //Large enough to be compressed, so the values are decompressed into a buffer that is reused
+        const QString description = QString("description ").repeated(100);
+        for (const auto &summary : QStringList() << "b" << "a" << "c") {
+            Akonadi2::Domain::Event event;
+            event.setProperty("uid", summary);
+            event.setProperty("summary", summary);
+            event.setProperty("description", summary + description);
+            Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        }
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.lazyLoading = true;
+        query.limit = 2;
+        query.sortProperty = "summary";
+        query.requestedProperties << "summary" << "description";
+
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 2);
+        //The properties are read after the query released its buffers
+        QCOMPARE(result.at(0)->getProperty("summary").toString(), QString("a"));
+        QCOMPARE(result.at(0)->getProperty("description").toString(), "a" + description);
+        QCOMPARE(result.at(1)->getProperty("summary").toString(), QString("b"));
+        QCOMPARE(result.at(1)->getProperty("description").toString(), "b" + description);
+    }
+
+    void testPinnedQuery()
+    {
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "pinneduid1");
+        event.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+        }
+
+        auto snapshot = Akonadi2::Store::openSnapshot("org.kde.dummy");
+        QVERIFY(snapshot);
+
+        Akonadi2::Domain::Event other;
+        other.setProperty("uid", "pinneduid2");
+        other.setProperty("summary", "summaryValue");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(other, "org.kde.dummy");
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 2);
+        }
+
+        //The pinned query doesn't see the entity that was created after the snapshot
+        query.processAll = false;
+        query.snapshots.insert("org.kde.dummy", snapshot);
+        auto emitter = Akonadi2::Store::load<Akonadi2::Domain::Event>(query);
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(emitter);
+        result.exec();
+        QCOMPARE(result.size(), 1);
+        QCOMPARE(result.first()->getProperty("uid").toByteArray(), QByteArray("pinneduid1"));
+        QCOMPARE(emitter->revision("org.kde.dummy"), snapshot->revision());
+    }
+
+    void testQueryCache()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "cacheduid");
+        event.setProperty("summary", "cachedSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("summary", "cachedSummary");
+
+        auto cache = Akonadi2::QueryCache::forResource("org.kde.dummy");
+        cache->clear();
+        cache->resetStatistics();
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+        }
+        QCOMPARE(cache->statistics().misses, qint64(1));
+
+        //The same query at the same revision is answered from the cache
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            QCOMPARE(result.first()->getProperty("uid").toByteArray(), QByteArray("cacheduid"));
+        }
+        QCOMPARE(cache->statistics().hits, qint64(1));
+
+        //A new revision patches the cached keys instead of scanning again
+        Akonadi2::Domain::Event other;
+        other.setProperty("uid", "othercacheduid");
+        other.setProperty("summary", "cachedSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(other, "org.kde.dummy");
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 2);
+        }
+        QCOMPARE(cache->statistics().patchedHits, qint64(1));
+    }
+
+    void testQueryCacheById()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "cacheduid");
+        event.setProperty("summary", "cachedSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("summary", "cachedSummary");
+
+        auto cache = Akonadi2::QueryCache::forResource("org.kde.dummy");
+        cache->clear();
+        cache->resetStatistics();
+        QString identifier;
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            identifier = result.first()->identifier();
+        }
+
+        query.ids << identifier;
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+        }
+
+        //An entity that matches the filter, but not the id, doesn't end up in the patched result
+        Akonadi2::Domain::Event other;
+        other.setProperty("uid", "othercacheduid");
+        other.setProperty("summary", "cachedSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(other, "org.kde.dummy");
+        {
+            async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+            result.exec();
+            QCOMPARE(result.size(), 1);
+            QCOMPARE(result.first()->identifier(), identifier);
+        }
+        QCOMPARE(cache->statistics().patchedHits, qint64(1));
+    }
+
+    void testLiveQuery()
+    {
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.liveQuery = true;
+        query.propertyFilter.insert("summary", "liveSummary");
+
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 0);
+
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "liveuid");
+        event.setProperty("summary", "liveSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        //The new entity is added to the result set once the resource processed it
+        QTRY_COMPARE(result.size(), 1);
+        QCOMPARE(result.first()->getProperty("uid").toByteArray(), QByteArray("liveuid"));
+    }
+
+    //Loads the only entity with @param uid
+    static Akonadi2::Domain::Event::Ptr loadByUid(const QByteArray &uid)
+    {
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.propertyFilter.insert("uid", uid);
+        query.requestedProperties << "uid" << "summary";
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        return result.size() == 1 ? result.first() : Akonadi2::Domain::Event::Ptr();
+    }
+
+    void testLiveQueryChanges()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "liveuid");
+        event.setProperty("summary", "liveSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        event.setProperty("uid", "otheruid");
+        event.setProperty("summary", "otherSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        event.setProperty("uid", "unrelateduid");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.liveQuery = true;
+        query.propertyFilter.insert("summary", "liveSummary");
+
+        auto emitter = Akonadi2::Store::load<Akonadi2::Domain::Event>(query);
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(emitter);
+        QStringList modified;
+        QStringList removed;
+        emitter->onModified([&modified](const Akonadi2::Domain::Event::Ptr &value) {
+            modified << value->identifier();
+        });
+        emitter->onRemoved([&removed](const Akonadi2::Domain::Event::Ptr &value) {
+            //A removed entity has no properties left, but reading them must be safe
+            QVERIFY(!value->getProperty("summary").isValid());
+            removed << value->identifier();
+        });
+        result.exec();
+        QCOMPARE(result.size(), 1);
+
+        //An entity that starts matching is added, not modified
+        auto other = loadByUid("otheruid");
+        QVERIFY(other);
+        other->setProperty("summary", "liveSummary");
+        Akonadi2::Store::modify<Akonadi2::Domain::Event>(*other, "org.kde.dummy");
+        QTRY_COMPARE(result.size(), 2);
+        QVERIFY(modified.isEmpty());
+
+        //Removing an entity that never matched is not reported
+        auto unrelated = loadByUid("unrelateduid");
+        QVERIFY(unrelated);
+        Akonadi2::Store::remove<Akonadi2::Domain::Event>(*unrelated, "org.kde.dummy");
+        //An entity that no longer matches is removed
+        other = loadByUid("otheruid");
+        QVERIFY(other);
+        other->setProperty("summary", "otherSummary");
+        Akonadi2::Store::modify<Akonadi2::Domain::Event>(*other, "org.kde.dummy");
+        QTRY_COMPARE(removed.size(), 1);
+        QCOMPARE(removed.first(), other->identifier());
+        QVERIFY(modified.isEmpty());
+    }
+
+    void testLoadChangesAfterCompaction()
+    {
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "liveuid");
+        event.setProperty("summary", "liveSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        QVERIFY(loadByUid("liveuid"));
+
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.propertyFilter.insert("summary", "liveSummary");
+        auto facade = Akonadi2::FacadeFactory::instance().getFacade<Akonadi2::Domain::Event>("org.kde.dummy");
+        QVERIFY(facade);
+        auto loadChanges = [&]() {
+            auto future = facade->loadChanges(query, 0, [](const Akonadi2::Domain::Event::Ptr &) {},
+                                              [](const QByteArray &, qint64) {},
+                                              [](qint64) {}).exec();
+            future.waitForFinished();
+            return future.errorCode();
+        };
+        QCOMPARE(loadChanges(), 0);
+
+        //The change since revision 0 is gone, so the caller has to reload instead of missing it
+        {
+            Akonadi2::Storage storage(Akonadi2::Store::storageLocation(), "org.kde.dummy", Akonadi2::Storage::ReadWrite);
+            storage.removeChangesBefore(storage.maxRevision() + 1);
+        }
+        QCOMPARE(loadChanges(), Akonadi2::ChangesIncompleteError);
+    }
+
+    void testLiveQueryWithLimit()
+    {
+        Akonadi2::Query query;
+        query.resources << "org.kde.dummy";
+        query.syncOnDemand = false;
+        query.processAll = true;
+        query.liveQuery = true;
+        query.limit = 1;
+        query.propertyFilter.insert("summary", "liveSummary");
+
+        async::SyncListResult<Akonadi2::Domain::Event::Ptr> result(Akonadi2::Store::load<Akonadi2::Domain::Event>(query));
+        result.exec();
+        QCOMPARE(result.size(), 0);
+
+        Akonadi2::Domain::Event event;
+        event.setProperty("uid", "liveuid");
+        event.setProperty("summary", "liveSummary");
+        Akonadi2::Store::create<Akonadi2::Domain::Event>(event, "org.kde.dummy");
+        QVERIFY(loadByUid("liveuid"));
+        //Limited queries are not kept up to date
+        QTest::qWait(100);
+        QCOMPARE(result.size(), 0);
+    }
+
     void testResourceSync()
     {
         Akonadi2::Pipeline pipeline("org.kde.dummy");
@@ -55,6 +55,44 @@ private Q_SLOTS:
             QCOMPARE(values.size(), 0);
         }
     }
+
+    void testRemove()
+    {
+        Index index(Akonadi2::Store::storageLocation(), "org.kde.dummy.testindex", Akonadi2::Storage::ReadWrite);
+        index.add("key1", "value1");
+        index.add("key1", "value2");
+        index.add("key2", "value3");
+
+        //Only the given value is removed, the other values of the key remain
+        index.remove("key1", "value1");
+        {
+            QList<QByteArray> values;
+            index.lookup(QByteArray("key1"), [&values](const QByteArray &value) {
+                values << value;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+            QCOMPARE(values, QList<QByteArray>() << "value2");
+        }
+
+        //A removed key doesn't return the values of the next key
+        index.remove("key1", "value2");
+        {
+            QList<QByteArray> values;
+            index.lookup(QByteArray("key1"), [&values](const QByteArray &value) {
+                values << value;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+            QCOMPARE(values.size(), 0);
+        }
+        {
+            QList<QByteArray> values;
+            index.lookup(QByteArray("key2"), [&values](const QByteArray &value) {
+                values << value;
+            },
+            [](const Index::Error &error){ qWarning() << "Error: "; });
+            QCOMPARE(values.size(), 1);
+        }
+    }
 };
 
 QTEST_MAIN(IndexTest)
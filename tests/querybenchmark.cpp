@@ -0,0 +1,259 @@
+#include <QtTest>
+
+#include <QString>
+#include <QTime>
+
+#include "dummyresource/domainadaptor.h"
+#include "hawd/dataset.h"
+#include "common/storage.h"
+#include "common/entitybuffer.h"
+#include "common/topk.h"
+#include "dummycalendar_generated.h"
+#include "event_generated.h"
+#include "entity_generated.h"
+#include "metadata_generated.h"
+
+/**
+ * Measures full scans over entities as the facade executes them.
+ */
+class QueryBenchmark : public QObject
+{
+    Q_OBJECT
+private:
+    //This should point to a directory on disk and not a ramdisk (since we're measuring performance)
+    QString testDataPath;
+    QString dbName;
+    const int count = 1000000;
+    //Every matchInterval'th entity matches the filter
+    const int matchInterval = 100;
+
+    void populate()
+    {
+        Akonadi2::Storage storage(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        flatbuffers::FlatBufferBuilder metadataFbb;
+        flatbuffers::FlatBufferBuilder resourceFbb;
+        flatbuffers::FlatBufferBuilder localFbb;
+        flatbuffers::FlatBufferBuilder entityFbb;
+        for (int i = 0; i < count; i++) {
+            if (i % 10000 == 0) {
+                if (i > 0) {
+                    storage.commitTransaction();
+                }
+                storage.startTransaction();
+            }
+
+            metadataFbb.Clear();
+            {
+                auto builder = Akonadi2::MetadataBuilder(metadataFbb);
+                builder.add_revision(i);
+                builder.add_processed(true);
+                Akonadi2::FinishMetadataBuffer(metadataFbb, builder.Finish());
+            }
+
+            resourceFbb.Clear();
+            {
+                auto summary = resourceFbb.CreateString("summary" + std::to_string(i % 1000));
+                auto builder = DummyCalendar::DummyEventBuilder(resourceFbb);
+                builder.add_summary(summary);
+                DummyCalendar::FinishDummyEventBuffer(resourceFbb, builder.Finish());
+            }
+
+            localFbb.Clear();
+            {
+                auto uid = localFbb.CreateString(i % matchInterval ? "uid" + std::to_string(i) : std::string("testuid"));
+                auto builder = Akonadi2::Domain::Buffer::EventBuilder(localFbb);
+                builder.add_uid(uid);
+                Akonadi2::Domain::Buffer::FinishEventBuffer(localFbb, builder.Finish());
+            }
+
+            entityFbb.Clear();
+            Akonadi2::EntityBuffer::assembleEntityBuffer(entityFbb, metadataFbb.GetBufferPointer(), metadataFbb.GetSize(), resourceFbb.GetBufferPointer(), resourceFbb.GetSize(), localFbb.GetBufferPointer(), localFbb.GetSize());
+            const std::string key = "key" + std::to_string(i);
+            storage.write(key.data(), key.size(), entityFbb.GetBufferPointer(), entityFbb.GetSize());
+        }
+        storage.commitTransaction();
+    }
+
+    /*
+     * Extracts the buffers like the facade does and returns the number of entities accepted by the matcher.
+     *
+     * @param finish is called while the transaction is still open, so the scanned buffers are still valid.
+     * @param verify verifies the buffers, as the facade does for a storage that is not trusted.
+     */
+    int scan(const std::function<bool(const Akonadi2::Entity &entity, Akonadi2::Domain::Buffer::Event const *local, DummyCalendar::DummyEvent const *resource)> &matcher,
+             const std::function<void()> &finish = std::function<void()>(), bool verify = true)
+    {
+        int hits = 0;
+        Akonadi2::Storage storage(testDataPath, dbName);
+        storage.startTransaction(Akonadi2::Storage::ReadOnly);
+        storage.scan("", [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            if (Akonadi2::Storage::isInternalKey(keyValue, keySize)) {
+                return true;
+            }
+            Akonadi2::EntityBuffer buffer(dataValue, dataSize, verify);
+            auto resourceBuffer = Akonadi2::EntityBuffer::readBuffer(buffer.entity().resource(), &DummyCalendar::VerifyDummyEventBuffer, &DummyCalendar::GetDummyEvent, verify);
+            auto localBuffer = Akonadi2::EntityBuffer::readBuffer(buffer.entity().local(), &Akonadi2::Domain::Buffer::VerifyEventBuffer, &Akonadi2::Domain::Buffer::GetEvent, verify);
+
+            if (matcher(buffer.entity(), localBuffer, resourceBuffer)) {
+                hits++;
+            }
+            return true;
+        });
+        if (finish) {
+            finish();
+        }
+        return hits;
+    }
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        testDataPath = "./testdb";
+        dbName = "querybenchmark";
+        Akonadi2::Storage storage(testDataPath, dbName);
+        storage.removeFromDisk();
+        populate();
+    }
+
+    void cleanupTestCase()
+    {
+        Akonadi2::Storage storage(testDataPath, dbName);
+        storage.removeFromDisk();
+    }
+
+    void testFilteredScan()
+    {
+        DummyEventAdaptorFactory factory;
+        QHash<QString, QVariant> propertyFilter;
+        propertyFilter.insert("uid", "testuid");
+
+        QTime time;
+        time.start();
+        {
+            const auto predicate = factory.createPredicate(propertyFilter);
+            const int hits = scan([&predicate](const Akonadi2::Entity &, Akonadi2::Domain::Buffer::Event const *local, DummyCalendar::DummyEvent const *resource) {
+                return predicate.matches(local, resource);
+            });
+            QCOMPARE(hits, count / matchInterval);
+        }
+        const qreal predicateDuration = time.restart();
+        const qreal predicateOpsPerMs = count / predicateDuration;
+        qDebug() << "Scan with compiled predicate took[ms]: " << predicateDuration << "->" << predicateOpsPerMs << "ops/ms";
+
+        {
+            //The property based path, through the adaptor and QVariant
+            const QByteArray uid = propertyFilter.value("uid").toByteArray();
+            const int hits = scan([&factory, &uid](const Akonadi2::Entity &entity, Akonadi2::Domain::Buffer::Event const *, DummyCalendar::DummyEvent const *) {
+                return factory.createAdaptor(entity)->getProperty("uid").toByteArray() == uid;
+            });
+            QCOMPARE(hits, count / matchInterval);
+        }
+        const qreal adaptorDuration = time.restart();
+        const qreal adaptorOpsPerMs = count / adaptorDuration;
+        qDebug() << "Scan with buffer adaptor took[ms]: " << adaptorDuration << "->" << adaptorOpsPerMs << "ops/ms";
+
+        HAWD::Dataset dataset("query_filter", m_hawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("rows", count);
+        row.setValue("predicate", predicateDuration);
+        row.setValue("predicateOps", predicateOpsPerMs);
+        row.setValue("adaptor", adaptorDuration);
+        row.setValue("adaptorOps", adaptorOpsPerMs);
+        dataset.insertRow(row);
+    }
+
+    void testTopK()
+    {
+        typedef QuerySortField<Akonadi2::Domain::Buffer::Event, DummyCalendar::DummyEvent> SortField;
+        const int k = 100;
+        DummyEventAdaptorFactory factory;
+        const QStringList properties = QStringList() << "summary";
+
+        QTime time;
+        time.start();
+        {
+            //The sort values point into the storage, only the final k entities are materialized
+            const auto sortField = factory.createSortField("summary");
+            typedef QPair<flatbuffers::String const *, const Akonadi2::Entity *> Candidate;
+            TopK<Candidate> topK(k, [](const Candidate &left, const Candidate &right) {
+                return SortField::lessThan(right.first, left.first);
+            });
+            QList<Akonadi2::Domain::Event::Ptr> results;
+            scan([&](const Akonadi2::Entity &entity, Akonadi2::Domain::Buffer::Event const *local, DummyCalendar::DummyEvent const *resource) {
+                topK.add(qMakePair(sortField.value(local, resource), &entity));
+                return true;
+            },
+            [&]() {
+                for (const auto &candidate : topK.takeSorted()) {
+                    auto adaptor = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create(*factory.createAdaptor(*candidate.second), properties);
+                    results << QSharedPointer<Akonadi2::Domain::Event>::create("org.kde.dummy", QString(), 0, adaptor);
+                }
+            });
+            QCOMPARE(results.size(), k);
+            QCOMPARE(results.first()->getProperty("summary").toString(), QString("summary999"));
+        }
+        const qreal heapDuration = time.restart();
+        qDebug() << "Top " << k << " with bounded heap took[ms]: " << heapDuration;
+
+        {
+            //Materialize everything and sort afterwards, as a client would have to
+            QList<Akonadi2::Domain::Event::Ptr> results;
+            scan([&](const Akonadi2::Entity &entity, Akonadi2::Domain::Buffer::Event const *, DummyCalendar::DummyEvent const *) {
+                auto adaptor = QSharedPointer<Akonadi2::Domain::MemoryBufferAdaptor>::create(*factory.createAdaptor(entity), properties);
+                results << QSharedPointer<Akonadi2::Domain::Event>::create("org.kde.dummy", QString(), 0, adaptor);
+                return true;
+            });
+            std::sort(results.begin(), results.end(), [](const Akonadi2::Domain::Event::Ptr &left, const Akonadi2::Domain::Event::Ptr &right) {
+                return left->getProperty("summary").toString() > right->getProperty("summary").toString();
+            });
+            results = results.mid(0, k);
+            QCOMPARE(results.size(), k);
+            QCOMPARE(results.first()->getProperty("summary").toString(), QString("summary999"));
+        }
+        const qreal materializedDuration = time.restart();
+        qDebug() << "Top " << k << " with full materialization took[ms]: " << materializedDuration;
+
+        HAWD::Dataset dataset("query_topk", m_hawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("rows", count);
+        row.setValue("k", k);
+        row.setValue("heap", heapDuration);
+        row.setValue("materialized", materializedDuration);
+        dataset.insertRow(row);
+    }
+
+    void testVerification()
+    {
+        DummyEventAdaptorFactory factory;
+        QHash<QString, QVariant> propertyFilter;
+        propertyFilter.insert("uid", "testuid");
+        const auto predicate = factory.createPredicate(propertyFilter);
+        const auto matcher = [&predicate](const Akonadi2::Entity &, Akonadi2::Domain::Buffer::Event const *local, DummyCalendar::DummyEvent const *resource) {
+            return predicate.matches(local, resource);
+        };
+
+        QTime time;
+        time.start();
+        QCOMPARE(scan(matcher, std::function<void()>(), true), count / matchInterval);
+        const qreal verifiedDuration = time.restart();
+        qDebug() << "Scan with verification took[ms]: " << verifiedDuration;
+
+        //Buffers of a trusted storage were verified when they were written
+        QCOMPARE(scan(matcher, std::function<void()>(), false), count / matchInterval);
+        const qreal trustedDuration = time.restart();
+        qDebug() << "Scan without verification took[ms]: " << trustedDuration;
+
+        HAWD::Dataset dataset("query_verification", m_hawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("rows", count);
+        row.setValue("verified", verifiedDuration);
+        row.setValue("trusted", trustedDuration);
+        dataset.insertRow(row);
+    }
+
+private:
+    HAWD::State m_hawdState;
+};
+
+QTEST_MAIN(QueryBenchmark)
+#include "querybenchmark.moc"
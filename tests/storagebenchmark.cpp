@@ -4,9 +4,12 @@
 
 #include "hawd/dataset.h"
 #include "common/storage.h"
+#include "common/checksum.h"
+#include "common/compression.h"
 
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include <QDebug>
 #include <QString>
@@ -36,6 +39,39 @@ static std::string createEvent()
     return std::string(reinterpret_cast<const char *>(fbb.GetBufferPointer()), fbb.GetSize());
 }
 
+//An event with a text description of about @param descriptionSize bytes, which compresses like real descriptions do
+static std::string createDescribedEvent(int seed, int descriptionSize)
+{
+    static const char *words[] = { "meeting", "project", "review", "the", "with", "team", "agenda", "notes",
+                                   "please", "bring", "quarterly", "budget", "and", "room", "call", "dial-in" };
+    std::string description;
+    quint32 state = seed * 2654435761u + 1;
+    while (description.size() < size_t(descriptionSize)) {
+        state = state * 1103515245 + 12345;
+        description += words[(state >> 16) % 16];
+        description += ' ';
+    }
+
+    FlatBufferBuilder fbb;
+    auto summary = fbb.CreateString("summary " + std::to_string(seed));
+    auto descriptionString = fbb.CreateString(description);
+    Calendar::EventBuilder eventBuilder(fbb);
+    eventBuilder.add_summary(summary);
+    eventBuilder.add_description(descriptionString);
+    Calendar::FinishEventBuffer(fbb, eventBuilder.Finish());
+    return std::string(reinterpret_cast<const char *>(fbb.GetBufferPointer()), fbb.GetSize());
+}
+
+static qint64 writeEvents(Akonadi2::Storage &store, const std::vector<std::string> &events)
+{
+    store.startTransaction();
+    for (size_t i = 0; i < events.size(); i++) {
+        store.write("key" + std::to_string(i), events[i]);
+    }
+    store.commitTransaction();
+    return store.diskUsage();
+}
+
 // static void readEvent(const std::string &data)
 // {
 //     auto readEvent = GetEvent(data.c_str());
@@ -201,6 +237,153 @@ private Q_SLOTS:
         qDebug() << "Creating buffers took[ms]: " << bufferDuration << "->" << opsPerMs << "ops/ms";
     }
 
+    void testChecksumThroughput()
+    {
+        const int size = 64 * 1024 * 1024;
+        const int iterations = 10;
+        QByteArray data(size, 0);
+        for (int i = 0; i < size; i++) {
+            data[i] = char(i * 31);
+        }
+
+        QTime time;
+        time.start();
+        quint32 checksum = 0;
+        for (int i = 0; i < iterations; i++) {
+            checksum = Akonadi2::Checksum::crc32c(data.constData(), data.size(), checksum);
+        }
+        const qreal checksumDuration = time.restart();
+
+        quint32 portableChecksum = 0;
+        for (int i = 0; i < iterations; i++) {
+            portableChecksum = Akonadi2::Checksum::crc32cPortable(data.constData(), data.size(), portableChecksum);
+        }
+        const qreal portableDuration = time.restart();
+        QCOMPARE(checksum, portableChecksum);
+
+        //Bytes per ms are 1e-6 GB/s
+        const qreal bytes = qreal(size) * iterations;
+        const qreal throughput = bytes / qMax(checksumDuration, qreal(1)) / 1e6;
+        const qreal portableThroughput = bytes / qMax(portableDuration, qreal(1)) / 1e6;
+        qDebug() << "CRC32C throughput[GB/s]: " << throughput << "hardware accelerated: " << Akonadi2::Checksum::isHardwareAccelerated();
+        qDebug() << "Portable CRC32C throughput[GB/s]: " << portableThroughput;
+
+        HAWD::Dataset dataset("checksum_throughput", m_hawdState);
+        HAWD::Dataset::Row row = dataset.row();
+        row.setValue("size", size / (1024 * 1024));
+        row.setValue("checksum", throughput);
+        row.setValue("portable", portableThroughput);
+        dataset.insertRow(row);
+    }
+
+    void testCompression_data()
+    {
+        QTest::addColumn<int>("descriptionSize");
+
+        //Small values are only compressed with a dictionary
+        QTest::newRow("small") << 100;
+        QTest::newRow("large") << 4096;
+    }
+
+    void testCompression()
+    {
+        QFETCH(int, descriptionSize);
+        const int values = 10000;
+
+        std::vector<std::string> events;
+        qint64 size = 0;
+        for (int i = 0; i < values; i++) {
+            events.push_back(createDescribedEvent(i, descriptionSize));
+            size += events.back().size();
+        }
+        //A few values that are not part of the measured ones make up the dictionary
+        QByteArray dictionary;
+        for (int i = 0; i < 8; i++) {
+            const std::string sample = createDescribedEvent(values + i, descriptionSize);
+            dictionary += QByteArray(sample.data(), sample.size());
+        }
+
+        QTime time;
+        time.start();
+        std::vector<std::string> encodedEvents;
+        qint64 encodedSize = 0;
+        for (const auto &event : events) {
+            const void *encoded;
+            size_t encodedEventSize;
+            Akonadi2::Compression::encode(event.data(), event.size(), QByteArray(), encoded, encodedEventSize);
+            encodedEvents.push_back(std::string(static_cast<const char*>(encoded), encodedEventSize));
+            encodedSize += encodedEventSize;
+        }
+        const qreal compressDuration = time.restart();
+
+        for (const auto &encoded : encodedEvents) {
+            void *data;
+            size_t dataSize;
+            QVERIFY(Akonadi2::Compression::decode(encoded.data(), encoded.size(), [](quint32) { return QByteArray(); }, data, dataSize));
+        }
+        const qreal decompressDuration = time.restart();
+
+        qint64 dictionarySize = 0;
+        for (const auto &event : events) {
+            const void *encoded;
+            size_t encodedEventSize;
+            Akonadi2::Compression::encode(event.data(), event.size(), dictionary, encoded, encodedEventSize);
+            dictionarySize += encodedEventSize;
+        }
+
+        qint64 uncompressedDiskUsage;
+        {
+            Akonadi2::Storage store(testDataPath, dbName + ".uncompressed", Akonadi2::Storage::ReadWrite);
+            uncompressedDiskUsage = writeEvents(store, events);
+            store.removeFromDisk();
+        }
+
+        Akonadi2::Storage store(testDataPath, dbName + ".compressed", Akonadi2::Storage::ReadWrite);
+        QVERIFY(store.enableCompression());
+        store.setCompressionDictionary(dictionary);
+        time.start();
+        const qint64 compressedDiskUsage = writeEvents(store, events);
+        const qreal writeDuration = time.restart();
+        store.startTransaction(Akonadi2::Storage::ReadOnly);
+        int read = 0;
+        for (int i = 0; i < values; i++) {
+            store.read("key" + std::to_string(i), [&](void *data, int dataSize) -> bool {
+                read += dataSize == int(events[i].size());
+                return false;
+            });
+        }
+        store.abortTransaction();
+        const qreal readDuration = time.restart();
+        QCOMPARE(read, values);
+        store.removeFromDisk();
+
+        //Bytes per ms are 1e-3 MB/s
+        const qreal ratio = qreal(size) / encodedSize;
+        const qreal dictionaryRatio = qreal(size) / dictionarySize;
+        const qreal diskRatio = qreal(uncompressedDiskUsage) / qMax(compressedDiskUsage, qint64(1));
+        const qreal compressThroughput = size / qMax(compressDuration, qreal(1)) / 1e3;
+        const qreal decompressThroughput = size / qMax(decompressDuration, qreal(1)) / 1e3;
+        qDebug() << "Compression ratio: " << ratio << "with dictionary: " << dictionaryRatio << "on disk: " << diskRatio;
+        qDebug() << "Compression throughput[MB/s]: " << compressThroughput << "decompression: " << decompressThroughput;
+
+        HAWD::Dataset ratioDataset("compression_ratio", m_hawdState);
+        HAWD::Dataset::Row ratioRow = ratioDataset.row();
+        ratioRow.setValue("descriptionSize", descriptionSize);
+        ratioRow.setValue("ratio", ratio);
+        ratioRow.setValue("dictionaryRatio", dictionaryRatio);
+        ratioRow.setValue("diskRatio", diskRatio);
+        ratioDataset.insertRow(ratioRow);
+
+        HAWD::Dataset throughputDataset("compression_throughput", m_hawdState);
+        HAWD::Dataset::Row throughputRow = throughputDataset.row();
+        throughputRow.setValue("descriptionSize", descriptionSize);
+        throughputRow.setValue("compress", compressThroughput);
+        throughputRow.setValue("decompress", decompressThroughput);
+        throughputRow.setValue("write", values / qMax(writeDuration, qreal(1)));
+        throughputRow.setValue("read", values / qMax(readDuration, qreal(1)));
+        throughputDataset.insertRow(throughputRow);
+    }
+
     void testSizes()
     {
         Akonadi2::Storage store(testDataPath, dbName);
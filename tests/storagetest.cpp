@@ -7,6 +7,8 @@
 #include <QtConcurrent/QtConcurrentRun>
 
 #include "common/storage.h"
+#include "common/blobstore.h"
+#include "common/compression.h"
 
 class StorageTest : public QObject
 {
@@ -67,6 +69,8 @@ private Q_SLOTS:
     {
         Akonadi2::Storage storage(testDataPath, dbName);
         storage.removeFromDisk();
+        Akonadi2::Storage blobs(testDataPath, dbName + ".blobs");
+        blobs.removeFromDisk();
     }
 
     void testCleanup()
@@ -128,6 +132,260 @@ private Q_SLOTS:
         }
     }
 
+    void testMultiKeyLookup()
+    {
+        const int count = 100;
+        populate(count);
+
+        QVector<QByteArray> keys;
+        keys << "key70" << "key5" << "nonexistant" << "key5" << "key31";
+        QList<QByteArray> results;
+        bool gotError = false;
+        Akonadi2::Storage store(testDataPath, dbName);
+        store.scan(keys, [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            const QByteArray key(static_cast<char*>(keyValue), keySize);
+            if (QByteArray(static_cast<char*>(dataValue), dataSize) != key) {
+                qDebug() << "Mismatch while reading";
+                gotError = true;
+            }
+            results << key;
+            return true;
+        },
+        [&](const Akonadi2::Storage::Error &) {
+            gotError = true;
+        });
+        QVERIFY(!gotError);
+        //Keys are returned in key order, duplicates and missing keys are skipped
+        QCOMPARE(results, QList<QByteArray>() << "key31" << "key5" << "key70");
+    }
+
+    void testScanFrom()
+    {
+        const int count = 100;
+        populate(count);
+
+        QList<QByteArray> results;
+        bool gotError = false;
+        Akonadi2::Storage store(testDataPath, dbName);
+        store.scanFrom("key95", [&](void *keyValue, int keySize, void *dataValue, int dataSize) -> bool {
+            results << QByteArray(static_cast<char*>(keyValue), keySize);
+            return results.size() < 3;
+        },
+        [&](const Akonadi2::Storage::Error &) {
+            gotError = true;
+        });
+        QVERIFY(!gotError);
+        //Starts at the given key and stops once the handler returns false
+        QCOMPARE(results, QList<QByteArray>() << "key95" << "key96" << "key97");
+    }
+
+    void testChangelog()
+    {
+        populate(3);
+        Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        store.recordChange(1, Akonadi2::Storage::EntityCreated, "key1");
+        store.recordChange(2, Akonadi2::Storage::EntityModified, "key1");
+        store.recordChange(3, Akonadi2::Storage::EntityRemoved, "key2");
+
+        QList<qint64> revisions;
+        QList<Akonadi2::Storage::ChangeType> types;
+        QList<QByteArray> keys;
+        store.readChanges(1, [&](qint64 revision, Akonadi2::Storage::ChangeType type, const QByteArray &key) -> bool {
+            revisions << revision;
+            types << type;
+            keys << key;
+            return true;
+        });
+        //Only the changes after the given revision are read, in revision order
+        QCOMPARE(revisions, QList<qint64>() << 2 << 3);
+        QCOMPARE(types, QList<Akonadi2::Storage::ChangeType>() << Akonadi2::Storage::EntityModified << Akonadi2::Storage::EntityRemoved);
+        QCOMPARE(keys, QList<QByteArray>() << "key1" << "key2");
+    }
+
+    void testChangelogCompaction()
+    {
+        populate(1);
+        Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        QCOMPARE(store.oldestChange(), qint64(-1));
+        for (int revision = 1; revision <= 10; revision++) {
+            QVERIFY(store.recordChange(revision, Akonadi2::Storage::EntityCreated, "key" + QByteArray::number(revision)));
+        }
+        //The changelog is append only
+        QVERIFY(!store.recordChange(5, Akonadi2::Storage::EntityModified, "key5"));
+
+        store.removeChangesBefore(8);
+        QCOMPARE(store.oldestChange(), qint64(8));
+
+        QList<qint64> revisions;
+        store.readChanges(0, [&](qint64 revision, Akonadi2::Storage::ChangeType, const QByteArray &) -> bool {
+            revisions << revision;
+            return true;
+        });
+        QCOMPARE(revisions, QList<qint64>() << 8 << 9 << 10);
+    }
+
+    void testScrub()
+    {
+        {
+            Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+            store.setChecksumsEnabled(true);
+            store.write("key1", "value1");
+            store.write("key2", "value2");
+            store.write("key3", "value3");
+            store.remove("key3", 4);
+        }
+
+        QList<QByteArray> corruptKeys;
+        const auto corruptKeyHandler = [&corruptKeys](const QByteArray &key) -> bool {
+            corruptKeys << key;
+            return true;
+        };
+        {
+            Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadOnly);
+            QCOMPARE(store.scrub(corruptKeyHandler), qint64(0));
+        }
+
+        //A write that bypasses the checksum leaves a mismatching checksum behind, just like a corrupted value
+        {
+            Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+            store.write("key2", "corrupt");
+        }
+        Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadOnly);
+        QCOMPARE(store.scrub(corruptKeyHandler), qint64(1));
+        QCOMPARE(corruptKeys, QList<QByteArray>() << "key2");
+    }
+
+    void testCompression()
+    {
+        const std::string large(Akonadi2::Compression::threshold * 4, 'a');
+        const std::string small("small");
+        const QByteArray dictionary("a dictionary with what the values have in common");
+        //Too small to be compressed without the dictionary
+        const std::string medium = "with what the values have in common, with what the values have in common, with what they have";
+        {
+            Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+            store.setChecksumsEnabled(true);
+            QVERIFY(store.enableCompression());
+            store.setCompressionDictionary(dictionary);
+            store.write("large", large);
+            store.write("small", small);
+            store.write("medium", medium);
+        }
+
+        //A reader finds out on its own that the values are compressed, and which dictionary they need
+        Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadOnly);
+        QVERIFY(store.isCompressed());
+        const auto readValue = [&store](const std::string &key, bool transient) -> std::string {
+            std::string result;
+            store.read(key, [&result, transient](void *data, int size) -> bool {
+                result = std::string(static_cast<char*>(data), size);
+                //Only compressed values are decompressed into the buffer of the thread
+                if (Akonadi2::Storage::isTransient(data) != transient) {
+                    result.clear();
+                }
+                return false;
+            });
+            return result;
+        };
+        QCOMPARE(readValue("large", true), large);
+        QCOMPARE(readValue("small", false), small);
+        QCOMPARE(readValue("medium", true), medium);
+        QCOMPARE(store.maxRevision(), qint64(0));
+        //The checksums cover the stored values
+        QCOMPARE(store.scrub([](const QByteArray &) -> bool { return true; }), qint64(0));
+    }
+
+    void testEnableCompressionOnPopulatedStorage()
+    {
+        populate(1);
+        Akonadi2::Storage store(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        //The existing value has no header, so the storage can't be switched anymore
+        QVERIFY(!store.enableCompression());
+        QVERIFY(!store.isCompressed());
+        QVERIFY(verify(store, 0));
+    }
+
+    void testBlobStore()
+    {
+        const QByteArray data(Akonadi2::BlobStore::threshold, 'a');
+        Akonadi2::BlobStore blobs(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        //The same content is stored once, and referenced twice
+        const QByteArray reference = blobs.add(data.constData(), data.size());
+        QCOMPARE(blobs.add(data.constData(), data.size()), reference);
+        QCOMPARE(blobs.referenceCount(reference), qint64(2));
+        QCOMPARE(blobs.read(reference), data);
+
+        blobs.release(reference);
+        QCOMPARE(blobs.collectGarbage(), qint64(0));
+        QCOMPARE(blobs.read(reference), data);
+
+        blobs.release(reference);
+        QCOMPARE(blobs.referenceCount(reference), qint64(0));
+        QCOMPARE(blobs.collectGarbage(), qint64(1));
+        QVERIFY(blobs.read(reference).isNull());
+    }
+
+    void testBlobStoreCreatedLater()
+    {
+        const QByteArray data(Akonadi2::BlobStore::threshold, 'a');
+        //The reader is opened before the store exists
+        Akonadi2::BlobStore reader(testDataPath, dbName);
+        QVERIFY(reader.read(Akonadi2::BlobStore::reference(data.constData(), data.size())).isNull());
+
+        Akonadi2::BlobStore writer(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        const QByteArray reference = writer.add(data.constData(), data.size());
+        QCOMPARE(reader.read(reference), data);
+    }
+
+    void testBlobStoreConcurrentRead()
+    {
+        const QByteArray data(Akonadi2::BlobStore::threshold, 'a');
+        Akonadi2::BlobStore writer(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        const QByteArray reference = writer.add(data.constData(), data.size());
+
+        //The adaptors of a resource share a blob store, which is read from the query threads
+        Akonadi2::BlobStore reader(testDataPath, dbName);
+        QList<QFuture<bool> > futures;
+        for (int i = 0; i < 4; i++) {
+            futures << QtConcurrent::run([&reader, &reference, &data]() -> bool {
+                for (int j = 0; j < 100; j++) {
+                    if (reader.read(reference) != data) {
+                        return false;
+                    }
+                }
+                return true;
+            });
+        }
+        for (auto &future : futures) {
+            QVERIFY(future.result());
+        }
+    }
+
+    void testBlobStoreStatistics()
+    {
+        const QByteArray data(Akonadi2::BlobStore::threshold, 'a');
+        const QByteArray other(Akonadi2::BlobStore::threshold * 2, 'b');
+        Akonadi2::BlobStore blobs(testDataPath, dbName, Akonadi2::Storage::ReadWrite);
+        blobs.add(data.constData(), data.size());
+        blobs.add(data.constData(), data.size());
+        blobs.add(data.constData(), data.size());
+        const QByteArray reference = blobs.add(other.constData(), other.size());
+
+        auto statistics = blobs.statistics();
+        QCOMPARE(statistics.blobs, qint64(2));
+        QCOMPARE(statistics.references, qint64(4));
+        QCOMPARE(statistics.storedBytes, qint64(data.size() + other.size()));
+        QCOMPARE(statistics.savedBytes(), qint64(2 * data.size()));
+        QVERIFY(blobs.diskUsage() > 0);
+
+        //Blobs without references don't count as referenced until they are collected
+        blobs.release(reference);
+        statistics = blobs.statistics();
+        QCOMPARE(statistics.blobs, qint64(2));
+        QCOMPARE(statistics.references, qint64(3));
+        QCOMPARE(statistics.referencedBytes, qint64(3 * data.size()));
+    }
+
     void testTurnReadToWrite()
     {
         populate(3);